@@ -15,6 +15,8 @@
 	Implementation Notes: 
 	1. Creating context from device type is not yet supported (clCreateContextFromType)
 	2. Command queues can be created using the devices used for creating context.
+	3. Platforms and devices are discovered lazily on the first CLPlatform::getAllPlatforms() call,
+	   not during static initialization. CLPlatform::setDiscoveryFilter can limit it to one platform or device type.
 */
 #ifndef _OPENCLPP_H_
 #define _OPENCLPP_H_
@@ -24,6 +26,9 @@
 #else
     #include <CL/opencl.h>
 #endif 
+#include <iosfwd>
+#include <new>
+#include <type_traits>
 
 #define MAX_CLPLATFORM_NAME_LEN 128
 #define MAX_CLPLATFORM_PROFILE_LEN 128
@@ -32,12 +37,32 @@
 #define MAX_CLPLATFORM_EXTENSIONS_LEN 1024
 #define MAX_CLPLATFORM_ICD_SUFFIX_LEN 16
 #define MAX_DEVICE_NAME 128
+#define MAX_DEVICE_VENDOR_LEN 128
+#define MAX_DEVICE_VERSION_LEN 128
+#define MAX_DEVICE_DRIVER_VERSION_LEN 128
+#define MAX_CLSNAPSHOT_PATH_LEN 1024
+#define MAX_CLPROFILE_NAME_LEN 64
+#define MAX_CLBINARY_CACHE_PATH_LEN 1024
+#define MAX_CLBUNDLE_PROGRAM_NAME_LEN 128
+#define MAX_CLTUNING_DB_PATH_LEN 1024
+#define MAX_CLTUNING_CANDIDATES 32
+#define CLLAUNCH_TARGET_GROUP_SIZE 256
+#define CLSORT_HOST_THRESHOLD 16384
+#define CLGEMM_NUM_TILINGS 7
+#define CLBATCHED_DOT_UNROLL_MAX 32
+#define CLPROFILE_HISTOGRAM_BUCKETS 496
+#define MAX_CLPIPELINE_STREAMS 16
 
 class CLDevice;
 class CLContext;
 class CLCommandQueue;
 class CLProgram;
 class CLKernel;
+class CLEvent;
+class CLProfiler;
+class CLMemPool;
+class CLDependencyTracker;
+template <typename T> class CLMappedView;
 
 // Initial implementations. Change later to impl pattern for binary compatibility
 class CLPlatform {
@@ -55,15 +80,40 @@ private:
 
 	// static data members
 	static CLPlatform* g_allPlatforms;
+	static bool g_discovered;
+	static cl_device_type g_discoveryDevType;
+	static char g_discoveryPlatformName[MAX_CLPLATFORM_NAME_LEN];
+	static char g_snapshotPath[MAX_CLSNAPSHOT_PATH_LEN];
 
 	// constructor: private
-	CLPlatform(cl_platform_id);
-	// static library initializer to initialize static data members.
+	CLPlatform(cl_platform_id, cl_device_type devType = CL_DEVICE_TYPE_ALL);
+	// library initializer to initialize static data members. Called once, on first use.
 	static cl_uint initLib();
+	// Attribute snapshot: load validates it against the live handles, save rewrites it after a live discovery
+	static bool loadSnapshot(const char *path, const cl_platform_id *ids, cl_uint numPlatforms);
+	static void saveSnapshot(const char *path, cl_uint numPlatforms);
 
 public:
+	// Valid after the first call to getAllPlatforms() or numPlatforms()
 	static cl_uint g_numPlatforms;
+	// Discovers the platforms and devices on first call (thread-safe), returns the cached array afterwards
 	static const CLPlatform *getAllPlatforms();
+	static cl_uint numPlatforms();
+	// Restricts discovery to the platforms whose name contains platformName (NULL for all)
+	// and to devices of type devType. Must be called before the first getAllPlatforms(),
+	// returns false if discovery has already happened.
+	static bool setDiscoveryFilter(cl_device_type devType, const char *platformName = NULL);
+	// Opt-in on-disk snapshot of the platform and device attributes (env OPENCLPP_SNAPSHOT if not set).
+	// When the ICD suffix, platform version, device names and driver versions still match the live
+	// platforms, the attributes are loaded from it and only the handles are queried; otherwise it is rewritten.
+	// Must be called before the first getAllPlatforms(), returns false if discovery has already happened.
+	static bool setSnapshotFile(const char *path);
+	// Device selection across all platforms for a workload profile (or'ed CLDevice::WorkloadProfile values).
+	// Devices whose memory cannot hold workingSetBytes are excluded.
+	static const CLDevice *bestDevice(int profile, cl_ulong workingSetBytes = 0, cl_device_type devType = CL_DEVICE_TYPE_ALL);
+	// Fills ranked with up to maxDevices suitable devices, best first, and returns their count
+	static cl_uint rankDevices(int profile, const CLDevice **ranked, cl_uint maxDevices,
+		cl_ulong workingSetBytes = 0, cl_device_type devType = CL_DEVICE_TYPE_ALL);
 
 	CLDevice *devices() const { return _devices; }
 
@@ -78,15 +128,62 @@ public:
 };
 
 class CLDevice {
+public:
+	// Workload profiles for device ranking, can be or'ed together
+	enum WorkloadProfile {
+		BANDWIDTH_BOUND = 1,      // limited by global memory bandwidth
+		COMPUTE_BOUND = 2,        // limited by arithmetic throughput
+		DOUBLE_HEAVY = 4,         // compute bound in double precision, implies REQUIRES_DOUBLE
+		REQUIRES_DOUBLE = 8       // excludes the devices without double support
+	};
 private:
 	cl_device_id _id;
 	char _name[MAX_DEVICE_NAME];
+	char _vendor[MAX_DEVICE_VENDOR_LEN];
+	char _version[MAX_DEVICE_VERSION_LEN];
+	char _driverVersion[MAX_DEVICE_DRIVER_VERSION_LEN];
 	cl_uint _numComputeUnits;          // Number of compute units (SM's on NV GPU)
 	cl_uint _maxWorkGroupSize;         // Max work group size
 	cl_uint _maxWorkItemSizes[3];      // Max work item sizes
 	cl_device_type _devType;
 	cl_uint _nativeDoubleSupport;
 	cl_uint _preferredDoubleSupport;
+	cl_uint _maxClockFrequency;        // MHz
+	// Memory
+	cl_ulong _globalMemSize;
+	cl_ulong _localMemSize;
+	cl_device_local_mem_type _localMemType;
+	cl_ulong _maxConstantBufferSize;
+	cl_ulong _maxMemAllocSize;
+	cl_uint _globalMemCacheLineSize;
+	cl_ulong _globalMemCacheSize;
+	cl_uint _memBaseAddrAlign;         // bits
+	cl_bool _hostUnifiedMemory;
+	// Vector widths
+	cl_uint _preferredVectorWidthChar;
+	cl_uint _preferredVectorWidthShort;
+	cl_uint _preferredVectorWidthInt;
+	cl_uint _preferredVectorWidthLong;
+	cl_uint _preferredVectorWidthFloat;
+	cl_uint _preferredVectorWidthHalf;
+	cl_uint _nativeVectorWidthChar;
+	cl_uint _nativeVectorWidthShort;
+	cl_uint _nativeVectorWidthInt;
+	cl_uint _nativeVectorWidthLong;
+	cl_uint _nativeVectorWidthFloat;
+	cl_uint _nativeVectorWidthHalf;
+	// Queues and profiling
+	cl_command_queue_properties _queueProperties;
+	size_t _profilingTimerResolution;  // ns
+	cl_ulong _profilingTimerOffsetAMD;
+	// cl_nv_device_attribute_query, 0 on other devices
+	cl_uint _computeCapabilityMajorNV;
+	cl_uint _computeCapabilityMinorNV;
+	cl_uint _registersPerBlockNV;
+	cl_uint _warpSizeNV;
+	cl_bool _gpuOverlapNV;
+	cl_bool _kernelExecTimeoutNV;
+	cl_bool _integratedMemoryNV;
 
 	CLDevice(cl_device_id);
 public:
@@ -94,6 +191,9 @@ public:
 	cl_uint maxWorkGroupSize() const { return _maxWorkGroupSize; }
 	const cl_uint *maxWorkItemSizes() const { return _maxWorkItemSizes; }
 	const char *name() const { return _name; }
+	const char *vendor() const { return _vendor; }
+	const char *version() const { return _version; }
+	const char *driverVersion() const { return _driverVersion; }
 	cl_device_id id() const { return _id; }
 	bool isGpu() const { return (_devType & CL_DEVICE_TYPE_GPU) ? true : false; }
 	bool isCpu() const { return (_devType & CL_DEVICE_TYPE_CPU)  ? true : false; }
@@ -101,6 +201,50 @@ public:
 	cl_device_type devType() const { return _devType; }
 	cl_uint nativeDoubleSupport() const { return _nativeDoubleSupport; }
 	cl_uint preferredDoubleSupport() const { return _preferredDoubleSupport; }
+	cl_uint maxClockFrequency() const { return _maxClockFrequency; }
+
+	cl_ulong globalMemSize() const { return _globalMemSize; }
+	cl_ulong localMemSize() const { return _localMemSize; }
+	bool hasDedicatedLocalMem() const { return _localMemType == CL_LOCAL; }
+	cl_ulong maxConstantBufferSize() const { return _maxConstantBufferSize; }
+	cl_ulong maxMemAllocSize() const { return _maxMemAllocSize; }
+	cl_uint globalMemCacheLineSize() const { return _globalMemCacheLineSize; }
+	cl_ulong globalMemCacheSize() const { return _globalMemCacheSize; }
+	cl_uint memBaseAddrAlign() const { return _memBaseAddrAlign; }
+	bool hostUnifiedMemory() const { return _hostUnifiedMemory ? true : false; }
+
+	cl_uint preferredVectorWidthChar() const { return _preferredVectorWidthChar; }
+	cl_uint preferredVectorWidthShort() const { return _preferredVectorWidthShort; }
+	cl_uint preferredVectorWidthInt() const { return _preferredVectorWidthInt; }
+	cl_uint preferredVectorWidthLong() const { return _preferredVectorWidthLong; }
+	cl_uint preferredVectorWidthFloat() const { return _preferredVectorWidthFloat; }
+	cl_uint preferredVectorWidthDouble() const { return _preferredDoubleSupport; }
+	cl_uint preferredVectorWidthHalf() const { return _preferredVectorWidthHalf; }
+	cl_uint nativeVectorWidthChar() const { return _nativeVectorWidthChar; }
+	cl_uint nativeVectorWidthShort() const { return _nativeVectorWidthShort; }
+	cl_uint nativeVectorWidthInt() const { return _nativeVectorWidthInt; }
+	cl_uint nativeVectorWidthLong() const { return _nativeVectorWidthLong; }
+	cl_uint nativeVectorWidthFloat() const { return _nativeVectorWidthFloat; }
+	cl_uint nativeVectorWidthDouble() const { return _nativeDoubleSupport; }
+	cl_uint nativeVectorWidthHalf() const { return _nativeVectorWidthHalf; }
+
+	cl_command_queue_properties queueProperties() const { return _queueProperties; }
+	size_t profilingTimerResolution() const { return _profilingTimerResolution; }
+	cl_ulong profilingTimerOffsetAMD() const { return _profilingTimerOffsetAMD; }
+
+	cl_uint computeCapabilityMajorNV() const { return _computeCapabilityMajorNV; }
+	cl_uint computeCapabilityMinorNV() const { return _computeCapabilityMinorNV; }
+	cl_uint registersPerBlockNV() const { return _registersPerBlockNV; }
+	cl_uint warpSizeNV() const { return _warpSizeNV; }
+	bool gpuOverlapNV() const { return _gpuOverlapNV ? true : false; }
+	bool kernelExecTimeoutNV() const { return _kernelExecTimeoutNV ? true : false; }
+	bool integratedMemoryNV() const { return _integratedMemoryNV ? true : false; }
+
+	// Estimated processing lanes per compute unit (CUDA cores per SM, SIMD lanes per CPU core)
+	cl_uint lanesPerComputeUnit() const;
+	// Relative suitability for the workload profile (or'ed WorkloadProfile values), 0 if unsuitable.
+	// Estimated from the attributes only, comparable between devices but not a throughput figure.
+	double score(int profile, cl_ulong workingSetBytes = 0) const;
 
 	// add CLPlatform as friend class
 	friend class CLPlatform;
@@ -123,12 +267,21 @@ public:
 };
 
 class CLMem {
+public:
+	// How a command accesses the memory object, used for the dependency tracking of out-of-order queues
+	enum Access { READ = 1, WRITE = 2, READ_WRITE = 3 };
 private:
 	cl_mem _id;
 	cl_mem_flags _flags;
 	CLContext *_ctx;
 	size_t _size;
 	void *_hostPtr;
+	cl_ulong _serial;
+protected:
+	cl_int _ciErrNum;
+
+	// Wraps an existing memory object (e.g. a sub-buffer), taking ownership of id
+	CLMem(CLContext *ctx, cl_mem id, cl_mem_flags flags, size_t size);
 public:
 	// Constructor
 	CLMem(CLContext *ctx, cl_mem_flags flags, size_t size, void *hostPtr = NULL);
@@ -139,6 +292,11 @@ public:
 	const CLContext *ctx() const { return _ctx; }
 	size_t size() const { return _size; }
 	void *hostPtr() const { return _hostPtr; }
+	// Unique per memory object wrapper, tells apart wrappers of a cl_mem handle value the driver reused
+	cl_ulong serial() const { return _serial; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+	// Access of a kernel to this memory object according to its flags
+	Access kernelAccess() const;
 };
 
 class CLReadOnlyMem : public CLMem {
@@ -153,6 +311,149 @@ public:
 	virtual ~CLWriteOnlyMem();
 };
 
+// Buffer of count elements of type T. The typed transfers (CLCommandQueue::enqueueWrite/enqueueRead)
+// and kernel arguments count in elements, so byte sizes are computed by the compiler.
+template <typename T>
+class CLBuffer : public CLMem {
+	static_assert(std::is_trivially_copyable<T>::value, "CLBuffer elements must be trivially copyable");
+private:
+	size_t _count;
+public:
+	typedef T value_type;
+
+	CLBuffer(CLContext *ctx, cl_mem_flags flags, size_t count, T *hostPtr = NULL)
+		: CLMem(ctx, flags, count * sizeof(T), hostPtr), _count(count) {}
+	virtual ~CLBuffer() {}
+
+	size_t count() const { return _count; }
+	T *hostPtr() const { return static_cast<T*>(CLMem::hostPtr()); }
+};
+
+// Page-locked host memory: a CL_MEM_ALLOC_HOST_PTR buffer kept mapped for its whole life.
+// The application fills ptr() directly, and transfers from and to it (enqueueWriteBuffer/enqueueReadBuffer
+// of a device buffer with ptr() as host pointer) run at full DMA speed without a driver staging copy.
+// queue is used to map and unmap the buffer and must outlive it.
+class CLPinnedHostBuffer : public CLMem {
+private:
+	CLCommandQueue *_queue;
+	void *_mapped;
+
+	CLPinnedHostBuffer(const CLPinnedHostBuffer &);
+	CLPinnedHostBuffer& operator=(const CLPinnedHostBuffer &);
+public:
+	CLPinnedHostBuffer(CLContext *ctx, CLCommandQueue *queue, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+	virtual ~CLPinnedHostBuffer();
+
+	void *ptr() const { return _mapped; }
+	template <typename T> T *data() const { return static_cast<T*>(_mapped); }
+
+	// Allocation by pointer, for CLPinnedAllocator: returns the mapped pointer of a new pinned buffer
+	// (NULL on failure), release() destroys the buffer owning ptr
+	static void *allocate(CLContext *ctx, CLCommandQueue *queue, size_t size);
+	static void release(void *ptr);
+	// Pinned buffer owning ptr (the start of an allocation), NULL if ptr was not allocated by allocate()
+	static CLPinnedHostBuffer *find(const void *ptr);
+};
+
+// STL allocator handing out pinned host memory, e.g. std::vector<cl_float, CLPinnedAllocator<cl_float> >
+template <typename T>
+class CLPinnedAllocator {
+private:
+	CLContext *_ctx;
+	CLCommandQueue *_queue;
+public:
+	typedef T value_type;
+
+	CLPinnedAllocator(CLContext *ctx, CLCommandQueue *queue) : _ctx(ctx), _queue(queue) {}
+	template <typename U>
+	CLPinnedAllocator(const CLPinnedAllocator<U> &other) : _ctx(other.ctx()), _queue(other.queue()) {}
+
+	T *allocate(size_t n) {
+		void *p = CLPinnedHostBuffer::allocate(_ctx, _queue, n * sizeof(T));
+		if (p == NULL)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+	void deallocate(T *p, size_t) { CLPinnedHostBuffer::release(p); }
+
+	CLContext *ctx() const { return _ctx; }
+	CLCommandQueue *queue() const { return _queue; }
+	template <typename U>
+	bool operator==(const CLPinnedAllocator<U> &other) const { return _ctx == other.ctx() && _queue == other.queue(); }
+	template <typename U>
+	bool operator!=(const CLPinnedAllocator<U> &other) const { return !(*this == other); }
+};
+
+// Buffer handed out by CLMemPool: a sub-buffer of one of the pool's slabs, or a dedicated buffer
+// for sizes the slabs do not serve. Give it back with CLMemPool::free while the pool exists.
+class CLPooledMem : public CLMem {
+private:
+	const CLMemPool *_pool;
+	void *_slab;                       // NULL for dedicated buffers
+	cl_uint _sizeClass;
+
+	CLPooledMem(CLContext *ctx, cl_mem id, cl_mem_flags flags, size_t size, const CLMemPool *pool, void *slab, cl_uint sizeClass);
+
+	friend class CLMemPool;
+public:
+	virtual ~CLPooledMem();
+
+	const CLMemPool *pool() const { return _pool; }
+};
+
+struct CLMemPoolStats {
+	cl_uint slabs;
+	size_t reservedBytes;              // in slabs
+	size_t inUseBytes;                 // handed out, size class granularity, dedicated buffers included
+	size_t peakInUseBytes;
+	size_t freeListBytes;              // sub-buffers waiting for reuse
+	cl_ulong allocs;
+	cl_ulong reused;                   // served from a free list, no driver call
+	cl_ulong subBuffersCreated;
+	cl_ulong dedicatedAllocs;          // larger than the slab size or beyond the high-water mark
+	cl_ulong frees;
+};
+
+// Per-context device memory pool. Reserves large slabs with clCreateBuffer and carves them into
+// power of 2 size classes with clCreateSubBuffer, aligned to the devices' base address alignment.
+// Freed sub-buffers go to a free list per size class and are handed out again as they are, so a
+// steady state allocation is a free-list pop. Thread-safe. The flags may add CL_MEM_ALLOC_HOST_PTR to the
+// access flags (a pinned pool), pools with CL_MEM_USE_HOST_PTR or CL_MEM_COPY_HOST_PTR fail with CL_INVALID_VALUE.
+class CLMemPool {
+private:
+	class Impl;
+	Impl *_impl;
+
+	CLMemPool(const CLMemPool &);
+	CLMemPool& operator=(const CLMemPool &);
+public:
+	CLMemPool(CLContext *ctx, size_t slabSize = 64 << 20, cl_mem_flags flags = CL_MEM_READ_WRITE);
+	~CLMemPool();
+
+	// Buffer of at least size bytes (its size() is the size class), NULL on failure
+	CLPooledMem *alloc(size_t size);
+	// Gives back a buffer alloc returned, buffers of other pools are ignored
+	void free(CLPooledMem *mem);
+	// Maximum bytes reserved in slabs (0, the default, for no limit). Beyond it the pool first
+	// trims, then falls back to dedicated buffers.
+	CLMemPool* setHighWater(size_t bytes);
+	// Releases the slabs none of whose sub-buffers are in use, returns the bytes released
+	size_t trim();
+	CLMemPoolStats stats() const;
+	size_t slabSize() const;
+	size_t alignment() const;
+	cl_int ciErrNum() const;
+};
+
+// OpenCL C source embedded in the executable by tools/clembed, with its #include directives resolved.
+// hash is the 64 bit FNV-1a hash of source, computed at generation time.
+struct CLEmbeddedSource {
+	const char *name;
+	const char *source;
+	size_t length;
+	cl_ulong hash;
+};
+
 class CLProgram {
 private:
 	cl_program _id;
@@ -161,36 +462,395 @@ private:
 	const char **_strings;
 	const size_t *_lengths;
 	cl_int _ciErrNum;
+	bool _fromBinaryCache;
+	bool _fromBundle;
+	// Name of a program created by name, NULL for the strings constructor
+	const char *_name;
+	// Source registered by an embedded source table, NULL for the strings constructor
+	const CLEmbeddedSource *_embedded;
+	cl_ulong _sourceHash;
+	// Completion state of buildAsync()
+	struct BuildState;
+	BuildState *_buildState;
+
+	static char g_binaryCacheDir[MAX_CLBINARY_CACHE_PATH_LEN];
+
+	static const char *binaryCacheDir();
+	// Cache entry key of the program for a device: hash of the sources, the options, the device name and driver version
+	cl_ulong binaryCacheKey(const CLDevice *device, const char *options) const;
+	// Replaces _id with a program built from the cached binaries of all the context's devices, false on any miss
+	bool buildFromBinaryCache(const char *options);
+	void saveToBinaryCache(const char *options);
+	// Replaces _id with a program built from the loaded bundles' binaries of all the context's devices
+	bool buildFromBundle(const char *options);
+	// Synchronous build (binary cache included), returns the error code
+	cl_int buildNow(const char *options);
+	// clBuildProgram with a completion callback, from a pool thread when probe is set
+	void buildWithNotify(bool probe);
+	void buildCompleted(cl_int ciErrNum);
+	static void CL_CALLBACK buildNotify(cl_program, void *userData);
 public:
 	CLProgram(CLContext *ctx, cl_uint count, const char **strings, const size_t *lengths = NULL);
+	// Program from the embedded source registered under name (the .cl file name) or, with no
+	// embedded source, from the binaries of a loaded bundle (see loadBundle). ciErrNum() is
+	// CL_INVALID_VALUE if there is neither. The binary cache keys it by the embedded hash.
+	CLProgram(CLContext *ctx, const char *name);
 	~CLProgram();
 
+	// Registers count embedded sources, called by the static initializer of the files tools/clembed generates
+	static void registerSources(const CLEmbeddedSource *sources, cl_uint count);
+	static const CLEmbeddedSource *findSource(const char *name);
+
+	// Opt-in on-disk cache of the compiled programs (env OPENCLPP_BINARY_CACHE if not set), in an existing
+	// directory shared by all the processes using it. build() then loads the CL_PROGRAM_BINARIES saved by
+	// an earlier build of the same sources and options for the same device and driver version, and falls
+	// back to the source build when an entry is missing, corrupt or rejected by the driver. NULL disables it.
+	static void setBinaryCacheDir(const char *dir);
+	// Maps a bundle written by tools/clprecompile (see CLBundleWriter) into memory, for the lifetime of the
+	// process. build() of a program created by name first looks for its binaries in the loaded bundles
+	// (env OPENCLPP_BUNDLE is loaded on first use): an entry matches the program name, the build options,
+	// the device name and the driver version. Returns false if the file is not a valid bundle.
+	static bool loadBundle(const char *path);
+
+	// Must be called before creating kernels of the program
 	CLProgram* build(const char *options = NULL);
+	// Starts the build and returns at once, wait() or ready() tell when it is done. Independent programs
+	// build concurrently: through the clBuildProgram callback on ICDs which build asynchronously with it,
+	// on a pool of worker threads otherwise (and when the binary cache is enabled). All the context's
+	// devices are built by the one clBuildProgram call, the ICD may compile them in parallel.
+	CLProgram* buildAsync(const char *options = NULL);
+	// Blocks until the pending buildAsync() completes, returns its error code (ciErrNum())
+	cl_int wait();
+	bool ready() const;
+	// Waits for the builds of count programs, returns the first error code
+	static cl_int waitAll(CLProgram **programs, cl_uint count);
 
 	cl_program id() { return _id; }
 	const CLContext *ctx() const { return _ctx; }
+	// Valid once the build completes
+	cl_int ciErrNum() const { return _ciErrNum; }
+	// True if the last build() was served from the binary cache
+	bool fromBinaryCache() const { return _fromBinaryCache; }
+	// True if the last build() used the binaries of a bundle
+	bool fromBundle() const { return _fromBundle; }
+	const char *name() const { return _name; }
+	const CLEmbeddedSource *embeddedSource() const { return _embedded; }
+	// Hash identifying the source: of the source strings, the embedded source's hash, or of the name
+	// for a program built from a bundle only
+	cl_ulong sourceHash() const { return _sourceHash; }
+	// 64 bit FNV-1a hash of the source text, the strings concatenated (the CLEmbeddedSource hash of an
+	// embedded source), 0 for a program built from a bundle only
+	cl_ulong sourceTextHash() const;
+};
+
+// Writes a bundle of program binaries: a versioned file with an entry per program and device, indexed
+// by the program name, the build options and the device name and driver version, with the hash of the
+// source text they were built from. See CLProgram::loadBundle.
+class CLBundleWriter {
+private:
+	class Impl;
+	Impl *_impl;
+
+	CLBundleWriter(const CLBundleWriter &);
+	CLBundleWriter& operator=(const CLBundleWriter &);
+public:
+	CLBundleWriter();
+	~CLBundleWriter();
+
+	// Adds the binaries of a built program for all its devices under name, replacing the entries
+	// of the same name, options and devices. Returns the error code.
+	cl_int add(CLProgram *program, const char *name, const char *options = NULL);
+	cl_uint numEntries() const;
+	// Writes the bundle to a temporary file renamed to path, returns false on an I/O error
+	bool write(const char *path) const;
+};
+
+// Static registration of an embedded source table, see tools/clembed
+struct CLEmbeddedSourceRegistrar {
+	CLEmbeddedSourceRegistrar(const CLEmbeddedSource *sources, cl_uint count) { CLProgram::registerSources(sources, count); }
+};
+
+// Global or local work size of an NDRange launch, dim 0 lets the runtime pick the local size
+class CLNDRange {
+private:
+	cl_uint _dim;
+	size_t _sizes[3];
+public:
+	CLNDRange() : _dim(0) { _sizes[0] = _sizes[1] = _sizes[2] = 1; }
+	CLNDRange(size_t x) : _dim(1) { _sizes[0] = x; _sizes[1] = _sizes[2] = 1; }
+	CLNDRange(size_t x, size_t y) : _dim(2) { _sizes[0] = x; _sizes[1] = y; _sizes[2] = 1; }
+	CLNDRange(size_t x, size_t y, size_t z) : _dim(3) { _sizes[0] = x; _sizes[1] = y; _sizes[2] = z; }
+
+	cl_uint dim() const { return _dim; }
+	// NULL for an empty range, as expected by clEnqueueNDRangeKernel for the local size
+	const size_t *sizes() const { return _dim > 0 ? _sizes : NULL; }
+	size_t operator[](cl_uint i) const { return _sizes[i]; }
+	size_t total() const { return _sizes[0] * _sizes[1] * _sizes[2]; }
+};
+
+// Launch shape of a kernel on a device for a problem of 1 to 3 dimensions. The local size is the tuned one
+// of a 1D problem (see CLAutotuner), else powers of 2 times CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE
+// along x, within CL_KERNEL_WORK_GROUP_SIZE, the device limits and the local memory the kernel leaves for
+// localMemPerItem bytes of __local memory per work item. The global size is the problem size rounded up
+// to multiples of it: pass problem() (or numElements()) to the kernel, which returns early for the
+// padding work items (if (get_global_id(0) >= n) return;).
+class CLLaunchConfig {
+private:
+	CLNDRange _problem;
+	CLNDRange _global;
+	CLNDRange _local;
+	size_t _kernelWorkGroupSize;
+	size_t _preferredMultiple;
+	cl_ulong _kernelLocalMemSize;
+	cl_int _ciErrNum;
+public:
+	// On failure (see ciErrNum()) the global size is the problem size and the local size is left to the runtime
+	CLLaunchConfig(CLKernel *kernel, const CLDevice *device, const CLNDRange &problem, size_t localMemPerItem = 0);
+
+	const CLNDRange &problem() const { return _problem; }
+	const CLNDRange &global() const { return _global; }
+	const CLNDRange &local() const { return _local; }
+	size_t numElements() const { return _problem.total(); }
+	size_t numWorkGroups() const { return _local.dim() > 0 ? _global.total() / _local.total() : 0; }
+	// clGetKernelWorkGroupInfo of the kernel on the device
+	size_t kernelWorkGroupSize() const { return _kernelWorkGroupSize; }
+	size_t preferredMultiple() const { return _preferredMultiple; }
+	cl_ulong kernelLocalMemSize() const { return _kernelLocalMemSize; }
 	cl_int ciErrNum() const { return _ciErrNum; }
 };
 
+// Local sizes of 1D launch configurations, computed with CLLaunchConfig once per kernel, device and problem
+// size bucket (power of 2), and again once the tuned sizes change, for launch paths which would otherwise
+// query clGetKernelWorkGroupInfo and the tuning database on every call. One thread at a time.
+class CLLaunchConfigCache {
+private:
+	class Impl;
+	Impl *_impl;
+
+	CLLaunchConfigCache(const CLLaunchConfigCache &);
+	CLLaunchConfigCache& operator=(const CLLaunchConfigCache &);
+public:
+	CLLaunchConfigCache();
+	~CLLaunchConfigCache();
+
+	// Local size of CLLaunchConfig(kernel, device, CLNDRange(problem), localMemPerItem), empty if it failed
+	CLNDRange local(CLKernel *kernel, const CLDevice *device, size_t problem, size_t localMemPerItem = 0);
+	// problem rounded up to a multiple of local, problem itself for an empty local size
+	static CLNDRange global(size_t problem, const CLNDRange &local);
+};
+
+// __local memory argument of a CLKernelFunctor
+struct CLLocalMem {
+	size_t size;
+	explicit CLLocalMem(size_t bytes) : size(bytes) {}
+};
+
+// Type erased kernel argument: a memory object, a value of size bytes or __local memory (value and mem NULL)
+struct CLKernelArg {
+	size_t size;
+	const void *value;
+	CLMem *mem;
+	int access;
+
+	static CLKernelArg of(CLMem *mem, int access = 0) {
+		CLKernelArg arg = { sizeof(cl_mem), NULL, mem, access };
+		return arg;
+	}
+	static CLKernelArg of(const CLLocalMem &local) {
+		CLKernelArg arg = { local.size, NULL, NULL, 0 };
+		return arg;
+	}
+	template <typename T>
+	static typename std::enable_if<!std::is_pointer<T>::value, CLKernelArg>::type of(const T &value) {
+		static_assert(std::is_trivially_copyable<T>::value, "kernel arguments must be trivially copyable");
+		static_assert(!std::is_same<T, bool>::value, "bool is not a valid kernel argument type, use cl_int");
+		static_assert(!std::is_same<T, long double>::value, "long double has no OpenCL counterpart");
+		CLKernelArg arg = { sizeof(T), &value, NULL, 0 };
+		return arg;
+	}
+};
+
 class CLKernel {
+	friend class CLCommandQueue;
+	friend class CLAutotuner;
 private:
 	cl_kernel _id;
 	CLProgram *_program;
 	const char* _name;
 	cl_int _ciErrNum;
 	cl_uint _argNum;
+	cl_uint _numArgs;
+	// Memory object bound to each argument (NULL for other arguments) and the kernel's access to it
+	CLMem **_memArgs;
+	CLMem::Access *_memArgAccess;
+	// Last value passed to the driver for each argument, a matching setArg skips clSetKernelArg
+	struct ArgShadow;
+	ArgShadow *_argShadows;
+	cl_ulong _argsIssued;
+	cl_ulong _argsElided;
+	// Serializes the argument binding and enqueue of CLCommandQueue::enqueueKernel
+	struct LaunchMutex;
+	LaunchMutex *_launchMutex;
+	// Local sizes CLAutotuner looked up for this kernel, per device and problem size bucket
+	struct TunedSizes;
+	TunedSizes *_tunedSizes;
+	cl_ulong _serial;
+
+	void bindMem(cl_uint argNum, CLMem *mem, CLMem::Access access);
+	// memSerial is the CLMem::serial() of a memory object argument, 0 for the others
+	void setArgValue(cl_uint argNum, size_t size, const void *value, cl_ulong memSerial = 0);
+	// Sets the arguments 0 to numArgs - 1, the argNum() cursor is left alone
+	cl_int setArgs(cl_uint numArgs, const CLKernelArg *args);
 public:
 	CLKernel(CLProgram *program, const char *name);
 	~CLKernel();
 
+	// The setArg calls below bind one argument at a time through the argNum() cursor, so a CLKernel set up
+	// this way must not be shared between threads. CLKernelFunctor binds and enqueues atomically instead.
+
 	cl_kernel id() { return _id; }
 	const CLProgram *program() const { return _program; }
 	const char* name() const { return _name; }
 	cl_int ciErrNum() const { return _ciErrNum; }
 	cl_uint argNum() const { return _argNum; }
+	cl_uint numArgs() const { return _numArgs; }
+	// Unique per kernel object, tells apart kernels created at the address of a deleted one
+	cl_ulong serial() const { return _serial; }
+	CLMem *memArg(cl_uint argNum) const { return argNum < _numArgs ? _memArgs[argNum] : NULL; }
+	CLMem::Access memArgAccess(cl_uint argNum) const { return _memArgAccess[argNum]; }
+	// clSetKernelArg calls made and skipped because the argument was already bound to the same value
+	cl_ulong argsIssued() const { return _argsIssued; }
+	cl_ulong argsElided() const { return _argsElided; }
+	void resetArgCounters() { _argsIssued = _argsElided = 0; }
+	// Forgets the shadow copies, the next setArg of every argument reaches the driver
+	void invalidateArgs();
 
-	CLKernel* setArg(CLMem* arg, int argNum = -1);
+	// access overrides the access derived from the memory flags, e.g. READ for a
+	// CL_MEM_READ_WRITE buffer which this kernel only reads
+	CLKernel* setArg(CLMem* arg, int argNum = -1, int access = 0);
 	CLKernel* setArg(cl_int& arg, int argNum = -1);
+	template <typename T>
+	CLKernel* setArg(CLBuffer<T>* arg, int argNum = -1, int access = 0) {
+		return setArg(static_cast<CLMem*>(arg), argNum, access);
+	}
+	// Any scalar, OpenCL vector type (cl_float4, ...) or struct passed by value. The struct layout
+	// must match the kernel's, pointers are rejected at compile time (pass memory objects as CLMem*).
+	template <typename T>
+	typename std::enable_if<!std::is_pointer<T>::value, CLKernel*>::type setArg(const T& arg, int argNum = -1) {
+		static_assert(std::is_trivially_copyable<T>::value, "kernel arguments must be trivially copyable");
+		static_assert(!std::is_same<T, bool>::value, "bool is not a valid kernel argument type, use cl_int");
+		static_assert(!std::is_same<T, long double>::value, "long double has no OpenCL counterpart");
+		return setArgBytes(sizeof(T), &arg, argNum);
+	}
+	// Raw argument setter, value NULL for __local memory of size bytes
+	CLKernel* setArgBytes(size_t size, const void *value, int argNum = -1);
+	// __local memory argument of size bytes
+	CLKernel* setLocalArg(size_t size, int argNum = -1) { return setArgBytes(size, NULL, argNum); }
+};
+
+// Reference counted event wrapper. Copies share the cl_event (clRetainEvent/clReleaseEvent).
+class CLEvent {
+private:
+	cl_event _id;
+public:
+	// Takes ownership of id: retain = false for an event just returned by an enqueue call
+	CLEvent(cl_event id = NULL, bool retain = false);
+	CLEvent(const CLEvent &other);
+	CLEvent& operator=(const CLEvent &other);
+	~CLEvent();
+
+	cl_event id() const { return _id; }
+	bool valid() const { return _id != NULL; }
+	// Releases the current event and takes ownership of id
+	void reset(cl_event id = NULL);
+
+	// Blocks until the command completes, returns the clWaitForEvents error code
+	cl_int wait() const;
+	// CL_QUEUED, CL_SUBMITTED, CL_RUNNING, CL_COMPLETE or a negative error code
+	cl_int status() const;
+	// Execution time of the completed command in ns (CL_PROFILING_COMMAND_END - START),
+	// 0 if the queue was not created with CL_QUEUE_PROFILING_ENABLE
+	cl_ulong elapsedNs() const;
+	// Blocks until all the commands complete. Invalid (NULL) events in the list are skipped.
+	static cl_int waitAll(const CLEvent *events, cl_uint numEvents);
+};
+
+// Latency histogram with log-linear buckets: exact below 8ns, then 8 buckets per power of 2 (12.5% resolution)
+class CLLatencyHistogram {
+private:
+	cl_ulong _buckets[CLPROFILE_HISTOGRAM_BUCKETS];
+	cl_ulong _count;
+
+	static cl_uint bucket(cl_ulong ns);
+	static cl_ulong bucketValue(cl_uint bucket);
+public:
+	CLLatencyHistogram();
+
+	void record(cl_ulong ns);
+	cl_ulong count() const { return _count; }
+	// Value below which the fraction p (0..1) of the samples lie, 0 if empty
+	cl_ulong percentile(double p) const;
+};
+
+// Timing aggregate of the profiled commands of one kernel or one transfer direction
+class CLProfileStats {
+public:
+	enum Kind { KERNEL, HOST_TO_DEVICE, DEVICE_TO_HOST, OTHER };
+private:
+	char _name[MAX_CLPROFILE_NAME_LEN];
+	Kind _kind;
+	cl_ulong _count;
+	cl_ulong _bytes;
+	cl_ulong _execNs;                  // sum of end - start
+	cl_ulong _queuedNs;                // sum of submit - queued
+	cl_ulong _submitNs;                // sum of start - submit
+	CLLatencyHistogram _latency;       // end - start
+
+	friend class CLProfiler;
+public:
+	CLProfileStats(Kind kind = OTHER, const char *name = NULL);
+
+	const char *name() const { return _name; }
+	Kind kind() const { return _kind; }
+	cl_ulong count() const { return _count; }
+	cl_ulong bytes() const { return _bytes; }
+	cl_ulong execNs() const { return _execNs; }
+	cl_ulong queuedNs() const { return _queuedNs; }
+	cl_ulong submitNs() const { return _submitNs; }
+	const CLLatencyHistogram &latency() const { return _latency; }
+	cl_ulong p50Ns() const { return _latency.percentile(0.50); }
+	cl_ulong p99Ns() const { return _latency.percentile(0.99); }
+	// Achieved bandwidth over the execution time (bytes per ns == GB/s), 0 for kernels
+	double gbps() const { return _execNs > 0 ? (double) _bytes / _execNs : 0; }
+};
+
+// Per-command timing collection for queues created with CL_QUEUE_PROFILING_ENABLE.
+// The queue records the event of every command; completed events are folded into per kernel
+// and per transfer direction statistics by collect(), which the queue also calls from finish()
+// and periodically while enqueuing. All functions are thread-safe.
+class CLProfiler {
+private:
+	class Impl;
+	Impl *_impl;
+
+	CLProfiler(const CLProfiler &);
+	CLProfiler& operator=(const CLProfiler &);
+public:
+	CLProfiler();
+	~CLProfiler();
+
+	void record(const CLEvent &event, CLProfileStats::Kind kind, const char *name, size_t bytes);
+	// Folds the completed commands into the statistics (waiting for all of them if wait is true),
+	// returns the number of commands still pending
+	cl_uint collect(bool wait = false);
+	cl_uint numStats() const;
+	// Copies up to maxStats statistics into stats, returns their count
+	cl_uint stats(CLProfileStats *stats, cl_uint maxStats) const;
+	// Statistics of a kernel (kind KERNEL) or a transfer direction (name NULL), false if none recorded
+	bool find(CLProfileStats::Kind kind, const char *name, CLProfileStats &stats) const;
+	void reset();
+	// One line per statistic: count, p50/p99 latency, bytes and GB/s
+	void print(std::ostream &os) const;
 };
 
 class CLCommandQueue {
@@ -198,27 +858,703 @@ private:
 	cl_command_queue _id;
 	const CLContext *_ctx;
 	const CLDevice *_device;
+	cl_command_queue_properties _properties;
+	CLProfiler *_profiler;
+	CLDependencyTracker *_tracker;
+	bool _zeroCopy;
 	cl_int _ciErrNum;
 
 	void init();
+	// Hands the command's event to the profiler and the caller's event
+	void enqueued(cl_event ev, CLEvent *event, CLProfileStats::Kind kind, const char *name, size_t bytes);
+	// Map and unmap without profiling, the command's event goes to ev (released if ev is NULL)
+	void *mapBuffer(CLMem *mem, bool blocking, cl_map_flags flags, size_t offset, size_t cb,
+		cl_uint numWaitEvents, const CLEvent *waitList, cl_event *ev);
+	void unmapMemObject(CLMem *mem, void *mapped, cl_uint numWaitEvents, const CLEvent *waitList, cl_event *ev);
 public:
-	// Construct using context and a device of the context
-	CLCommandQueue(CLContext *ctx, CLDevice *device = NULL);
+	// Construct using context and a device of the context. properties can enable
+	// CL_QUEUE_PROFILING_ENABLE to time every command, see profiler(), and
+	// CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE. On an out-of-order queue the enqueue calls track the
+	// read/write hazards on the memory objects they access (kernel memory arguments included) and
+	// wait only for the commands they conflict with, so independent commands can run concurrently.
+	CLCommandQueue(CLContext *ctx, const CLDevice *device = NULL, cl_command_queue_properties properties = 0);
 	~CLCommandQueue();
 
 	// Getters
 	cl_command_queue id() const { return _id; }
 	const CLContext *ctx() const { return _ctx; }
 	const CLDevice *device() const { return _device; }
+	cl_command_queue_properties properties() const { return _properties; }
+	// Per-command timing statistics, NULL unless created with CL_QUEUE_PROFILING_ENABLE
+	CLProfiler *profiler() const { return _profiler; }
+	bool outOfOrder() const { return (_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) ? true : false; }
+	bool zeroCopy() const { return _zeroCopy; }
 	cl_int ciErrNum() const { return _ciErrNum; }
 
+	// Blocking enqueueWriteBuffer/enqueueReadBuffer map the buffer and copy on the host instead of going
+	// through the driver's transfer path, no copy at all when the host pointer is the buffer's own
+	// (CL_MEM_USE_HOST_PTR). On by default for devices with host unified memory (integrated GPUs, CPUs).
+	CLCommandQueue* setZeroCopy(bool zeroCopy) { _zeroCopy = zeroCopy; return this; }
+
 	// Functionality
-	CLCommandQueue* enqueueWriteBuffer(CLMem *srcMem, bool blocking, size_t offset, size_t cb, void *src);
+	// Every enqueue call takes an optional wait list of numWaitEvents events which must complete
+	// before the command starts, and an optional event which receives the command's event.
+	CLCommandQueue* enqueueWriteBuffer(CLMem *srcMem, bool blocking, size_t offset, size_t cb, void *src,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
 	CLCommandQueue* enqueueNDRangeKernel(CLKernel *kernel, cl_uint dim, const size_t* global_work_offset,
                        const size_t* global_work_size,
-                       const size_t* local_work_size);
-	CLCommandQueue* enqueueReadBuffer(CLMem *dstMem, bool blocking, size_t offset, size_t cb, void *dst);
+                       const size_t* local_work_size,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	CLCommandQueue* enqueueNDRangeKernel(CLKernel *kernel, const CLNDRange &global, const CLNDRange &local = CLNDRange(),
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	CLCommandQueue* enqueueNDRangeKernel(CLKernel *kernel, const CLLaunchConfig &config,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueNDRangeKernel(kernel, config.global(), config.local(), numWaitEvents, waitList, event);
+	}
+	// Binds all the kernel's arguments and enqueues it as one step, safe for concurrent callers sharing
+	// the kernel. Arguments bound to the same value as in the previous launch make no driver call.
+	CLCommandQueue* enqueueKernel(CLKernel *kernel, cl_uint numArgs, const CLKernelArg *args,
+                       const CLNDRange &global, const CLNDRange &local = CLNDRange(),
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	CLCommandQueue* enqueueReadBuffer(CLMem *dstMem, bool blocking, size_t offset, size_t cb, void *dst,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	// Typed transfers of count elements (by default up to the end of the buffer) from element offset,
+	// CL_INVALID_VALUE for an offset past the end of the buffer
+	template <typename T>
+	CLCommandQueue* enqueueWrite(CLBuffer<T> *dst, bool blocking, const T *src, size_t count = (size_t) -1, size_t offset = 0,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		if (offset > dst->count()) {
+			_ciErrNum = CL_INVALID_VALUE;
+			return this;
+		}
+		if (count > dst->count() - offset)
+			count = dst->count() - offset;
+		return enqueueWriteBuffer(dst, blocking, offset * sizeof(T), count * sizeof(T), (void *) src, numWaitEvents, waitList, event);
+	}
+	template <typename T>
+	CLCommandQueue* enqueueRead(CLBuffer<T> *src, bool blocking, T *dst, size_t count = (size_t) -1, size_t offset = 0,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		if (offset > src->count()) {
+			_ciErrNum = CL_INVALID_VALUE;
+			return this;
+		}
+		if (count > src->count() - offset)
+			count = src->count() - offset;
+		return enqueueReadBuffer(src, blocking, offset * sizeof(T), count * sizeof(T), dst, numWaitEvents, waitList, event);
+	}
+	// Maps cb bytes at offset of the buffer into host memory, NULL on failure (see ciErrNum())
+	void *enqueueMapBuffer(CLMem *mem, bool blocking, cl_map_flags flags, size_t offset, size_t cb,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	CLCommandQueue* enqueueUnmapMemObject(CLMem *mem, void *mapped,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL);
+	// Scoped, blocking map of count elements of type T from element offset (all the remaining elements
+	// by default). The view unmaps on destruction.
+	template <typename T>
+	CLMappedView<T> map(CLMem &mem, size_t offset = 0, size_t count = (size_t) -1, cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE);
+	// Event which completes when all the previously enqueued commands complete (event may be NULL)
+	CLCommandQueue* enqueueMarker(CLEvent *event);
+	// Makes the commands enqueued after it wait for the events (e.g. from another queue)
+	CLCommandQueue* enqueueWaitForEvents(cl_uint numEvents, const CLEvent *events);
+	CLCommandQueue* enqueueBarrier();
+	CLCommandQueue* flush();
+	CLCommandQueue* finish();
+
+};
+
+// Host view of a mapped buffer range, iterable like a span. Unmaps on destruction or unmap().
+// Movable, not copyable.
+template <typename T>
+class CLMappedView {
+private:
+	CLCommandQueue *_queue;
+	CLMem *_mem;
+	T *_ptr;
+	size_t _count;
+
+	CLMappedView(const CLMappedView &);
+	CLMappedView& operator=(const CLMappedView &);
+public:
+	CLMappedView(CLCommandQueue *queue, CLMem *mem, T *ptr, size_t count) : _queue(queue), _mem(mem), _ptr(ptr), _count(ptr ? count : 0) {}
+	CLMappedView(CLMappedView &&other) : _queue(other._queue), _mem(other._mem), _ptr(other._ptr), _count(other._count) {
+		other._ptr = NULL;
+		other._count = 0;
+	}
+	CLMappedView& operator=(CLMappedView &&other) {
+		if (this != &other) {
+			unmap();
+			_queue = other._queue;
+			_mem = other._mem;
+			_ptr = other._ptr;
+			_count = other._count;
+			other._ptr = NULL;
+			other._count = 0;
+		}
+		return *this;
+	}
+	~CLMappedView() { unmap(); }
+
+	// Enqueues the unmap, the event (if given) completes when the device sees the host writes
+	void unmap(CLEvent *event = NULL) {
+		if (_ptr != NULL) {
+			_queue->enqueueUnmapMemObject(_mem, _ptr, 0, NULL, event);
+			_ptr = NULL;
+			_count = 0;
+		}
+	}
+
+	bool valid() const { return _ptr != NULL; }
+	T *data() const { return _ptr; }
+	size_t size() const { return _count; }
+	bool empty() const { return _count == 0; }
+	T *begin() const { return _ptr; }
+	T *end() const { return _ptr + _count; }
+	T &operator[](size_t i) const { return _ptr[i]; }
+};
+
+template <typename T>
+CLMappedView<T> CLCommandQueue::map(CLMem &mem, size_t offset, size_t count, cl_map_flags flags) {
+	size_t available = mem.size() / sizeof(T) > offset ? mem.size() / sizeof(T) - offset : 0;
+	if (count > available)
+		count = available;
+	T *ptr = static_cast<T*>(enqueueMapBuffer(&mem, true, flags, offset * sizeof(T), count * sizeof(T)));
+	return CLMappedView<T>(this, &mem, ptr, count);
+}
+
+// Launcher for a kernel whose arguments have the types Args, e.g.
+//     CLKernelFunctor<CLReadOnlyMem*, CLReadOnlyMem*, CLWriteOnlyMem*, cl_int> dot(&kernel);
+//     dot(queue, CLNDRange(globalSize), CLNDRange(256), a, b, c, n);
+// Arity and types are fixed at compile time, the call arguments are converted to Args. Memory objects
+// are passed as pointers to CLMem or its subclasses, __local memory as CLLocalMem. Several threads
+// may launch through the same functor, see CLCommandQueue::enqueueKernel.
+template <typename... Args>
+class CLKernelFunctor {
+private:
+	CLKernel *_kernel;
+public:
+	explicit CLKernelFunctor(CLKernel *kernel) : _kernel(kernel) {}
+
+	CLKernel *kernel() const { return _kernel; }
+	// False if the kernel does not take sizeof...(Args) arguments, its launches then fail with CL_INVALID_KERNEL_ARGS
+	bool valid() const { return _kernel->numArgs() == sizeof...(Args); }
+
+	CLCommandQueue* operator()(CLCommandQueue &queue, const CLNDRange &global, Args... args) {
+		return launch(queue, global, CLNDRange(), 0, NULL, NULL, args...);
+	}
+	CLCommandQueue* operator()(CLCommandQueue &queue, const CLNDRange &global, const CLNDRange &local, Args... args) {
+		return launch(queue, global, local, 0, NULL, NULL, args...);
+	}
+	CLCommandQueue* operator()(CLCommandQueue &queue, const CLLaunchConfig &config, Args... args) {
+		return launch(queue, config.global(), config.local(), 0, NULL, NULL, args...);
+	}
+	CLCommandQueue* launch(CLCommandQueue &queue, const CLNDRange &global, const CLNDRange &local,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event, Args... args) {
+		CLKernelArg argv[sizeof...(Args) > 0 ? sizeof...(Args) : 1] = { CLKernelArg::of(args)... };
+		return queue.enqueueKernel(_kernel, sizeof...(Args), argv, global, local, numWaitEvents, waitList, event);
+	}
+};
+
+// Local work size autotuner for 1D launches. tune() times the candidate local sizes of a kernel with the
+// arguments currently set on it and records the fastest in the tuning database, per kernel (name and
+// program source), device (name and driver version) and problem size bucket (power of 2 of the global
+// size). enqueueNDRangeKernel then uses the recorded size of the nearest bucket for a 1D launch without
+// local size, when it divides the global size, and CLLaunchConfig for a 1D problem. Each kernel keeps the
+// sizes it looked up, so launches take the database lock only until the database changes.
+class CLAutotuner {
+private:
+	static char g_databasePath[MAX_CLTUNING_DB_PATH_LEN];
+
+	static const char *databasePath();
+public:
+	// Tuning database file (env OPENCLPP_TUNING_DB if not set), loaded on first use and saved by tune().
+	// Must be called before the first tune() or launch, returns false afterwards.
+	static bool setDatabaseFile(const char *path);
+	// Local sizes worth timing: the multiples of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE and the powers
+	// of 2 within CL_KERNEL_WORK_GROUP_SIZE, maxWorkGroupSize, maxWorkItemSizes[0] and globalSize
+	static cl_uint candidates(CLKernel *kernel, const CLDevice *device, size_t globalSize, size_t *sizes, cl_uint maxSizes);
+	// Runs the kernel repetitions times (after a warm-up run) with each candidate on the queue's device and
+	// returns the fastest local size, 0 if none could run. Timed with profiling events, on a temporary
+	// profiling queue if the queue has no CL_QUEUE_PROFILING_ENABLE. The kernel's output is overwritten.
+	// As with CLLaunchConfig the global size is padded to a multiple of the candidate, so the kernel must
+	// bound check its work items against the element count set among its arguments.
+	static size_t tune(CLCommandQueue *queue, CLKernel *kernel, size_t globalSize, cl_uint repetitions = 3);
+	// Tuned local size for the nearest problem size bucket, 0 if the kernel is not tuned for the device
+	static size_t localSize(const CLKernel *kernel, const CLDevice *device, size_t globalSize);
+	static void record(const CLKernel *kernel, const CLDevice *device, size_t globalSize, size_t localSize, cl_ulong ns);
+	// Writes the database file, merged with the entries other processes saved meanwhile
+	static bool save();
+	// Forgets the tuned sizes in memory, the file is left alone
+	static void clear();
+	// Changes whenever the tuned sizes in memory change, see CLLaunchConfigCache
+	static unsigned long generation();
+};
+
+// Chunked, multi-queue execution of a kernel over large host arrays. The input is split into chunks
+// which rotate over depth command queues and depth sets of device buffers, so that the upload of
+// chunk k+1, the kernel on chunk k and the download of chunk k-1 overlap on devices with separate
+// copy engines. The kernel gets the chunk's input buffers, then its output buffers, in the order
+// they were added, followed by the chunk's element count as a cl_int (the DotProduct signature).
+class CLPipeline {
+private:
+	struct Stream {
+		char *host;
+		size_t elementBytes;
+		bool input;
+	};
+	CLContext *_ctx;
+	cl_uint _depth;
+	CLCommandQueue **_queues;
+	CLMem **_buffers;                  // _depth x _numStreams, allocated for _chunkCapacity elements
+	Stream _streams[MAX_CLPIPELINE_STREAMS];
+	cl_uint _numStreams;
+	size_t _chunkCapacity;
+	CLLaunchConfigCache _launchConfigs;
+	cl_int _ciErrNum;
+
+	void allocBuffers(size_t chunkElements);
+	void freeBuffers();
+	CLPipeline(const CLPipeline &);
+	CLPipeline& operator=(const CLPipeline &);
+public:
+	// depth is the number of chunks in flight (2 double, 3 triple buffering)
+	CLPipeline(CLContext *ctx, const CLDevice *device = NULL, cl_uint depth = 3, cl_command_queue_properties properties = 0);
+	~CLPipeline();
+
+	// elementBytes is the size of the data of one work element in this stream (e.g. 4 reals for DotProduct's inputs)
+	CLPipeline* addInput(const void *host, size_t elementBytes);
+	CLPipeline* addOutput(void *host, size_t elementBytes);
+	// Processes numElements elements in chunks of chunkElements (0 picks 4 chunks per queue) and
+	// returns when all outputs are back on the host. localWorkSize 0 picks it with CLLaunchConfig.
+	CLPipeline* run(CLKernel *kernel, size_t numElements, size_t chunkElements = 0, size_t localWorkSize = 0);
+
+	cl_uint depth() const { return _depth; }
+	CLCommandQueue *queue(cl_uint i) const { return _queues[i]; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+// OpenCL C name and limits of the element types of the primitives (CLReduction, ...): 32 and 64 bit
+// integers, float and double
+template <typename T>
+struct CLTypeInfo {
+	static_assert(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value && (sizeof(T) == 4 || sizeof(T) == 8),
+		"primitive element types are cl_int, cl_uint, cl_long, cl_ulong, cl_float and cl_double");
+	static const bool isFloat = std::is_floating_point<T>::value;
+	static const bool isSigned = std::is_signed<T>::value;
+	static const bool isDouble = isFloat && sizeof(T) == 8;
+
+	static const char *name() {
+		return isFloat ? (sizeof(T) == 8 ? "double" : "float")
+			: isSigned ? (sizeof(T) == 8 ? "long" : "int") : (sizeof(T) == 8 ? "ulong" : "uint");
+	}
+	static const char *lowest() {
+		return isFloat ? "-INFINITY" : !isSigned ? "0" : sizeof(T) == 8 ? "LONG_MIN" : "INT_MIN";
+	}
+	static const char *highest() {
+		return isFloat ? "INFINITY" : isSigned ? (sizeof(T) == 8 ? "LONG_MAX" : "INT_MAX") : (sizeof(T) == 8 ? "ULONG_MAX" : "UINT_MAX");
+	}
+};
+
+// Associative operation of a reduction or scan: an OpenCL C expression of a and b, and its identity element.
+// Reductions also require it to be commutative.
+struct CLReduceOp {
+	const char *expression;
+	const char *identity;
+
+	CLReduceOp(const char *expr, const char *ident) : expression(expr), identity(ident) {}
+	static CLReduceOp sum() { return CLReduceOp("a + b", "0"); }
+	template <typename T>
+	static CLReduceOp min() { return CLReduceOp("min(a, b)", CLTypeInfo<T>::highest()); }
+	template <typename T>
+	static CLReduceOp max() { return CLReduceOp("max(a, b)", CLTypeInfo<T>::lowest()); }
+};
+
+// Reduction of the elements of a buffer to one value on the device. Each work group reduces a strided part
+// of the input in local memory (tree reduction), then a second pass of one work group reduces the groups'
+// partial results, so that only the result needs to cross the bus. The kernels are built once per context,
+// element type and operation. A reduction object keeps its partial results buffer: one thread at a time.
+class CLReductionBase {
+private:
+	CLContext *_ctx;
+	const CLDevice *_device;
+	CLKernel *_kernel;
+	CLMem *_partials;
+	CLMem *_result;
+	size_t _elementSize;
+	size_t _localSize;
+	size_t _maxGroups;
+	cl_int _ciErrNum;
+
+	CLReductionBase(const CLReductionBase &);
+	CLReductionBase& operator=(const CLReductionBase &);
+protected:
+	CLReductionBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize, const CLReduceOp &op);
+
+	// count elements of in from element offset into element outOffset of out, CL_INVALID_VALUE if either
+	// range is outside its buffer
+	CLCommandQueue* enqueueReduce(CLCommandQueue *queue, CLMem *in, size_t offset, size_t count, CLMem *out, size_t outOffset,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+	// Blocking reduction into value
+	void reduce(CLCommandQueue *queue, CLMem *in, size_t offset, size_t count, void *value);
+public:
+	~CLReductionBase();
+
+	// Work group size of the kernel, a power of 2
+	size_t localSize() const { return _localSize; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+template <typename T>
+class CLReduction : public CLReductionBase {
+public:
+	// Double precision requires a device with native double support
+	CLReduction(CLContext *ctx, const CLDevice *device, const CLReduceOp &op = CLReduceOp::sum())
+		: CLReductionBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T), op) {}
+
+	// Reduces count elements of in (by default up to the end of the buffer) from element offset into
+	// result[resultOffset], without leaving the device
+	CLCommandQueue* enqueue(CLCommandQueue *queue, CLBuffer<T> *in, CLBuffer<T> *result, size_t resultOffset = 0,
+                       size_t offset = 0, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		// an offset past the end is left for enqueueReduce to reject
+		if (offset <= in->count() && count > in->count() - offset)
+			count = in->count() - offset;
+		return enqueueReduce(queue, in, offset, count, result, resultOffset, numWaitEvents, waitList, event);
+	}
+	// Blocking reduction which reads back the value, T() on error (see ciErrNum())
+	T run(CLCommandQueue *queue, CLBuffer<T> *in, size_t offset = 0, size_t count = (size_t) -1) {
+		// an offset past the end is left for enqueueReduce to reject
+		if (offset <= in->count() && count > in->count() - offset)
+			count = in->count() - offset;
+		T value = T();
+		reduce(queue, in, offset, count, &value);
+		return value;
+	}
+};
+
+// Work-efficient scan (prefix sums) of a buffer on the device with an associative operation: inclusive,
+// out[i] = in[0] op ... op in[i], or exclusive, out[i] = in[0] op ... op in[i - 1] and the identity for
+// out[0]. Each work group gets a contiguous chunk of the input: the groups reduce their chunks, one group
+// scans the chunk totals, then the groups scan their chunks tile by tile (Blelloch scan of tileSize()
+// elements in local memory) from their chunk's prefix. Three launches whatever the size, out may be in.
+// The segmented variants restart the scan at each segment head. The kernels are built once per context,
+// element type, operation and variant. A scan object keeps its chunk totals buffer: one thread at a time.
+class CLScanBase {
+protected:
+	enum Segments { NONE, FLAGS, KEYS };
+private:
+	CLContext *_ctx;
+	const CLDevice *_device;
+	Segments _segments;
+	CLKernel *_reduceKernel;
+	CLKernel *_sumsKernel;
+	CLKernel *_scanKernel;
+	CLMem *_sumValues;
+	CLMem *_sumHeads;
+	size_t _elementSize;
+	size_t _localSize;
+	size_t _maxGroups;
+	cl_int _ciErrNum;
+
+	CLScanBase(const CLScanBase &);
+	CLScanBase& operator=(const CLScanBase &);
+protected:
+	// keyTypeName is the OpenCL C type of the keys of a KEYS scan
+	CLScanBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize, const CLReduceOp &op,
+		Segments segments, const char *keyTypeName = NULL, bool keyIsDouble = false);
+
+	// count bounded by the element counts of the buffers
+	static size_t clampCount(size_t count, size_t n1, size_t n2, size_t n3 = (size_t) -1) {
+		count = count < n1 ? count : n1;
+		count = count < n2 ? count : n2;
+		return count < n3 ? count : n3;
+	}
+	// segments is the flags or keys buffer, NULL for NONE
+	CLCommandQueue* enqueueScan(CLCommandQueue *queue, CLMem *in, CLMem *segments, CLMem *out, size_t count, bool inclusive,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+public:
+	~CLScanBase();
+
+	// Elements scanned in local memory at once: twice the work group size, picked from the kernel's
+	// CL_KERNEL_WORK_GROUP_SIZE, maxWorkGroupSize and the local memory of the device
+	size_t tileSize() const { return 2 * _localSize; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+template <typename T>
+class CLScan : public CLScanBase {
+public:
+	// Double precision requires a device with native double support
+	CLScan(CLContext *ctx, const CLDevice *device, const CLReduceOp &op = CLReduceOp::sum())
+		: CLScanBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T), op, NONE) {}
+
+	// Scans the first count elements of in (by default all that fit in and out) into out
+	CLCommandQueue* inclusive(CLCommandQueue *queue, CLBuffer<T> *in, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, NULL, out, clampCount(count, in->count(), out->count()), true, numWaitEvents, waitList, event);
+	}
+	CLCommandQueue* exclusive(CLCommandQueue *queue, CLBuffer<T> *in, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, NULL, out, clampCount(count, in->count(), out->count()), false, numWaitEvents, waitList, event);
+	}
+};
+
+// Segmented scan: flags[i] != 0 (cl_uint flags) starts a segment at i, where the scan restarts from in[i] (inclusive) or
+// the identity (exclusive)
+template <typename T>
+class CLSegmentedScan : public CLScanBase {
+public:
+	CLSegmentedScan(CLContext *ctx, const CLDevice *device, const CLReduceOp &op = CLReduceOp::sum())
+		: CLScanBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T), op, FLAGS) {}
+
+	CLCommandQueue* inclusive(CLCommandQueue *queue, CLBuffer<T> *in, CLBuffer<unsigned int> *flags, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, flags, out, clampCount(count, in->count(), out->count(), flags->count()), true,
+			numWaitEvents, waitList, event);
+	}
+	CLCommandQueue* exclusive(CLCommandQueue *queue, CLBuffer<T> *in, CLBuffer<unsigned int> *flags, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, flags, out, clampCount(count, in->count(), out->count(), flags->count()), false,
+			numWaitEvents, waitList, event);
+	}
+};
+
+// Scan by key: each run of equal consecutive keys is a segment
+template <typename T, typename K>
+class CLScanByKey : public CLScanBase {
+public:
+	CLScanByKey(CLContext *ctx, const CLDevice *device, const CLReduceOp &op = CLReduceOp::sum())
+		: CLScanBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T), op, KEYS,
+			CLTypeInfo<K>::name(), CLTypeInfo<K>::isDouble) {}
+
+	CLCommandQueue* inclusive(CLCommandQueue *queue, CLBuffer<K> *keys, CLBuffer<T> *in, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, keys, out, clampCount(count, in->count(), out->count(), keys->count()), true,
+			numWaitEvents, waitList, event);
+	}
+	CLCommandQueue* exclusive(CLCommandQueue *queue, CLBuffer<K> *keys, CLBuffer<T> *in, CLBuffer<T> *out, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueScan(queue, in, keys, out, clampCount(count, in->count(), out->count(), keys->count()), false,
+			numWaitEvents, waitList, event);
+	}
+};
+
+// Stable LSD radix sort on the device, 4 bits per pass, of cl_uint, cl_int, cl_ulong, cl_long, cl_float or
+// cl_double keys, with an optional payload of 4 or 8 byte values. Each pass counts the digits of every work
+// group's chunk, scans the counts (CLScan) into the chunks' output offsets, then scatters each chunk tile by
+// tile: the tile is sorted on the digit in local memory first, so that the writes are contiguous. Floating
+// point keys are moved as their bits, mapped to an unsigned order (-0.0 before 0.0, NaNs by sign and bits),
+// so double keys need no double support. Fewer elements than the host threshold are sorted on the host.
+// A sort object keeps its temporary buffers: one thread at a time.
+class CLRadixSortBase {
+private:
+	CLContext *_ctx;
+	const CLDevice *_device;
+	CLKernel *_histogramKernel;
+	CLKernel *_scatterKernel;
+	CLScan<unsigned int> *_scan;
+	CLBuffer<unsigned int> *_histogram;
+	CLMem *_tempKeys;
+	CLMem *_tempValues;
+	size_t _tempCount;
+	size_t _keySize;
+	bool _keyIsFloat;
+	bool _keyIsSigned;
+	size_t _valueSize;
+	size_t _localSize;
+	size_t _maxGroups;
+	size_t _hostThreshold;
+	cl_int _ciErrNum;
+
+	CLCommandQueue* hostSort(CLCommandQueue *queue, CLMem *keys, CLMem *values, size_t count,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+	CLRadixSortBase(const CLRadixSortBase &);
+	CLRadixSortBase& operator=(const CLRadixSortBase &);
+protected:
+	// valueSize 0 sorts keys only
+	CLRadixSortBase(CLContext *ctx, const CLDevice *device, size_t keySize, bool keyIsFloat, bool keyIsSigned, size_t valueSize);
+
+	CLCommandQueue* enqueueSort(CLCommandQueue *queue, CLMem *keys, CLMem *values, size_t count,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+public:
+	~CLRadixSortBase();
+
+	// Sorts fewer than count elements on the host (CLSORT_HOST_THRESHOLD by default), 0 always on the device
+	void setHostThreshold(size_t count) { _hostThreshold = count; }
+	size_t hostThreshold() const { return _hostThreshold; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+template <typename K>
+class CLRadixSort : public CLRadixSortBase {
+public:
+	CLRadixSort(CLContext *ctx, const CLDevice *device)
+		: CLRadixSortBase(ctx, device, sizeof(K), CLTypeInfo<K>::isFloat, CLTypeInfo<K>::isSigned, 0) {}
+
+	// Sorts the first count keys (by default all) in place
+	CLCommandQueue* sort(CLCommandQueue *queue, CLBuffer<K> *keys, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueSort(queue, keys, NULL, count < keys->count() ? count : keys->count(), numWaitEvents, waitList, event);
+	}
+};
+
+// Sort of values by their keys, e.g. cl_uint indices for a permutation
+template <typename K, typename V>
+class CLRadixSortByKey : public CLRadixSortBase {
+	static_assert(sizeof(V) == 4 || sizeof(V) == 8, "sort payload values must be 4 or 8 bytes");
+public:
+	CLRadixSortByKey(CLContext *ctx, const CLDevice *device)
+		: CLRadixSortBase(ctx, device, sizeof(K), CLTypeInfo<K>::isFloat, CLTypeInfo<K>::isSigned, sizeof(V)) {}
+
+	// Sorts the first count keys (by default all that have a value) and their values in place
+	CLCommandQueue* sort(CLCommandQueue *queue, CLBuffer<K> *keys, CLBuffer<V> *values, size_t count = (size_t) -1,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		if (count > keys->count())
+			count = keys->count();
+		return enqueueSort(queue, keys, values, count < values->count() ? count : values->count(), numWaitEvents, waitList, event);
+	}
+};
+
+// Storage order and transposition of the matrices of CLMatrixMultiply
+enum CLMatrixOrder { CLRowMajor, CLColumnMajor };
+enum CLTranspose { CLNoTrans, CLTrans };
+
+// Dense matrix products on the device, BLAS style: gemm, C = alpha op(A) op(B) + beta C, and gemv,
+// y = alpha op(A) x + beta y, with op(X) X or its transpose and lda, ldb, ldc the distance between the
+// starts of the rows (row major) or columns (column major) of the matrices. C and y are not read when
+// beta is 0. A gemm work group computes a tile of C with register blocking (4 x 4 elements per work
+// item) from tiles of op(A) and op(B) staged in local memory; the tilings, from 64 x 64 down to 4 x 4,
+// are the ones the device's work group and local memory limits allow, the largest which still gives
+// every compute unit a tile unless tune() recorded a faster one in the tuning database (see CLAutotuner).
+// gemv gives a work group a row of the matrix when rows are contiguous in memory, else a work item an
+// output with x staged in local memory. The kernels are built once per context and element type.
+// A matrix multiply object keeps its kernels: one thread at a time.
+class CLMatrixMultiplyBase {
+private:
+	CLContext *_ctx;
+	const CLDevice *_device;
+	const char *_typeName;
+	bool _isDouble;
+	CLKernel *_gemmKernels[CLGEMM_NUM_TILINGS][4];   // built on first use, by transA * 2 + transB
+	bool _gemmUnusable[CLGEMM_NUM_TILINGS];
+	CLKernel *_gemvRowsKernel;
+	CLKernel *_gemvColumnsKernel;
+	size_t _gemvLocalSize;
+	size_t _elementSize;
+	cl_int _ciErrNum;
+
+	// Gemm kernel of the tiling and variant (transA * 2 + transB), NULL if the device cannot run it
+	CLKernel *gemmKernel(int tiling, int variant);
+	// Tiling for a problem of rows x columns: the tuned one, else the largest that keeps the compute units busy
+	int selectTiling(size_t rows, size_t columns);
+	CLMatrixMultiplyBase(const CLMatrixMultiplyBase &);
+	CLMatrixMultiplyBase& operator=(const CLMatrixMultiplyBase &);
+protected:
+	CLMatrixMultiplyBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize);
+
+	// alpha and beta point to elementSize bytes
+	CLCommandQueue* enqueueGemm(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose transA, CLTranspose transB,
+                       size_t M, size_t N, size_t K, const void *alpha, CLMem *A, size_t lda, CLMem *B, size_t ldb,
+                       const void *beta, CLMem *C, size_t ldc, cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+	CLCommandQueue* enqueueGemv(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose trans, size_t M, size_t N,
+                       const void *alpha, CLMem *A, size_t lda, CLMem *x, const void *beta, CLMem *y,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+public:
+	~CLMatrixMultiplyBase();
+
+	// Times every tiling the device can run on a row major M x K by K x N product and records the fastest in
+	// the tuning database (saved if it has a file), for the problems of about M x N elements. Returns the
+	// work group size of the fastest tiling, 0 if none could run. Timed as CLAutotuner::tune.
+	size_t tune(CLCommandQueue *queue, size_t M, size_t N, size_t K, cl_uint repetitions = 3);
+	// Tile of C (rows x columns) a gemm of M x N uses on this device
+	void tileSize(size_t M, size_t N, size_t *rows, size_t *columns);
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+template <typename T>
+class CLMatrixMultiply : public CLMatrixMultiplyBase {
+	static_assert(std::is_floating_point<T>::value && sizeof(T) <= 8, "CLMatrixMultiply is for cl_float or cl_double matrices");
+public:
+	// Double precision requires a device with native double support
+	CLMatrixMultiply(CLContext *ctx, const CLDevice *device)
+		: CLMatrixMultiplyBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T)) {}
+
+	// C (M x N) = alpha op(A) (M x K) op(B) (K x N) + beta C
+	CLCommandQueue* gemm(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose transA, CLTranspose transB,
+                       size_t M, size_t N, size_t K, T alpha, CLBuffer<T> *A, size_t lda, CLBuffer<T> *B, size_t ldb,
+                       T beta, CLBuffer<T> *C, size_t ldc, cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueGemm(queue, order, transA, transB, M, N, K, &alpha, A, lda, B, ldb, &beta, C, ldc, numWaitEvents, waitList, event);
+	}
+	// y = alpha op(A) x + beta y for A of M x N: x has N elements and y M, or the reverse for CLTrans
+	CLCommandQueue* gemv(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose trans, size_t M, size_t N,
+                       T alpha, CLBuffer<T> *A, size_t lda, CLBuffer<T> *x, T beta, CLBuffer<T> *y,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueGemv(queue, order, trans, M, N, &alpha, A, lda, x, &beta, y, numWaitEvents, waitList, event);
+	}
+};
+
+// Batched dot products on the device: out[i] = a_i . b_i for n vectors of d elements, a_i at element
+// i * strideA of A and b_i at element i * strideB of B (strides of d for packed vectors, a strideB of 0
+// scores every a_i against the same b, a batched gemv). Three kernels, selected from n and d: up to
+// CLBATCHED_DOT_UNROLL_MAX elements a work item per vector with d a compile time constant (a program
+// per d), else a work group, or a power of 2 slice of one for shorter vectors, per vector with a tree
+// in local memory, and for long vectors too few to occupy the compute units several work groups per
+// vector whose partial sums a second launch adds. The kernels are built once per context, element type
+// and d. A batched dot object keeps its partial sums buffer: one thread at a time.
+class CLBatchedDotBase {
+public:
+	enum Variant { UNROLLED, GROUP_PER_VECTOR, MULTI_GROUP };
+private:
+	CLContext *_ctx;
+	const CLDevice *_device;
+	const char *_typeName;
+	bool _isDouble;
+	CLKernel *_unrolledKernels[CLBATCHED_DOT_UNROLL_MAX + 1];  // by d, built on first use
+	CLKernel *_groupKernel;
+	CLKernel *_partialKernel;
+	CLKernel *_sumKernel;
+	CLMem *_partials;
+	size_t _partialCount;
+	size_t _elementSize;
+	size_t _localSize;
+	CLLaunchConfigCache _launchConfigs;   // of the unrolled and sum kernels
+	cl_int _ciErrNum;
+
+	CLKernel *unrolledKernel(size_t d);
+	// Work groups per vector of the MULTI_GROUP variant
+	size_t groupsPerVector(size_t n, size_t d) const;
+	CLBatchedDotBase(const CLBatchedDotBase &);
+	CLBatchedDotBase& operator=(const CLBatchedDotBase &);
+protected:
+	CLBatchedDotBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize);
+
+	CLCommandQueue* enqueueDot(CLCommandQueue *queue, size_t n, size_t d, CLMem *A, size_t strideA, CLMem *B, size_t strideB, CLMem *out,
+                       cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event);
+public:
+	~CLBatchedDotBase();
+
+	// Kernel enqueue() runs for n vectors of d elements
+	Variant variant(size_t n, size_t d) const;
+	// Work group size of the GROUP_PER_VECTOR and MULTI_GROUP kernels, a power of 2
+	size_t localSize() const { return _localSize; }
+	cl_int ciErrNum() const { return _ciErrNum; }
+};
+
+template <typename T>
+class CLBatchedDot : public CLBatchedDotBase {
+public:
+	// Double precision requires a device with native double support
+	CLBatchedDot(CLContext *ctx, const CLDevice *device)
+		: CLBatchedDotBase(ctx, device, CLTypeInfo<T>::name(), CLTypeInfo<T>::isDouble, sizeof(T)) {}
 
+	// out[i] = a_i . b_i for i < n, see CLBatchedDotBase
+	CLCommandQueue* enqueue(CLCommandQueue *queue, size_t n, size_t d, CLBuffer<T> *A, size_t strideA, CLBuffer<T> *B, size_t strideB,
+                       CLBuffer<T> *out, cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueDot(queue, n, d, A, strideA, B, strideB, out, numWaitEvents, waitList, event);
+	}
+	// Packed vectors: a_i at i * d of A and b_i at i * d of B
+	CLCommandQueue* enqueue(CLCommandQueue *queue, size_t n, size_t d, CLBuffer<T> *A, CLBuffer<T> *B, CLBuffer<T> *out,
+                       cl_uint numWaitEvents = 0, const CLEvent *waitList = NULL, CLEvent *event = NULL) {
+		return enqueueDot(queue, n, d, A, d, B, d, out, numWaitEvents, waitList, event);
+	}
 };
 
 #endif /* _OPENCLPP_H_ */
\ No newline at end of file
@@ -64,3 +64,62 @@ typedef float16 real16_t;
    
    //c[iGID] = a[iGID] * sin(b[iGID]) + 1;
 }
+
+// Variants of DotProduct for bandwidth tuning, see oclDotProductBench.cpp. Each work item computes
+// COARSEN outputs, iGID + k * get_global_size(0) for k < COARSEN, so that adjacent work items still
+// access adjacent elements; launch them with (iNumElements + COARSEN - 1) / COARSEN work items.
+
+// Array of structures input as DotProduct, 4 reals per output, read with vector loads
+#define DOT_PRODUCT_VEC4(name, COARSEN) \
+__kernel void name (__global const real_t* a, __global const real_t* b, __global real_t* c, int iNumElements) \
+{ \
+    int iGID = get_global_id(0); \
+    int iStride = get_global_size(0); \
+    for (int k = 0; k < COARSEN; k++, iGID += iStride) \
+    { \
+        if (iGID >= iNumElements) \
+        { \
+            return; \
+        } \
+        c[iGID] = dot(vload4(iGID, a), vload4(iGID, b)); \
+    } \
+}
+
+// Structure of arrays input: component j of element i at a[j * iNumElements + i], scalar coalesced loads
+#define DOT_PRODUCT_SOA(name, COARSEN) \
+__kernel void name (__global const real_t* a, __global const real_t* b, __global real_t* c, int iNumElements) \
+{ \
+    int iGID = get_global_id(0); \
+    int iStride = get_global_size(0); \
+    for (int k = 0; k < COARSEN; k++, iGID += iStride) \
+    { \
+        if (iGID >= iNumElements) \
+        { \
+            return; \
+        } \
+        c[iGID] = a[iGID] * b[iGID] \
+                   + a[iNumElements + iGID] * b[iNumElements + iGID] \
+                   + a[2 * iNumElements + iGID] * b[2 * iNumElements + iGID] \
+                   + a[3 * iNumElements + iGID] * b[3 * iNumElements + iGID]; \
+    } \
+}
+
+DOT_PRODUCT_VEC4(DotProductVec4x1, 1)
+DOT_PRODUCT_VEC4(DotProductVec4x2, 2)
+DOT_PRODUCT_VEC4(DotProductVec4x4, 4)
+DOT_PRODUCT_VEC4(DotProductVec4x8, 8)
+DOT_PRODUCT_SOA(DotProductSoAx1, 1)
+DOT_PRODUCT_SOA(DotProductSoAx2, 2)
+DOT_PRODUCT_SOA(DotProductSoAx4, 4)
+DOT_PRODUCT_SOA(DotProductSoAx8, 8)
+
+// Streaming copy of iNumElements real4_t, the attainable global memory bandwidth of the device
+__kernel void CopyBandwidth (__global const real4_t* src, __global real4_t* dst, int iNumElements)
+{
+    int iGID = get_global_id(0);
+    if (iGID >= iNumElements)
+    {
+        return;
+    }
+    dst[iGID] = src[iGID];
+}
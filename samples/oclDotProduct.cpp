@@ -5,14 +5,24 @@
  call "\Program Files (x86)\Microsoft Visual Studio 9.0"\Common7\Tools\vsvars32.bat
  cd samples
  cl -I. -I .. -I ..\include oclDotProduct.cpp ..\src\opencl++.cpp ..\lib\Win32\OpenCL.lib
- oclDotProduct.exe [-local 8/16/32/64/128/256/512/1024]
+ oclDotProduct.exe [-local 8/16/32/64/128/256/512/1024] [-pipeline depth] [-autotune repetitions]
  Linux:
- TBD
+ cd samples
+ g++ -std=c++11 -I ../include oclDotProduct.cpp ../src/opencl++.cpp -lOpenCL -pthread -o oclDotProduct
+ ./oclDotProduct [-local 8/16/32/64/128/256/512/1024] [-pipeline depth] [-autotune repetitions]
+ To embed DotProduct.cl instead of reading it at run time, generate DotProduct_cl.cpp and add it to the build:
+ g++ -std=c++11 ../tools/clembed.cpp -o clembed && ./clembed -o DotProduct_cl.cpp DotProduct.cl
+ g++ -std=c++11 -I ../include oclDotProduct.cpp DotProduct_cl.cpp ../src/opencl++.cpp -lOpenCL -pthread -o oclDotProduct
+ To skip the kernel compilation at startup, precompile it for the local devices into DotProduct.clb:
+ g++ -std=c++11 -I ../include ../tools/clprecompile.cpp ../src/opencl++.cpp -lOpenCL -pthread -o clprecompile
+ ./clprecompile -options "-D CONFIG_USE_DOUBLE" -o DotProduct.clb DotProduct.cl
 */
 #include <opencl++.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <chrono>
+#include <iostream>
 #ifdef _WIN32
     // Headers needed for Windows
     #include <windows.h>
@@ -168,16 +178,10 @@ int main(int argc, char **argv)
 	printf("Running in double mode...\n");
 #endif
 
-    // Get the NVIDIA platform
+    // List the platforms and devices
 	const CLPlatform *platforms = CLPlatform::getAllPlatforms();
-	const CLPlatform *nvidiaPlatformP = NULL;
-	const CLDevice *targetDeviceP = NULL;
-	for(cl_uint i = 0;i < CLPlatform::g_numPlatforms;i++) {
+	for(cl_uint i = 0;i < CLPlatform::numPlatforms();i++) {
 		printf("platform name: %s, profile: %s, version: %s, vendor: %s, extensions: %s, icd suffix: %s, devices: %u\n", platforms[i].name(), platforms[i].profile(), platforms[i].version(), platforms[i].vendor(), platforms[i].extensions(), platforms[i].icd_suffix(), platforms[i].numDevices()); 
-		if(strstr(platforms[i].name(), "NVIDIA")) {
-			nvidiaPlatformP = &platforms[i];
-			targetDeviceP = platforms[i].devices(); // first device of the platform
-		}
 		for(cl_uint j = 0;j < platforms[i].numDevices();++j) {
 		    printf("\n device %s # of Compute Units = %u, work group size %u, sizes (%u, %u, %u), Type %u, GPU %d, CPU %d, Accelerator %d, native double support %u, preferred double support %u\n", 
 				platforms[i].devices()[j].name(),
@@ -193,10 +197,30 @@ int main(int argc, char **argv)
 				platforms[i].devices()[j].nativeDoubleSupport(),
 				platforms[i].devices()[j].preferredDoubleSupport()
 				); 
+		    printf("  clock %u MHz, global mem %llu MB, local mem %llu KB, max alloc %llu MB, cache line %u, host unified memory %d\n",
+				platforms[i].devices()[j].maxClockFrequency(),
+				(unsigned long long) (platforms[i].devices()[j].globalMemSize() >> 20),
+				(unsigned long long) (platforms[i].devices()[j].localMemSize() >> 10),
+				(unsigned long long) (platforms[i].devices()[j].maxMemAllocSize() >> 20),
+				platforms[i].devices()[j].globalMemCacheLineSize(),
+				(int) platforms[i].devices()[j].hostUnifiedMemory()
+				);
 		}
 
 	}
 
+    // Pick the best device for a bandwidth bound workload which fits the input and output arrays
+	int workload = CLDevice::BANDWIDTH_BOUND;
+#if defined(DOUBLE_SUPPORT_AVAILABLE)
+	workload |= CLDevice::REQUIRES_DOUBLE;
+#endif
+	const CLDevice *targetDeviceP = CLPlatform::bestDevice(workload, (cl_ulong) sizeof(real_t) * 9 * iNumElements);
+	if(targetDeviceP == NULL) {
+		printf("No suitable OpenCL device found\n");
+		return EXIT_FAILURE;
+	}
+	printf("\nUsing device %s\n", targetDeviceP->name());
+
     // get command line arg for quick test, if provided
     // bNoPrompt = shrCheckCmdLineFlag(argc, (const char**)argv, "noprompt");
 
@@ -205,8 +229,15 @@ int main(int argc, char **argv)
 
     // set and log Global and Local work size dimensions
     szLocalWorkSize = 256;
-	if(argc > 2 && strcmp(argv[1], "-local") == 0) {
-		szLocalWorkSize = atoi(argv[2]);
+	cl_uint pipelineDepth = 0;
+	cl_uint autotuneRepetitions = 0;
+	for(int i = 1;i + 1 < argc;i += 2) {
+		if(strcmp(argv[i], "-local") == 0)
+			szLocalWorkSize = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-pipeline") == 0)
+			pipelineDepth = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-autotune") == 0)
+			autotuneRepetitions = atoi(argv[i + 1]);
 	}
     szGlobalWorkSize = shrRoundUp((int)szLocalWorkSize, iNumElements);  // rounded up to the nearest multiple of the LocalWorkSize
     // Allocate and initialize host arrays
@@ -219,19 +250,16 @@ int main(int argc, char **argv)
 
 	cxGPUContextP = new CLContext(targetDeviceP, 1);
 
-    // Create a command-queue
-	cqCommandQueueP = new CLCommandQueue(cxGPUContextP);
+    // Create a command-queue with profiling, so that every command gets timed
+	cqCommandQueueP = new CLCommandQueue(cxGPUContextP, targetDeviceP, CL_QUEUE_PROFILING_ENABLE);
 
     // Allocate the OpenCL buffer memory objects for source and result on the device GMEM
     cmDevSrcAP = new CLReadOnlyMem(cxGPUContextP, sizeof(real_t)*szGlobalWorkSize*4);
     cmDevSrcBP = new CLReadOnlyMem(cxGPUContextP, sizeof(real_t)*szGlobalWorkSize*4);
     cmDevDstP = new CLWriteOnlyMem(cxGPUContextP, sizeof(real_t)*szGlobalWorkSize);
 
-    // Read the OpenCL kernel in from source file
-    cSourceCL = oclLoadProgSource(cSourceFile, "", &szKernelLength);
-
     // Build the program with 'mad' Optimization option
-	char *flags = NULL;
+	const char *flags = NULL;
 #ifdef MAC
     flags = "-cl-fast-relaxed-math -DMAC";
 #else
@@ -241,7 +269,17 @@ int main(int argc, char **argv)
 	flags = "-D CONFIG_USE_DOUBLE";
 #endif
 
-	cpProgramP = (new CLProgram(cxGPUContextP, 1, (const char **)&cSourceCL, &szKernelLength))->build(flags);
+    // Use the binaries precompiled by tools/clprecompile or the source embedded by tools/clembed when
+    // available, else read the OpenCL kernel in from source file
+	CLProgram::loadBundle("DotProduct.clb");
+	cpProgramP = new CLProgram(cxGPUContextP, cSourceFile);
+	if(cpProgramP->ciErrNum() != CL_SUCCESS || cpProgramP->build(flags) == NULL) {
+		delete cpProgramP;
+		cSourceCL = oclLoadProgSource(cSourceFile, "", &szKernelLength);
+		cpProgramP = (new CLProgram(cxGPUContextP, 1, (const char **)&cSourceCL, &szKernelLength))->build(flags);
+	}
+	else if(cpProgramP->fromBundle())
+		printf("Using the precompiled %s from DotProduct.clb\n", cSourceFile);
 
     // Create the kernel
     ckKernelP = (new CLKernel(cpProgramP, "DotProduct"))
@@ -250,28 +288,50 @@ int main(int argc, char **argv)
 					->setArg(cmDevDstP)
 					->setArg(iNumElements);
 
+    // Time the candidate local sizes and use the fastest (saved in env OPENCLPP_TUNING_DB if set)
+	if(autotuneRepetitions > 0) {
+		size_t szTunedLocalWorkSize = CLAutotuner::tune(cqCommandQueueP, ckKernelP, szGlobalWorkSize, autotuneRepetitions);
+		if(szTunedLocalWorkSize > 0) {
+			szLocalWorkSize = szTunedLocalWorkSize;
+			printf("Autotuned local work size %u\n", (unsigned) szLocalWorkSize);
+		}
+	}
+
     // --------------------------------------------------------
     // Core sequence... copy input data to GPU, compute, copy results back
 
     // Asynchronous write of data to GPU device
     // Launch kernel
-	SYSTEMTIME t1_g, t2_g;
-	GetSystemTime(&t1_g);
+	std::chrono::high_resolution_clock::time_point t1_g = std::chrono::high_resolution_clock::now();
     cqCommandQueueP->enqueueWriteBuffer(cmDevSrcAP, CL_FALSE, 0, sizeof(real_t) * szGlobalWorkSize * 4, srcA)
 				   ->enqueueWriteBuffer(cmDevSrcBP, CL_FALSE, 0, sizeof(real_t) * szGlobalWorkSize * 4, srcB)
 				   ->enqueueNDRangeKernel(ckKernelP, 1, NULL, &szGlobalWorkSize, &szLocalWorkSize)
 				   ->enqueueReadBuffer(cmDevDstP, CL_TRUE, 0, sizeof(real_t) * szGlobalWorkSize, dst)
+				   ->finish()
 				   ;
 
-	GetSystemTime(&t2_g);
-	printf("kernel %d secs, %d mili\n", t2_g.wSecond-t1_g.wSecond, t2_g.wMilliseconds-t1_g.wMilliseconds);
+	std::chrono::high_resolution_clock::time_point t2_g = std::chrono::high_resolution_clock::now();
+	printf("device %.3f mili\n", std::chrono::duration<double, std::milli>(t2_g - t1_g).count());
+	if(cqCommandQueueP->profiler())
+		cqCommandQueueP->profiler()->print(std::cout);
+
+	if(pipelineDepth > 0) {
+		// Same computation in chunks over pipelineDepth queues, overlapping transfers with the kernel
+		CLPipeline pipeline(cxGPUContextP, targetDeviceP, pipelineDepth);
+		t1_g = std::chrono::high_resolution_clock::now();
+		pipeline.addInput(srcA, sizeof(real4_t))
+				->addInput(srcB, sizeof(real4_t))
+				->addOutput(dst, sizeof(real_t))
+				->run(ckKernelP, iNumElements, 0, szLocalWorkSize);
+		t2_g = std::chrono::high_resolution_clock::now();
+		printf("pipelined (depth %u) %.3f mili, error %d\n", pipelineDepth, std::chrono::duration<double, std::milli>(t2_g - t1_g).count(), pipeline.ciErrNum());
+	}
 
     // Compute and compare results for golden-host and report errors and pass/fail
-	SYSTEMTIME t1, t2;
-	GetSystemTime(&t1);
+	std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
     DotProductHost ((const real_t*)srcA, (const real_t*)srcB, (real_t*)Golden, iNumElements);
-	GetSystemTime(&t2);
-	printf("host %d secs, %d mili\n", t2.wSecond-t1.wSecond, t2.wMilliseconds-t1.wMilliseconds);
+	std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+	printf("host %.3f mili\n", std::chrono::duration<double, std::milli>(t2 - t1).count());
 
     // Cleanup and leave
     Cleanup (EXIT_SUCCESS);
@@ -0,0 +1,240 @@
+/*
+ File: oclDotProductBench.cpp
+ Runs the DotProduct variants of DotProduct.cl (vector loads, work coarsening, structure of arrays
+ input) on every device and reports their bandwidth against the device's measured peak, the
+ bandwidth of a streaming copy (CopyBandwidth). Kernel times come from profiling events, best of
+ the repetitions after a warm-up run. Every variant's output is checked against the host.
+ compilation and execution:
+ Windows:
+ cd samples
+ cl /EHsc -I ..\include oclDotProductBench.cpp ..\src\opencl++.cpp ..\lib\Win32\OpenCL.lib
+ oclDotProductBench.exe [-n elements] [-repetitions count]
+ Linux:
+ cd samples
+ g++ -std=c++11 -I ../include oclDotProductBench.cpp ../src/opencl++.cpp -lOpenCL -pthread -o oclDotProductBench
+ ./oclDotProductBench [-n elements] [-repetitions count]
+ Compile with -DUSE_DOUBLE to benchmark double precision, on the devices with native double support.
+*/
+#include <opencl++.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(USE_DOUBLE)
+// double
+typedef cl_double real_t;
+#define BUILD_OPTIONS "-D CONFIG_USE_DOUBLE"
+#define TOLERANCE 1e-12
+#else
+// float
+typedef cl_float real_t;
+#define BUILD_OPTIONS NULL
+#define TOLERANCE 1e-5f
+#endif
+
+// Name of the file with the source code for the computation kernels
+const char* cSourceFile = "DotProduct.cl";
+
+struct Variant {
+	const char *kernel;
+	cl_uint coarsen;      // outputs per work item
+	bool soa;             // structure of arrays input
+};
+
+static const Variant variants[] = {
+	{ "DotProduct", 1, false },
+	{ "DotProductVec4x1", 1, false },
+	{ "DotProductVec4x2", 2, false },
+	{ "DotProductVec4x4", 4, false },
+	{ "DotProductVec4x8", 8, false },
+	{ "DotProductSoAx1", 1, true },
+	{ "DotProductSoAx2", 2, true },
+	{ "DotProductSoAx4", 4, true },
+	{ "DotProductSoAx8", 8, true }
+};
+
+static char* loadSource(const char* cFilename, size_t* szLength)
+{
+	FILE* pFileStream = fopen(cFilename, "rb");
+	if(pFileStream == NULL)
+		return NULL;
+	fseek(pFileStream, 0, SEEK_END);
+	size_t szSourceLength = ftell(pFileStream);
+	fseek(pFileStream, 0, SEEK_SET);
+	char* cSourceString = (char *)malloc(szSourceLength + 1);
+	if(cSourceString == NULL || (szSourceLength > 0 && fread(cSourceString, szSourceLength, 1, pFileStream) != 1)) {
+		fclose(pFileStream);
+		free(cSourceString);
+		return NULL;
+	}
+	fclose(pFileStream);
+	cSourceString[szSourceLength] = '\0';
+	*szLength = szSourceLength;
+	return cSourceString;
+}
+
+// Fastest of repetitions runs in ns after a warm-up run, 0 on failure
+static cl_ulong timeKernel(CLCommandQueue *queue, CLKernel *kernel, const CLLaunchConfig &config, cl_uint repetitions)
+{
+	CLEvent ev;
+	if(queue->enqueueNDRangeKernel(kernel, config, 0, NULL, &ev)->ciErrNum() != CL_SUCCESS || ev.wait() != CL_SUCCESS)
+		return 0;
+	cl_ulong best = 0;
+	for(cl_uint r = 0;r < repetitions;r++) {
+		if(queue->enqueueNDRangeKernel(kernel, config, 0, NULL, &ev)->ciErrNum() != CL_SUCCESS || ev.wait() != CL_SUCCESS)
+			return 0;
+		cl_ulong ns = ev.elapsedNs();
+		if(best == 0 || ns < best)
+			best = ns;
+	}
+	return best;
+}
+
+static bool matches(const real_t *result, const real_t *golden, cl_int iNumElements)
+{
+	for(cl_int i = 0;i < iNumElements;i++) {
+		if(fabs(result[i] - golden[i]) > TOLERANCE * (1 + fabs(golden[i])))
+			return false;
+	}
+	return true;
+}
+
+static void benchmarkDevice(const CLDevice *device, const real_t *aos[2], const real_t *soa[2], const real_t *golden,
+	real_t *result, cl_int iNumElements, cl_uint repetitions)
+{
+	size_t inputBytes = sizeof(real_t) * 4 * iNumElements;
+	size_t outputBytes = sizeof(real_t) * iNumElements;
+	printf("\n%s (%s)\n", device->name(), device->driverVersion());
+#if defined(USE_DOUBLE)
+	if(device->nativeDoubleSupport() == 0) {
+		printf(" skipped: no native double support\n");
+		return;
+	}
+#endif
+	if(device->maxMemAllocSize() < inputBytes || device->globalMemSize() < 5 * inputBytes + outputBytes) {
+		printf(" skipped: not enough memory for %d elements\n", iNumElements);
+		return;
+	}
+
+	CLContext ctx(device, 1);
+	CLCommandQueue queue(&ctx, device, CL_QUEUE_PROFILING_ENABLE);
+	// Embedded or precompiled program if available, else the source file
+	char *cSourceCL = NULL;
+	CLProgram *program = new CLProgram(&ctx, cSourceFile);
+	if(program->ciErrNum() != CL_SUCCESS || program->build(BUILD_OPTIONS) == NULL) {
+		delete program;
+		size_t szKernelLength = 0;
+		cSourceCL = loadSource(cSourceFile, &szKernelLength);
+		if(cSourceCL == NULL) {
+			printf(" cannot read %s\n", cSourceFile);
+			return;
+		}
+		program = (new CLProgram(&ctx, 1, (const char **)&cSourceCL, &szKernelLength))->build(BUILD_OPTIONS);
+	}
+	if(program->ciErrNum() != CL_SUCCESS) {
+		printf(" build failed (%d)\n", program->ciErrNum());
+		delete program;
+		free(cSourceCL);
+		return;
+	}
+
+	CLReadOnlyMem aosA(&ctx, inputBytes), aosB(&ctx, inputBytes), soaA(&ctx, inputBytes), soaB(&ctx, inputBytes);
+	CLWriteOnlyMem copyDst(&ctx, inputBytes), dst(&ctx, outputBytes);
+	queue.enqueueWriteBuffer(&aosA, CL_FALSE, 0, inputBytes, (void *) aos[0])
+		->enqueueWriteBuffer(&aosB, CL_FALSE, 0, inputBytes, (void *) aos[1])
+		->enqueueWriteBuffer(&soaA, CL_FALSE, 0, inputBytes, (void *) soa[0])
+		->enqueueWriteBuffer(&soaB, CL_TRUE, 0, inputBytes, (void *) soa[1]);
+	if(queue.ciErrNum() != CL_SUCCESS) {
+		printf(" upload failed (%d)\n", queue.ciErrNum());
+		delete program;
+		free(cSourceCL);
+		return;
+	}
+
+	// Peak: a copy reads and writes each byte once
+	CLKernel copy(program, "CopyBandwidth");
+	copy.setArg(&aosA)->setArg(&copyDst)->setArg(iNumElements);
+	cl_ulong copyNs = timeKernel(&queue, &copy, CLLaunchConfig(&copy, device, CLNDRange(iNumElements)), repetitions);
+	double peak = copyNs > 0 ? 2.0 * inputBytes / copyNs : 0;
+	printf(" %-18s %9.3f ms %8.2f GB/s\n", "peak (copy)", copyNs * 1e-6, peak);
+
+	// Every variant reads both inputs and writes the output once
+	for(size_t v = 0;v < sizeof(variants) / sizeof(variants[0]);v++) {
+		CLKernel kernel(program, variants[v].kernel);
+		if(kernel.ciErrNum() != CL_SUCCESS) {
+			printf(" %-18s kernel creation failed (%d)\n", variants[v].kernel, kernel.ciErrNum());
+			continue;
+		}
+		kernel.setArg(variants[v].soa ? &soaA : &aosA)->setArg(variants[v].soa ? &soaB : &aosB)->setArg(&dst)->setArg(iNumElements);
+		CLLaunchConfig config(&kernel, device, CLNDRange((iNumElements + variants[v].coarsen - 1) / variants[v].coarsen));
+		memset(result, 0, outputBytes);
+		queue.enqueueWriteBuffer(&dst, CL_TRUE, 0, outputBytes, result);
+		cl_ulong ns = timeKernel(&queue, &kernel, config, repetitions);
+		if(ns == 0) {
+			printf(" %-18s launch failed (%d)\n", variants[v].kernel, queue.ciErrNum());
+			continue;
+		}
+		queue.enqueueReadBuffer(&dst, CL_TRUE, 0, outputBytes, result);
+		double bandwidth = (2.0 * inputBytes + outputBytes) / ns;
+		printf(" %-18s %9.3f ms %8.2f GB/s %6.1f%% of peak, local %u%s\n", variants[v].kernel, ns * 1e-6, bandwidth,
+			peak > 0 ? 100 * bandwidth / peak : 0.0, (unsigned) config.local()[0],
+			matches(result, golden, iNumElements) ? "" : ", WRONG RESULT");
+	}
+	delete program;
+	free(cSourceCL);
+}
+
+int main(int argc, char **argv)
+{
+	cl_int iNumElements = 1 << 22;
+	cl_uint repetitions = 10;
+	for(int i = 1;i + 1 < argc;i += 2) {
+		if(strcmp(argv[i], "-n") == 0)
+			iNumElements = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-repetitions") == 0)
+			repetitions = atoi(argv[i + 1]);
+	}
+	if(iNumElements <= 0) {
+		fprintf(stderr, "usage: %s [-n elements] [-repetitions count]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+#if defined(USE_DOUBLE)
+	printf("Running in double mode...\n");
+#endif
+	printf("%d elements, best of %u runs\n", iNumElements, repetitions);
+
+	// Inputs in both layouts and the host results
+	real_t *aos[2], *soa[2];
+	for(int m = 0;m < 2;m++) {
+		aos[m] = (real_t *) malloc(sizeof(real_t) * 4 * iNumElements);
+		soa[m] = (real_t *) malloc(sizeof(real_t) * 4 * iNumElements);
+		for(cl_int i = 0;i < iNumElements;i++) {
+			for(int j = 0;j < 4;j++) {
+				aos[m][4 * i + j] = (real_t) rand() / RAND_MAX;
+				soa[m][j * iNumElements + i] = aos[m][4 * i + j];
+			}
+		}
+	}
+	real_t *golden = (real_t *) malloc(sizeof(real_t) * iNumElements);
+	real_t *result = (real_t *) malloc(sizeof(real_t) * iNumElements);
+	for(cl_int i = 0;i < iNumElements;i++) {
+		golden[i] = 0;
+		for(int j = 0;j < 4;j++)
+			golden[i] += aos[0][4 * i + j] * aos[1][4 * i + j];
+	}
+
+	const CLPlatform *platforms = CLPlatform::getAllPlatforms();
+	for(cl_uint i = 0;i < CLPlatform::numPlatforms();i++) {
+		for(cl_uint j = 0;j < platforms[i].numDevices();j++)
+			benchmarkDevice(&platforms[i].devices()[j], (const real_t **) aos, (const real_t **) soa, golden, result, iNumElements, repetitions);
+	}
+
+	for(int m = 0;m < 2;m++) {
+		free(aos[m]);
+		free(soa[m]);
+	}
+	free(golden);
+	free(result);
+	return EXIT_SUCCESS;
+}
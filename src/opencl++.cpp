@@ -8,19 +8,56 @@
 #if defined(_WIN32) || defined(_WIN64)
     // Headers needed for Windows
     #include <windows.h>
+    #include <process.h>
+	#define CL_GETPID _getpid
 	#define CL_PLACEMENT_NEW(p, T) (p)->T::T
 	#define CL_PLACEMENT_NEW_TEMPL(p, T, C) (p)->T::C
 #else
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+	#define CL_GETPID getpid
 	#define CL_PLACEMENT_NEW(p, T) new (p) T
 	#define CL_PLACEMENT_NEW_TEMPL(p, T, C) new (p) T
 #endif
 
 #include <iostream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 CLPlatform* CLPlatform::g_allPlatforms = NULL;
-cl_uint CLPlatform::g_numPlatforms = CLPlatform::initLib();
+cl_uint CLPlatform::g_numPlatforms = 0;
+bool CLPlatform::g_discovered = false;
+cl_device_type CLPlatform::g_discoveryDevType = CL_DEVICE_TYPE_ALL;
+char CLPlatform::g_discoveryPlatformName[MAX_CLPLATFORM_NAME_LEN] = "";
+char CLPlatform::g_snapshotPath[MAX_CLSNAPSHOT_PATH_LEN] = "";
 
-CLPlatform::CLPlatform(cl_platform_id __id) : _id(__id), _devices(NULL) {
+// Guards the one time discovery and the discovery filter
+static std::mutex g_discoveryMutex;
+
+// Suffix for the temporary file a writer renames into place. The pid separates processes and the counter
+// separates writers within a process, so concurrent writers of the same path never share a temporary file
+static void tmpFileSuffix(char *buf, size_t size) {
+	static std::atomic<unsigned long> counter(0);
+	snprintf(buf, size, ".%lu.%lu.tmp", (unsigned long) CL_GETPID(), counter++);
+}
+
+CLPlatform::CLPlatform(cl_platform_id __id, cl_device_type devType) : _id(__id), _numDevices(0), _devices(NULL) {
 	cl_int ciErrNum = 0;
 	ciErrNum = clGetPlatformInfo (_id, CL_PLATFORM_NAME, sizeof(_name), &_name, NULL);
 	ciErrNum = clGetPlatformInfo (_id, CL_PLATFORM_PROFILE, sizeof(_profile), &_profile, NULL);
@@ -28,7 +65,12 @@ CLPlatform::CLPlatform(cl_platform_id __id) : _id(__id), _devices(NULL) {
 	ciErrNum = clGetPlatformInfo (_id, CL_PLATFORM_VENDOR, sizeof(_vendor), &_vendor, NULL);
 	ciErrNum = clGetPlatformInfo (_id, CL_PLATFORM_EXTENSIONS, sizeof(_extensions), &_extensions, NULL);
 	ciErrNum = clGetPlatformInfo (_id, CL_PLATFORM_ICD_SUFFIX_KHR, sizeof(_icd_suffix), &_icd_suffix, NULL);
-	ciErrNum = clGetDeviceIDs(_id, CL_DEVICE_TYPE_ALL, 0, NULL, &_numDevices);
+	ciErrNum = clGetDeviceIDs(_id, devType, 0, NULL, &_numDevices);
+	if (ciErrNum != CL_SUCCESS || _numDevices == 0) {
+		// CL_DEVICE_NOT_FOUND when the platform has no device of devType
+		_numDevices = 0;
+		return;
+	}
 
 	cl_device_id* cdDeviceIds = new cl_device_id[_numDevices];
 	if (cdDeviceIds == NULL) {
@@ -38,7 +80,7 @@ CLPlatform::CLPlatform(cl_platform_id __id) : _id(__id), _devices(NULL) {
 	void* raw_memory = operator new[]( _numDevices * sizeof( CLDevice ) );
     _devices = static_cast<CLDevice*>(raw_memory);
 
-	ciErrNum = clGetDeviceIDs(_id, CL_DEVICE_TYPE_ALL, _numDevices, cdDeviceIds, NULL);
+	ciErrNum = clGetDeviceIDs(_id, devType, _numDevices, cdDeviceIds, NULL);
     for( cl_uint i = 0; i < _numDevices; ++i ) {
 #ifndef _WINDOWS_
         new (&_devices[i]) CLDevice(cdDeviceIds[i]);
@@ -61,36 +103,390 @@ cl_uint CLPlatform::initLib() {
 	if (clPlatformIDs == NULL) {
 		return 0;
 	}
+	ciErrNum = clGetPlatformIDs (num_platforms, clPlatformIDs, NULL);
+
+	// Drop the platforms not matching the name filter before querying any of their attributes or devices
+	cl_uint num_selected = 0;
+	for( cl_uint i = 0; i < num_platforms; ++i ) {
+		if (g_discoveryPlatformName[0] != '\0') {
+			char name[MAX_CLPLATFORM_NAME_LEN];
+			name[0] = '\0';
+			clGetPlatformInfo (clPlatformIDs[i], CL_PLATFORM_NAME, sizeof(name), name, NULL);
+			if (strstr(name, g_discoveryPlatformName) == NULL)
+				continue;
+		}
+		clPlatformIDs[num_selected++] = clPlatformIDs[i];
+	}
+	if (num_selected == 0) {
+		delete[] clPlatformIDs;
+		return 0;
+	}
+
+	const char *snapshotPath = g_snapshotPath[0] != '\0' ? g_snapshotPath : getenv("OPENCLPP_SNAPSHOT");
+	if (snapshotPath != NULL && snapshotPath[0] != '\0' && loadSnapshot(snapshotPath, clPlatformIDs, num_selected)) {
+		delete[] clPlatformIDs;
+		return num_selected;
+	}
 
-	void* raw_memory = operator new[]( num_platforms * sizeof( CLPlatform ) );
+	void* raw_memory = operator new[]( num_selected * sizeof( CLPlatform ) );
     g_allPlatforms = static_cast<CLPlatform*>( raw_memory );
 
-	ciErrNum = clGetPlatformIDs (num_platforms, clPlatformIDs, NULL);
-    for( cl_uint i = 0; i < num_platforms; ++i ) {
+    for( cl_uint i = 0; i < num_selected; ++i ) {
 #ifndef _WINDOWS_
-        new (&g_allPlatforms[i]) CLPlatform(clPlatformIDs[i]);
+        new (&g_allPlatforms[i]) CLPlatform(clPlatformIDs[i], g_discoveryDevType);
 #else
-		(&g_allPlatforms[i])->CLPlatform::CLPlatform( clPlatformIDs[i] );
+		(&g_allPlatforms[i])->CLPlatform::CLPlatform( clPlatformIDs[i], g_discoveryDevType );
 #endif
     }
 
 	delete[] clPlatformIDs;
-	return num_platforms;
+	if (snapshotPath != NULL && snapshotPath[0] != '\0')
+		saveSnapshot(snapshotPath, num_selected);
+	return num_selected;
+}
+
+// Snapshot file: header followed by, for each platform, the CLPlatform bytes and its CLDevice array.
+// Handles and pointers stored in it are meaningless and replaced on load.
+#define CLSNAPSHOT_MAGIC "OCLPPSNP"
+#define CLSNAPSHOT_FORMAT_VERSION 1
+
+struct CLSnapshotHeader {
+	char magic[8];
+	cl_uint formatVersion;
+	cl_uint platformSize;
+	cl_uint deviceSize;
+	cl_uint numPlatforms;
+	cl_device_type devType;
+	char platformName[MAX_CLPLATFORM_NAME_LEN];
+};
+
+static_assert(std::is_trivially_copyable<CLPlatform>::value && std::is_trivially_copyable<CLDevice>::value,
+	"CLPlatform and CLDevice are stored byte for byte in the snapshot");
+
+bool CLPlatform::loadSnapshot(const char *path, const cl_platform_id *ids, cl_uint numPlatforms) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL)
+		return false;
+	fseek(fp, 0, SEEK_END);
+	long fileSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (fileSize < (long) sizeof(CLSnapshotHeader)) {
+		fclose(fp);
+		return false;
+	}
+	char *buf = new char[fileSize];
+	bool ok = fread(buf, fileSize, 1, fp) == 1;
+	fclose(fp);
+
+	CLSnapshotHeader header;
+	memcpy(&header, buf, sizeof(header));
+	ok = ok && memcmp(header.magic, CLSNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+		&& header.formatVersion == CLSNAPSHOT_FORMAT_VERSION
+		&& header.platformSize == sizeof(CLPlatform) && header.deviceSize == sizeof(CLDevice)
+		&& header.numPlatforms == numPlatforms && header.devType == g_discoveryDevType
+		&& strncmp(header.platformName, g_discoveryPlatformName, MAX_CLPLATFORM_NAME_LEN) == 0;
+	if (!ok) {
+		delete[] buf;
+		return false;
+	}
+
+	CLPlatform *platforms = static_cast<CLPlatform*>(operator new[]( numPlatforms * sizeof( CLPlatform ) ));
+	for (cl_uint i = 0; i < numPlatforms; ++i)
+		platforms[i]._devices = NULL;
+	size_t offset = sizeof(CLSnapshotHeader);
+	for (cl_uint i = 0; ok && i < numPlatforms; ++i) {
+		CLPlatform &p = platforms[i];
+		if (offset + sizeof(CLPlatform) > (size_t) fileSize) {
+			ok = false;
+			break;
+		}
+		memcpy(&p, buf + offset, sizeof(CLPlatform));
+		offset += sizeof(CLPlatform);
+		p._id = ids[i];
+		p._devices = NULL;
+
+		// Cheap live checks: ICD suffix, platform version and device count
+		char icdSuffix[MAX_CLPLATFORM_ICD_SUFFIX_LEN] = "";
+		char version[MAX_CLPLATFORM_VERSION_LEN] = "";
+		cl_uint numDevices = 0;
+		clGetPlatformInfo (p._id, CL_PLATFORM_ICD_SUFFIX_KHR, sizeof(icdSuffix), icdSuffix, NULL);
+		clGetPlatformInfo (p._id, CL_PLATFORM_VERSION, sizeof(version), version, NULL);
+		if (clGetDeviceIDs(p._id, g_discoveryDevType, 0, NULL, &numDevices) != CL_SUCCESS)
+			numDevices = 0;
+		if (strcmp(icdSuffix, p._icd_suffix) != 0 || strcmp(version, p._version) != 0 || numDevices != p._numDevices
+			|| offset + numDevices * sizeof(CLDevice) > (size_t) fileSize) {
+			ok = false;
+			break;
+		}
+		if (numDevices == 0)
+			continue;
+
+		cl_device_id* cdDeviceIds = new cl_device_id[numDevices];
+		clGetDeviceIDs(p._id, g_discoveryDevType, numDevices, cdDeviceIds, NULL);
+		p._devices = static_cast<CLDevice*>(operator new[]( numDevices * sizeof( CLDevice ) ));
+		memcpy(p._devices, buf + offset, numDevices * sizeof(CLDevice));
+		offset += numDevices * sizeof(CLDevice);
+		for (cl_uint j = 0; ok && j < numDevices; ++j) {
+			CLDevice &d = p._devices[j];
+			d._id = cdDeviceIds[j];
+			char name[MAX_DEVICE_NAME] = "";
+			char driverVersion[MAX_DEVICE_DRIVER_VERSION_LEN] = "";
+			clGetDeviceInfo(d._id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+			clGetDeviceInfo(d._id, CL_DRIVER_VERSION, sizeof(driverVersion), driverVersion, NULL);
+			ok = strcmp(name, d._name) == 0 && strcmp(driverVersion, d._driverVersion) == 0;
+		}
+		delete[] cdDeviceIds;
+	}
+	delete[] buf;
+
+	if (!ok) {
+		// Stale or corrupt snapshot: fall back to the live discovery which rewrites it
+		for (cl_uint i = 0; i < numPlatforms; ++i)
+			operator delete[]( platforms[i]._devices );
+		operator delete[]( platforms );
+		return false;
+	}
+	g_allPlatforms = platforms;
+	return true;
+}
+
+void CLPlatform::saveSnapshot(const char *path, cl_uint numPlatforms) {
+	// Write to a temporary file and rename it so concurrent readers never see a partial snapshot
+	char tmpPath[MAX_CLSNAPSHOT_PATH_LEN + 64];
+	char suffix[64];
+	tmpFileSuffix(suffix, sizeof(suffix));
+	snprintf(tmpPath, sizeof(tmpPath), "%s%s", path, suffix);
+	FILE *fp = fopen(tmpPath, "wb");
+	if (fp == NULL)
+		return;
+
+	CLSnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLSNAPSHOT_MAGIC, sizeof(header.magic));
+	header.formatVersion = CLSNAPSHOT_FORMAT_VERSION;
+	header.platformSize = sizeof(CLPlatform);
+	header.deviceSize = sizeof(CLDevice);
+	header.numPlatforms = numPlatforms;
+	header.devType = g_discoveryDevType;
+	strncpy(header.platformName, g_discoveryPlatformName, MAX_CLPLATFORM_NAME_LEN - 1);
+
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	for (cl_uint i = 0; ok && i < numPlatforms; ++i) {
+		const CLPlatform &p = g_allPlatforms[i];
+		ok = fwrite(&p, sizeof(CLPlatform), 1, fp) == 1;
+		if (ok && p._numDevices > 0)
+			ok = fwrite(p._devices, sizeof(CLDevice), p._numDevices, fp) == p._numDevices;
+	}
+	ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(tmpPath, path) != 0)
+		remove(tmpPath);
 }
 
 const CLPlatform *CLPlatform::getAllPlatforms() {
+	std::lock_guard<std::mutex> lock(g_discoveryMutex);
+	if (!g_discovered) {
+		g_numPlatforms = initLib();
+		g_discovered = true;
+	}
 	return g_allPlatforms;
 }
 
+cl_uint CLPlatform::numPlatforms() {
+	getAllPlatforms();
+	return g_numPlatforms;
+}
+
+bool CLPlatform::setDiscoveryFilter(cl_device_type devType, const char *platformName) {
+	std::lock_guard<std::mutex> lock(g_discoveryMutex);
+	if (g_discovered)
+		return false;
+	g_discoveryDevType = devType;
+	g_discoveryPlatformName[0] = '\0';
+	if (platformName != NULL) {
+		strncpy(g_discoveryPlatformName, platformName, MAX_CLPLATFORM_NAME_LEN - 1);
+		g_discoveryPlatformName[MAX_CLPLATFORM_NAME_LEN - 1] = '\0';
+	}
+	return true;
+}
+
+bool CLPlatform::setSnapshotFile(const char *path) {
+	std::lock_guard<std::mutex> lock(g_discoveryMutex);
+	if (g_discovered)
+		return false;
+	g_snapshotPath[0] = '\0';
+	if (path != NULL) {
+		strncpy(g_snapshotPath, path, MAX_CLSNAPSHOT_PATH_LEN - 1);
+		g_snapshotPath[MAX_CLSNAPSHOT_PATH_LEN - 1] = '\0';
+	}
+	return true;
+}
+
+cl_uint CLPlatform::rankDevices(int profile, const CLDevice **ranked, cl_uint maxDevices, cl_ulong workingSetBytes, cl_device_type devType) {
+	const CLPlatform *platforms = getAllPlatforms();
+	double *scores = new double[maxDevices];
+	cl_uint numRanked = 0;
+	for (cl_uint i = 0; i < g_numPlatforms; i++) {
+		for (cl_uint j = 0; j < platforms[i].numDevices(); j++) {
+			const CLDevice *device = &platforms[i].devices()[j];
+			double score = (device->devType() & devType) ? device->score(profile, workingSetBytes) : 0;
+			if (score <= 0)
+				continue;
+			// insertion into the sorted (descending) array, dropping the worst when full
+			cl_uint pos = numRanked;
+			while (pos > 0 && scores[pos - 1] < score)
+				pos--;
+			if (pos >= maxDevices)
+				continue;
+			cl_uint last = numRanked < maxDevices ? numRanked : maxDevices - 1;
+			for (cl_uint k = last; k > pos; k--) {
+				scores[k] = scores[k - 1];
+				ranked[k] = ranked[k - 1];
+			}
+			scores[pos] = score;
+			ranked[pos] = device;
+			if (numRanked < maxDevices)
+				numRanked++;
+		}
+	}
+	delete[] scores;
+	return numRanked;
+}
+
+const CLDevice *CLPlatform::bestDevice(int profile, cl_ulong workingSetBytes, cl_device_type devType) {
+	const CLDevice *best = NULL;
+	return rankDevices(profile, &best, 1, workingSetBytes, devType) > 0 ? best : NULL;
+}
+
+// Queries a scalar device attribute, 0 when the device does not support the query (e.g. vendor extension attributes)
+template <typename T>
+static cl_int getDeviceInfo(cl_device_id id, cl_device_info param, T &value) {
+	cl_int ciErrNum = clGetDeviceInfo(id, param, sizeof(T), &value, NULL);
+	if (ciErrNum != CL_SUCCESS)
+		value = 0;
+	return ciErrNum;
+}
+
 CLDevice::CLDevice(cl_device_id __id) : _id(__id), _devType(0) {
 	cl_int ciErrNum = 0;
     ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_NAME, sizeof(_name), &_name, NULL);
-    ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(_numComputeUnits), &_numComputeUnits, NULL);
-	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(_maxWorkGroupSize), &_maxWorkGroupSize, NULL);
-	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(_maxWorkItemSizes), _maxWorkItemSizes, NULL);
-	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_TYPE, sizeof(_devType), &_devType, NULL);
-	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE, sizeof(_nativeDoubleSupport), &_nativeDoubleSupport, NULL);
-	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, sizeof(_preferredDoubleSupport), &_preferredDoubleSupport, NULL);
+    ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_VENDOR, sizeof(_vendor), &_vendor, NULL);
+    ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_VERSION, sizeof(_version), &_version, NULL);
+    ciErrNum = clGetDeviceInfo(_id, CL_DRIVER_VERSION, sizeof(_driverVersion), &_driverVersion, NULL);
+    ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_COMPUTE_UNITS, _numComputeUnits);
+
+	// work group limits are size_t in the API
+	size_t maxWorkGroupSize = 0;
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_WORK_GROUP_SIZE, maxWorkGroupSize);
+	_maxWorkGroupSize = (cl_uint) maxWorkGroupSize;
+	cl_uint workItemDims = 0;
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, workItemDims);
+	size_t *maxWorkItemSizes = new size_t[workItemDims > 3 ? workItemDims : 3];
+	maxWorkItemSizes[0] = maxWorkItemSizes[1] = maxWorkItemSizes[2] = 0;
+	ciErrNum = clGetDeviceInfo(_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t) * workItemDims, maxWorkItemSizes, NULL);
+	for (int i = 0; i < 3; i++)
+		_maxWorkItemSizes[i] = (cl_uint) maxWorkItemSizes[i];
+	delete[] maxWorkItemSizes;
+
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_TYPE, _devType);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_DOUBLE, _nativeDoubleSupport);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE, _preferredDoubleSupport);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_CLOCK_FREQUENCY, _maxClockFrequency);
+
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_GLOBAL_MEM_SIZE, _globalMemSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_LOCAL_MEM_SIZE, _localMemSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_LOCAL_MEM_TYPE, _localMemType);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, _maxConstantBufferSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MAX_MEM_ALLOC_SIZE, _maxMemAllocSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE, _globalMemCacheLineSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, _globalMemCacheSize);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, _memBaseAddrAlign);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_HOST_UNIFIED_MEMORY, _hostUnifiedMemory);
+
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR, _preferredVectorWidthChar);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT, _preferredVectorWidthShort);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, _preferredVectorWidthInt);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG, _preferredVectorWidthLong);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, _preferredVectorWidthFloat);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PREFERRED_VECTOR_WIDTH_HALF, _preferredVectorWidthHalf);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_CHAR, _nativeVectorWidthChar);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_SHORT, _nativeVectorWidthShort);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_INT, _nativeVectorWidthInt);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_LONG, _nativeVectorWidthLong);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, _nativeVectorWidthFloat);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_NATIVE_VECTOR_WIDTH_HALF, _nativeVectorWidthHalf);
+
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_QUEUE_PROPERTIES, _queueProperties);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PROFILING_TIMER_RESOLUTION, _profilingTimerResolution);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_PROFILING_TIMER_OFFSET_AMD, _profilingTimerOffsetAMD);
+
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV, _computeCapabilityMajorNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV, _computeCapabilityMinorNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_REGISTERS_PER_BLOCK_NV, _registersPerBlockNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_WARP_SIZE_NV, _warpSizeNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_GPU_OVERLAP_NV, _gpuOverlapNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_KERNEL_EXEC_TIMEOUT_NV, _kernelExecTimeoutNV);
+	ciErrNum = getDeviceInfo(_id, CL_DEVICE_INTEGRATED_MEMORY_NV, _integratedMemoryNV);
+}
+
+cl_uint CLDevice::lanesPerComputeUnit() const {
+	if (_computeCapabilityMajorNV > 0) {
+		// CUDA cores per SM by compute capability
+		switch (_computeCapabilityMajorNV) {
+		case 1: return 8;
+		case 2: return _computeCapabilityMinorNV == 0 ? 32 : 48;
+		case 3: return 192;
+		case 6: return _computeCapabilityMinorNV == 0 ? 64 : 128;
+		case 7: return 64;
+		case 8: return _computeCapabilityMinorNV == 0 ? 64 : 128;
+		default: return 128;
+		}
+	}
+	if (isGpu())
+		return (strstr(_vendor, "AMD") || strstr(_vendor, "Advanced Micro Devices")) ? 64 : 16;
+	// CPU cores and accelerators: SIMD width
+	return _nativeVectorWidthFloat > 0 ? _nativeVectorWidthFloat : 1;
+}
+
+double CLDevice::score(int profile, cl_ulong workingSetBytes) const {
+	if (workingSetBytes > _globalMemSize)
+		return 0;
+	bool hasDouble = _nativeDoubleSupport > 0 || _preferredDoubleSupport > 0;
+	if ((profile & (DOUBLE_HEAVY | REQUIRES_DOUBLE)) && !hasDouble)
+		return 0;
+
+	double clock = _maxClockFrequency > 0 ? _maxClockFrequency : 1;
+	double compute = (double) _numComputeUnits * lanesPerComputeUnit() * clock;
+	double bandwidth = (double) _numComputeUnits * clock * (_globalMemCacheLineSize > 64 ? _globalMemCacheLineSize : 64);
+	// devices sharing host RAM compete with the host for its (much lower) bandwidth
+	if (_hostUnifiedMemory || _integratedMemoryNV)
+		bandwidth *= 0.25;
+
+	double result = 1;
+	int terms = 0;
+	if (profile & BANDWIDTH_BOUND) {
+		result *= bandwidth;
+		terms++;
+	}
+	if (profile & DOUBLE_HEAVY) {
+		// double to float throughput ratio: vector widths on CPUs, 1/2 on NV compute GPUs (x.0 of Fermi, Pascal,
+		// Volta, Ampere), 1/16 on other GPUs where the attributes do not tell
+		double ratio = 1.0 / 16;
+		if (!isGpu())
+			ratio = (_nativeVectorWidthFloat > 0 && _nativeDoubleSupport > 0) ? (double) _nativeDoubleSupport / _nativeVectorWidthFloat : 0.5;
+		else if (_computeCapabilityMinorNV == 0 && (_computeCapabilityMajorNV == 2 || _computeCapabilityMajorNV >= 6))
+			ratio = 0.5;
+		result *= compute * ratio;
+		terms++;
+	}
+	else if ((profile & COMPUTE_BOUND) || terms == 0) {
+		result *= compute;
+		terms++;
+	}
+	return terms > 1 ? pow(result, 1.0 / terms) : result;
 }
 
 CLContext::CLContext(const CLDevice *devices, cl_uint numDevices) : _devices(devices), _numDevices(numDevices) {
@@ -102,7 +498,11 @@ CLContext::CLContext(const CLDevice *devices, cl_uint numDevices) : _devices(dev
 	delete[] cdDeviceIds;
 }
 
+// Frees the context's primitive programs, see primitiveProgram
+static void releasePrimitivePrograms(const CLContext *ctx);
+
 CLContext::~CLContext() {
+	releasePrimitivePrograms(this);
 	clReleaseContext(_id);
 }
 
@@ -111,44 +511,750 @@ void CLContext::callback(const char *errInfo, const void * /* private_info */, s
 	std::cerr << "Error on context: " << this_ptr->id() << ": " << errInfo << std::endl;
 }
 
-CLCommandQueue::CLCommandQueue(CLContext *ctx, CLDevice *device) : _ctx(ctx), _device(device), _ciErrNum(0) {
+// Memory access of one command, see CLDependencyTracker
+struct CLMemAccess {
+	cl_mem mem;
+	int access;
+};
+
+// Read/write hazard tracking for out-of-order queues: remembers for every memory object the last
+// writing command and the reading commands since, and derives the events a new command must wait for.
+class CLDependencyTracker {
+private:
+	struct MemState {
+		CLEvent lastWrite;
+		std::vector<CLEvent> reads;
+	};
+	std::mutex _mutex;
+	std::map<cl_mem, MemState> _states;
+
+	static void addDependency(std::vector<cl_event> &deps, const CLEvent &ev) {
+		if (!ev.valid() || ev.status() == CL_COMPLETE)
+			return;
+		for (size_t i = 0; i < deps.size(); i++) {
+			if (deps[i] == ev.id())
+				return;
+		}
+		deps.push_back(ev.id());
+	}
+
+	// Drops the completed commands of a state, true if none is left
+	static bool dropCompleted(MemState &state) {
+		size_t kept = 0;
+		for (size_t i = 0; i < state.reads.size(); i++) {
+			if (state.reads[i].status() > CL_COMPLETE)
+				state.reads[kept++] = state.reads[i];
+		}
+		state.reads.resize(kept);
+		if (state.lastWrite.valid() && state.lastWrite.status() <= CL_COMPLETE)
+			state.lastWrite.reset();
+		return kept == 0 && !state.lastWrite.valid();
+	}
+
+	// Drops the states whose commands have all completed, so that the map does not grow with every buffer ever used
+	void prune() {
+		std::map<cl_mem, MemState>::iterator it = _states.begin();
+		while (it != _states.end()) {
+			if (dropCompleted(it->second))
+				_states.erase(it++);
+			else
+				++it;
+		}
+	}
+public:
+	// Locks the tracker and fills deps with the caller's wait list and the hazards of the accesses
+	void begin(const CLMemAccess *accesses, cl_uint numAccesses, cl_uint numWaitEvents, const CLEvent *waitList, std::vector<cl_event> &deps) {
+		_mutex.lock();
+		for (cl_uint i = 0; waitList != NULL && i < numWaitEvents; i++) {
+			if (waitList[i].valid())
+				deps.push_back(waitList[i].id());
+		}
+		for (cl_uint i = 0; i < numAccesses; i++) {
+			std::map<cl_mem, MemState>::iterator it = _states.find(accesses[i].mem);
+			if (it == _states.end())
+				continue;
+			// read after write, write after write
+			addDependency(deps, it->second.lastWrite);
+			// write after read
+			if (accesses[i].access & CLMem::WRITE) {
+				for (size_t j = 0; j < it->second.reads.size(); j++)
+					addDependency(deps, it->second.reads[j]);
+			}
+		}
+	}
+
+	// Records the command's event for its accesses and unlocks the tracker
+	void commit(const CLMemAccess *accesses, cl_uint numAccesses, cl_event ev) {
+		if (ev != NULL) {
+			if (_states.size() > 256)
+				prune();
+			for (cl_uint i = 0; i < numAccesses; i++) {
+				MemState &state = _states[accesses[i].mem];
+				if (accesses[i].access & CLMem::WRITE) {
+					state.lastWrite = CLEvent(ev, true);
+					state.reads.clear();
+				}
+				else {
+					// the reads in flight only: a buffer read over and over keeps a short list
+					dropCompleted(state);
+					state.reads.push_back(CLEvent(ev, true));
+				}
+			}
+		}
+		_mutex.unlock();
+	}
+};
+
+// Wait list of one enqueue call: the caller's valid events, plus the hazards when the queue tracks dependencies.
+// Default constructed events are skipped as CLEvent::waitAll does.
+class CLWaitList {
+private:
+	CLDependencyTracker *_tracker;
+	const CLMemAccess *_accesses;
+	cl_uint _numAccesses;
+	cl_uint _size;
+	const cl_event *_ids;
+	std::vector<cl_event> _deps;
+public:
+	CLWaitList(CLDependencyTracker *tracker, const CLMemAccess *accesses, cl_uint numAccesses, cl_uint numWaitEvents, const CLEvent *waitList)
+		: _tracker(tracker), _accesses(accesses), _numAccesses(numAccesses), _size(0), _ids(NULL) {
+		if (_tracker) {
+			_tracker->begin(accesses, numAccesses, numWaitEvents, waitList, _deps);
+			_size = (cl_uint) _deps.size();
+			_ids = _size > 0 ? &_deps[0] : NULL;
+		}
+		else if (numWaitEvents > 0 && waitList != NULL) {
+			cl_uint numValid = 0;
+			while (numValid < numWaitEvents && waitList[numValid].valid())
+				numValid++;
+			if (numValid == numWaitEvents) {
+				// CLEvent has the layout of a cl_event
+				_size = numWaitEvents;
+				_ids = reinterpret_cast<const cl_event*>(waitList);
+				return;
+			}
+			for (cl_uint i = 0; i < numWaitEvents; i++) {
+				if (waitList[i].valid())
+					_deps.push_back(waitList[i].id());
+			}
+			_size = (cl_uint) _deps.size();
+			_ids = _size > 0 ? &_deps[0] : NULL;
+		}
+	}
+	~CLWaitList() {
+		if (_tracker)
+			_tracker->commit(_accesses, _numAccesses, NULL);
+	}
+	cl_uint size() const { return _size; }
+	const cl_event *ids() const { return _ids; }
+	// Records the command's event, to be called right after the enqueue call
+	void commit(cl_event ev) {
+		if (_tracker) {
+			_tracker->commit(_accesses, _numAccesses, ev);
+			_tracker = NULL;
+		}
+	}
+};
+
+struct CLKernel::LaunchMutex {
+	std::mutex mutex;
+};
+
+struct CLKernel::TunedSizes {
+	std::mutex mutex;
+	bool hashed;
+	cl_ulong kernelKey;
+	// tuning database generation the sizes were looked up in
+	unsigned long generation;
+	std::map<std::pair<const CLDevice*, cl_uint>, size_t> sizes;
+
+	TunedSizes() : hashed(false), kernelKey(0), generation(0) {}
+};
+
+CLCommandQueue::CLCommandQueue(CLContext *ctx, const CLDevice *device, cl_command_queue_properties properties)
+	: _ctx(ctx), _device(device ? device : ctx->devices()), _properties(properties), _profiler(NULL), _tracker(NULL),
+	_zeroCopy(_device->hostUnifiedMemory()), _ciErrNum(0) {
 	init();
 }
 
 void CLCommandQueue::init() {
-	_id = clCreateCommandQueue(_ctx->id(), _device ? _device->id() : _ctx->devices()->id(), 0, &_ciErrNum);
+	_id = clCreateCommandQueue(_ctx->id(), _device->id(), _properties, &_ciErrNum);
+	if (_ciErrNum == CL_SUCCESS && (_properties & CL_QUEUE_PROFILING_ENABLE))
+		_profiler = new CLProfiler();
+	if (_ciErrNum == CL_SUCCESS && (_properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE))
+		_tracker = new CLDependencyTracker();
 }
 
 CLCommandQueue::~CLCommandQueue() {
+	if (_profiler || _tracker)
+		clFinish(_id);
+	delete _profiler;
+	delete _tracker;
 	clReleaseCommandQueue(_id);
 }
 
-CLCommandQueue* CLCommandQueue::enqueueWriteBuffer(CLMem *srcMem, bool blocking, size_t offset, size_t cb, void *src) {
-	_ciErrNum = clEnqueueWriteBuffer(_id, srcMem->id(), blocking, offset, cb, src, 0, NULL, NULL);
+void CLCommandQueue::enqueued(cl_event ev, CLEvent *event, CLProfileStats::Kind kind, const char *name, size_t bytes) {
+	if (ev == NULL)
+		return;
+	CLEvent owned(ev);
+	if (_profiler)
+		_profiler->record(owned, kind, name, bytes);
+	if (event)
+		*event = owned;
+}
+
+// CLEvent has the layout of a cl_event so that an array of CLEvent can be passed as an event wait list
+static_assert(sizeof(CLEvent) == sizeof(cl_event), "CLEvent must only wrap a cl_event");
+
+CLCommandQueue* CLCommandQueue::enqueueWriteBuffer(CLMem *srcMem, bool blocking, size_t offset, size_t cb, void *src,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (blocking && _zeroCopy) {
+		void *mapped = mapBuffer(srcMem, true, CL_MAP_WRITE, offset, cb, numWaitEvents, waitList, NULL);
+		if (mapped != NULL) {
+			if (mapped != src)
+				memcpy(mapped, src, cb);
+			// the unmap hands the data to the device: it is the transfer the caller and the profiler see
+			cl_event ev = NULL;
+			unmapMemObject(srcMem, mapped, 0, NULL, (event || _profiler) ? &ev : NULL);
+			enqueued(ev, event, CLProfileStats::HOST_TO_DEVICE, NULL, cb);
+			return this;
+		}
+		// transfer path below if the buffer cannot be mapped
+	}
+	cl_event ev = NULL;
+	CLMemAccess access = { srcMem->id(), CLMem::WRITE };
+	CLWaitList deps(_tracker, &access, 1, numWaitEvents, waitList);
+	_ciErrNum = clEnqueueWriteBuffer(_id, srcMem->id(), blocking && !_tracker, offset, cb, src,
+		deps.size(), deps.ids(), (event || _profiler || _tracker) ? &ev : NULL);
+	deps.commit(ev);
+	// a blocking call on a tracked queue waits after the tracker is released
+	if (blocking && _tracker && ev != NULL)
+		clWaitForEvents(1, &ev);
+	enqueued(ev, event, CLProfileStats::HOST_TO_DEVICE, NULL, cb);
 	return this;
 }
 
 CLCommandQueue* CLCommandQueue::enqueueNDRangeKernel(CLKernel *kernel, cl_uint dim, const size_t* global_work_offset,
                        const size_t* global_work_size,
-					   const size_t* local_work_size) {
-	_ciErrNum = clEnqueueNDRangeKernel(_id, kernel->id(), dim, global_work_offset, global_work_size, local_work_size, 0, NULL, NULL);
+					   const size_t* local_work_size,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	// tuned local size, see CLAutotuner
+	size_t tunedLocalSize = 0;
+	if (local_work_size == NULL && dim == 1 && global_work_size != NULL) {
+		tunedLocalSize = CLAutotuner::localSize(kernel, _device, global_work_size[0]);
+		if (tunedLocalSize != 0 && global_work_size[0] % tunedLocalSize == 0)
+			local_work_size = &tunedLocalSize;
+	}
+	cl_event ev = NULL;
+	std::vector<CLMemAccess> accesses;
+	if (_tracker) {
+		for (cl_uint i = 0; i < kernel->numArgs(); i++) {
+			if (kernel->memArg(i) != NULL) {
+				CLMemAccess access = { kernel->memArg(i)->id(), kernel->memArgAccess(i) };
+				accesses.push_back(access);
+			}
+		}
+	}
+	CLWaitList deps(_tracker, accesses.empty() ? NULL : &accesses[0], (cl_uint) accesses.size(), numWaitEvents, waitList);
+	_ciErrNum = clEnqueueNDRangeKernel(_id, kernel->id(), dim, global_work_offset, global_work_size, local_work_size,
+		deps.size(), deps.ids(), (event || _profiler || _tracker) ? &ev : NULL);
+	deps.commit(ev);
+	enqueued(ev, event, CLProfileStats::KERNEL, kernel->name(), 0);
+	return this;
+}
+
+CLCommandQueue* CLCommandQueue::enqueueNDRangeKernel(CLKernel *kernel, const CLNDRange &global, const CLNDRange &local,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (local.dim() != 0 && local.dim() != global.dim()) {
+		_ciErrNum = CL_INVALID_WORK_DIMENSION;
+		return this;
+	}
+	return enqueueNDRangeKernel(kernel, global.dim(), NULL, global.sizes(), local.sizes(), numWaitEvents, waitList, event);
+}
+
+CLCommandQueue* CLCommandQueue::enqueueKernel(CLKernel *kernel, cl_uint numArgs, const CLKernelArg *args,
+					   const CLNDRange &global, const CLNDRange &local,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	// clSetKernelArg and clEnqueueNDRangeKernel on a shared cl_kernel must not interleave between threads:
+	// the enqueue captures the argument values, so the kernel can be rebound once it returns
+	std::lock_guard<std::mutex> lock(kernel->_launchMutex->mutex);
+	_ciErrNum = kernel->setArgs(numArgs, args);
+	if (_ciErrNum != CL_SUCCESS)
+		return this;
+	return enqueueNDRangeKernel(kernel, global, local, numWaitEvents, waitList, event);
+}
+
+CLCommandQueue* CLCommandQueue::enqueueReadBuffer(CLMem *dstMem, bool blocking, size_t offset, size_t cb, void *dst,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (blocking && _zeroCopy) {
+		// the map makes the data visible to the host: it is the transfer the profiler sees
+		cl_event ev = NULL;
+		void *mapped = mapBuffer(dstMem, true, CL_MAP_READ, offset, cb, numWaitEvents, waitList, _profiler ? &ev : NULL);
+		enqueued(ev, NULL, CLProfileStats::DEVICE_TO_HOST, NULL, cb);
+		if (mapped != NULL) {
+			if (mapped != dst)
+				memcpy(dst, mapped, cb);
+			// the caller's event completes once the buffer is unmapped again
+			ev = NULL;
+			unmapMemObject(dstMem, mapped, 0, NULL, event ? &ev : NULL);
+			if (ev != NULL)
+				*event = CLEvent(ev);
+			return this;
+		}
+	}
+	cl_event ev = NULL;
+	CLMemAccess access = { dstMem->id(), CLMem::READ };
+	CLWaitList deps(_tracker, &access, 1, numWaitEvents, waitList);
+	_ciErrNum = clEnqueueReadBuffer(_id, dstMem->id(), blocking && !_tracker, offset, cb, dst,
+		deps.size(), deps.ids(), (event || _profiler || _tracker) ? &ev : NULL);
+	deps.commit(ev);
+	if (blocking && _tracker && ev != NULL)
+		clWaitForEvents(1, &ev);
+	enqueued(ev, event, CLProfileStats::DEVICE_TO_HOST, NULL, cb);
+	return this;
+}
+
+void *CLCommandQueue::mapBuffer(CLMem *mem, bool blocking, cl_map_flags flags, size_t offset, size_t cb,
+					   cl_uint numWaitEvents, const CLEvent *waitList, cl_event *event) {
+	cl_event ev = NULL;
+	// a map for writing is a write hazard: the host may change the data
+	CLMemAccess access = { mem->id(), (flags & CL_MAP_WRITE) ? CLMem::WRITE : CLMem::READ };
+	CLWaitList deps(_tracker, &access, 1, numWaitEvents, waitList);
+	void *mapped = clEnqueueMapBuffer(_id, mem->id(), blocking && !_tracker, flags, offset, cb,
+		deps.size(), deps.ids(), (event || _tracker) ? &ev : NULL, &_ciErrNum);
+	deps.commit(ev);
+	if (blocking && _tracker && ev != NULL)
+		clWaitForEvents(1, &ev);
+	if (event)
+		*event = ev;
+	else if (ev != NULL)
+		clReleaseEvent(ev);
+	return _ciErrNum == CL_SUCCESS ? mapped : NULL;
+}
+
+void CLCommandQueue::unmapMemObject(CLMem *mem, void *mapped, cl_uint numWaitEvents, const CLEvent *waitList, cl_event *event) {
+	cl_event ev = NULL;
+	CLMemAccess access = { mem->id(), CLMem::WRITE };
+	CLWaitList deps(_tracker, &access, 1, numWaitEvents, waitList);
+	_ciErrNum = clEnqueueUnmapMemObject(_id, mem->id(), mapped,
+		deps.size(), deps.ids(), (event || _tracker) ? &ev : NULL);
+	deps.commit(ev);
+	if (event)
+		*event = ev;
+	else if (ev != NULL)
+		clReleaseEvent(ev);
+}
+
+void *CLCommandQueue::enqueueMapBuffer(CLMem *mem, bool blocking, cl_map_flags flags, size_t offset, size_t cb,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	cl_event ev = NULL;
+	void *mapped = mapBuffer(mem, blocking, flags, offset, cb, numWaitEvents, waitList, (event || _profiler) ? &ev : NULL);
+	enqueued(ev, event, CLProfileStats::OTHER, "map", cb);
+	return mapped;
+}
+
+CLCommandQueue* CLCommandQueue::enqueueUnmapMemObject(CLMem *mem, void *mapped,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	cl_event ev = NULL;
+	unmapMemObject(mem, mapped, numWaitEvents, waitList, (event || _profiler) ? &ev : NULL);
+	enqueued(ev, event, CLProfileStats::OTHER, "unmap", 0);
 	return this;
 }
 
-CLCommandQueue* CLCommandQueue::enqueueReadBuffer(CLMem *dstMem, bool blocking, size_t offset, size_t cb, void *dst) {
-	_ciErrNum = clEnqueueReadBuffer(_id, dstMem->id(), blocking, offset, cb, dst, 0, NULL, NULL);
+CLCommandQueue* CLCommandQueue::enqueueMarker(CLEvent *event) {
+	cl_event ev = NULL;
+	// clEnqueueMarker always returns an event, release it if the caller does not want it
+	_ciErrNum = clEnqueueMarker(_id, &ev);
+	if (event)
+		event->reset(ev);
+	else if (ev != NULL)
+		clReleaseEvent(ev);
 	return this;
 }
 
-CLMem::CLMem(CLContext *ctx, cl_mem_flags flags, size_t size, void *hostPtr) : _ctx(ctx), _flags(flags), _size(size), _hostPtr(hostPtr) {
-	cl_int ciErrNum = 0;
-	_id = clCreateBuffer(_ctx->id(), _flags, _size, _hostPtr, &ciErrNum);
+CLCommandQueue* CLCommandQueue::enqueueWaitForEvents(cl_uint numEvents, const CLEvent *events) {
+	CLWaitList waitList(NULL, NULL, 0, numEvents, events);
+	_ciErrNum = waitList.size() > 0 ? clEnqueueWaitForEvents(_id, waitList.size(), waitList.ids()) : CL_SUCCESS;
+	return this;
+}
+
+CLCommandQueue* CLCommandQueue::enqueueBarrier() {
+	_ciErrNum = clEnqueueBarrier(_id);
+	return this;
+}
+
+CLCommandQueue* CLCommandQueue::flush() {
+	_ciErrNum = clFlush(_id);
+	return this;
+}
+
+CLCommandQueue* CLCommandQueue::finish() {
+	_ciErrNum = clFinish(_id);
+	if (_profiler)
+		_profiler->collect();
+	return this;
+}
+
+CLEvent::CLEvent(cl_event id, bool retain) : _id(id) {
+	if (_id != NULL && retain)
+		clRetainEvent(_id);
+}
+
+CLEvent::CLEvent(const CLEvent &other) : _id(other._id) {
+	if (_id != NULL)
+		clRetainEvent(_id);
+}
+
+CLEvent& CLEvent::operator=(const CLEvent &other) {
+	if (other._id != NULL)
+		clRetainEvent(other._id);
+	reset(other._id);
+	return *this;
+}
+
+CLEvent::~CLEvent() {
+	if (_id != NULL)
+		clReleaseEvent(_id);
+}
+
+void CLEvent::reset(cl_event id) {
+	if (_id != NULL)
+		clReleaseEvent(_id);
+	_id = id;
+}
+
+cl_int CLEvent::wait() const {
+	return _id != NULL ? clWaitForEvents(1, &_id) : CL_SUCCESS;
+}
+
+cl_int CLEvent::status() const {
+	cl_int status = CL_COMPLETE;
+	if (_id != NULL) {
+		cl_int ciErrNum = clGetEventInfo(_id, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+		if (ciErrNum != CL_SUCCESS)
+			return ciErrNum;
+	}
+	return status;
+}
+
+cl_ulong CLEvent::elapsedNs() const {
+	cl_ulong start = 0, end = 0;
+	if (_id == NULL
+		|| clGetEventProfilingInfo(_id, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) != CL_SUCCESS
+		|| clGetEventProfilingInfo(_id, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) != CL_SUCCESS)
+		return 0;
+	return end > start ? end - start : 0;
+}
+
+cl_int CLEvent::waitAll(const CLEvent *events, cl_uint numEvents) {
+	cl_event *ids = new cl_event[numEvents > 0 ? numEvents : 1];
+	cl_uint numValid = 0;
+	for (cl_uint i = 0; i < numEvents; i++) {
+		if (events[i].valid())
+			ids[numValid++] = events[i].id();
+	}
+	cl_int ciErrNum = numValid > 0 ? clWaitForEvents(numValid, ids) : CL_SUCCESS;
+	delete[] ids;
+	return ciErrNum;
+}
+
+// Serials of the CLMem objects, 0 is left for the arguments which are no memory object
+static std::atomic<cl_ulong> g_memSerial(0);
+
+CLMem::CLMem(CLContext *ctx, cl_mem_flags flags, size_t size, void *hostPtr) : _flags(flags), _ctx(ctx), _size(size), _hostPtr(hostPtr),
+	_serial(++g_memSerial), _ciErrNum(0) {
+	_id = clCreateBuffer(_ctx->id(), _flags, _size, _hostPtr, &_ciErrNum);
+}
+
+CLMem::CLMem(CLContext *ctx, cl_mem id, cl_mem_flags flags, size_t size) : _id(id), _flags(flags), _ctx(ctx), _size(size), _hostPtr(NULL),
+	_serial(++g_memSerial), _ciErrNum(0) {
 }
 
 CLMem::~CLMem() {
 	clReleaseMemObject(_id);
 }
 
+CLMem::Access CLMem::kernelAccess() const {
+	if (_flags & CL_MEM_READ_ONLY)
+		return READ;
+	if (_flags & CL_MEM_WRITE_ONLY)
+		return WRITE;
+	return READ_WRITE;
+}
+
+CLPinnedHostBuffer::CLPinnedHostBuffer(CLContext *ctx, CLCommandQueue *queue, size_t size, cl_mem_flags flags)
+	: CLMem(ctx, flags | CL_MEM_ALLOC_HOST_PTR, size), _queue(queue), _mapped(NULL) {
+	if (_ciErrNum == CL_SUCCESS)
+		_mapped = clEnqueueMapBuffer(_queue->id(), id(), CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &_ciErrNum);
+}
+
+CLPinnedHostBuffer::~CLPinnedHostBuffer() {
+	if (_mapped != NULL) {
+		clEnqueueUnmapMemObject(_queue->id(), id(), _mapped, 0, NULL, NULL);
+		clFinish(_queue->id());
+	}
+}
+
+// Pinned buffers handed out by pointer (CLPinnedAllocator)
+static std::mutex g_pinnedMutex;
+static std::map<const void*, CLPinnedHostBuffer*> g_pinnedBuffers;
+
+void *CLPinnedHostBuffer::allocate(CLContext *ctx, CLCommandQueue *queue, size_t size) {
+	CLPinnedHostBuffer *buffer = new CLPinnedHostBuffer(ctx, queue, size > 0 ? size : 1);
+	if (buffer->ptr() == NULL) {
+		delete buffer;
+		return NULL;
+	}
+	std::lock_guard<std::mutex> lock(g_pinnedMutex);
+	g_pinnedBuffers[buffer->ptr()] = buffer;
+	return buffer->ptr();
+}
+
+void CLPinnedHostBuffer::release(void *ptr) {
+	CLPinnedHostBuffer *buffer = NULL;
+	{
+		std::lock_guard<std::mutex> lock(g_pinnedMutex);
+		std::map<const void*, CLPinnedHostBuffer*>::iterator it = g_pinnedBuffers.find(ptr);
+		if (it == g_pinnedBuffers.end())
+			return;
+		buffer = it->second;
+		g_pinnedBuffers.erase(it);
+	}
+	delete buffer;
+}
+
+CLPinnedHostBuffer *CLPinnedHostBuffer::find(const void *ptr) {
+	std::lock_guard<std::mutex> lock(g_pinnedMutex);
+	std::map<const void*, CLPinnedHostBuffer*>::iterator it = g_pinnedBuffers.find(ptr);
+	return it != g_pinnedBuffers.end() ? it->second : NULL;
+}
+
+CLPooledMem::CLPooledMem(CLContext *ctx, cl_mem id, cl_mem_flags flags, size_t size, const CLMemPool *pool, void *slab, cl_uint sizeClass)
+	: CLMem(ctx, id, flags, size), _pool(pool), _slab(slab), _sizeClass(sizeClass) {
+}
+
+CLPooledMem::~CLPooledMem() {
+}
+
+// Smallest size class
+#define CLMEMPOOL_MIN_CLASS_SHIFT 8
+
+struct CLMemSlab {
+	CLMem *mem;
+	size_t used;                       // bump offset
+	cl_uint outstanding;               // sub-buffers handed out
+};
+
+class CLMemPool::Impl {
+public:
+	CLContext *ctx;
+	cl_mem_flags flags;
+	// clCreateSubBuffer takes the access flags only, the host memory flags come from the slab
+	cl_mem_flags subBufferFlags;
+	size_t slabSize;
+	size_t alignment;
+	size_t highWater;
+	cl_uint numClasses;
+	cl_int ciErrNum;
+	mutable std::mutex mutex;
+	std::vector<CLMemSlab*> slabs;
+	std::vector< std::vector<CLPooledMem*> > freeLists;
+	CLMemPoolStats stats;
+
+	static size_t classSize(cl_uint sizeClass) { return (size_t) 1 << (sizeClass + CLMEMPOOL_MIN_CLASS_SHIFT); }
+
+	size_t trimLocked() {
+		size_t released = 0;
+		size_t kept = 0;
+		for (size_t i = 0; i < slabs.size(); i++) {
+			CLMemSlab *slab = slabs[i];
+			if (slab->outstanding > 0) {
+				slabs[kept++] = slab;
+				continue;
+			}
+			// drop the slab's sub-buffers from the free lists before the slab itself
+			for (size_t c = 0; c < freeLists.size(); c++) {
+				std::vector<CLPooledMem*> &list = freeLists[c];
+				size_t keptFree = 0;
+				for (size_t j = 0; j < list.size(); j++) {
+					if (list[j]->_slab == slab) {
+						stats.freeListBytes -= list[j]->size();
+						delete list[j];
+					}
+					else {
+						list[keptFree++] = list[j];
+					}
+				}
+				list.resize(keptFree);
+			}
+			released += slab->mem->size();
+			stats.reservedBytes -= slab->mem->size();
+			delete slab->mem;
+			delete slab;
+		}
+		slabs.resize(kept);
+		stats.slabs = (cl_uint) kept;
+		return released;
+	}
+
+	// Carves a sub-buffer of the class from the slabs, reserving a new slab when they are full
+	CLPooledMem *carve(CLMemPool *pool, cl_uint sizeClass) {
+		size_t size = classSize(sizeClass);
+		CLMemSlab *slab = NULL;
+		for (size_t i = 0; i < slabs.size() && slab == NULL; i++) {
+			if (slabs[i]->used + size <= slabSize)
+				slab = slabs[i];
+		}
+		if (slab == NULL) {
+			if (highWater > 0 && stats.reservedBytes + slabSize > highWater && (trimLocked() == 0 || stats.reservedBytes + slabSize > highWater))
+				return NULL;
+			CLMem *mem = new CLMem(ctx, flags, slabSize);
+			if (mem->ciErrNum() != CL_SUCCESS) {
+				delete mem;
+				return NULL;
+			}
+			slab = new CLMemSlab();
+			slab->mem = mem;
+			slab->used = 0;
+			slab->outstanding = 0;
+			slabs.push_back(slab);
+			stats.slabs = (cl_uint) slabs.size();
+			stats.reservedBytes += slabSize;
+		}
+		cl_buffer_region region;
+		region.origin = slab->used;
+		region.size = size;
+		cl_int ciErrNum = 0;
+		cl_mem id = clCreateSubBuffer(slab->mem->id(), subBufferFlags, CL_BUFFER_CREATE_TYPE_REGION, &region, &ciErrNum);
+		if (ciErrNum != CL_SUCCESS)
+			return NULL;
+		slab->used += (size + alignment - 1) / alignment * alignment;
+		stats.subBuffersCreated++;
+		return new CLPooledMem(ctx, id, flags, size, pool, slab, sizeClass);
+	}
+};
+
+CLMemPool::CLMemPool(CLContext *ctx, size_t slabSize, cl_mem_flags flags) : _impl(new Impl()) {
+	_impl->ctx = ctx;
+	_impl->flags = flags;
+	_impl->subBufferFlags = flags & (CL_MEM_READ_WRITE | CL_MEM_WRITE_ONLY | CL_MEM_READ_ONLY);
+	// the slabs are created without host pointer
+	_impl->ciErrNum = (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR)) != 0 ? CL_INVALID_VALUE : CL_SUCCESS;
+	_impl->highWater = 0;
+	// sub-buffer origins must be aligned for every device of the context
+	_impl->alignment = 128;
+	for (cl_uint i = 0; i < ctx->numDevices(); i++) {
+		size_t align = ctx->devices()[i].memBaseAddrAlign() / 8;
+		if (align > _impl->alignment)
+			_impl->alignment = align;
+	}
+	size_t minSize = (size_t) 1 << CLMEMPOOL_MIN_CLASS_SHIFT;
+	_impl->slabSize = slabSize > minSize ? slabSize : minSize;
+	_impl->numClasses = 0;
+	while (Impl::classSize(_impl->numClasses) <= _impl->slabSize)
+		_impl->numClasses++;
+	_impl->freeLists.resize(_impl->numClasses);
+	memset(&_impl->stats, 0, sizeof(_impl->stats));
+}
+
+CLMemPool::~CLMemPool() {
+	for (size_t c = 0; c < _impl->freeLists.size(); c++) {
+		for (size_t j = 0; j < _impl->freeLists[c].size(); j++)
+			delete _impl->freeLists[c][j];
+	}
+	// sub-buffers still handed out keep their slab's memory alive through the driver's reference counting,
+	// they can only be deleted (not freed to the pool) after this
+	for (size_t i = 0; i < _impl->slabs.size(); i++) {
+		delete _impl->slabs[i]->mem;
+		delete _impl->slabs[i];
+	}
+	delete _impl;
+}
+
+CLPooledMem *CLMemPool::alloc(size_t size) {
+	if (_impl->ciErrNum != CL_SUCCESS)
+		return NULL;
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	_impl->stats.allocs++;
+	cl_uint sizeClass = 0;
+	while (sizeClass < _impl->numClasses && Impl::classSize(sizeClass) < size)
+		sizeClass++;
+
+	CLPooledMem *mem = NULL;
+	if (sizeClass < _impl->numClasses) {
+		std::vector<CLPooledMem*> &list = _impl->freeLists[sizeClass];
+		if (!list.empty()) {
+			mem = list.back();
+			list.pop_back();
+			_impl->stats.freeListBytes -= mem->size();
+			_impl->stats.reused++;
+		}
+		else {
+			mem = _impl->carve(this, sizeClass);
+		}
+		if (mem != NULL)
+			static_cast<CLMemSlab*>(mem->_slab)->outstanding++;
+	}
+	if (mem == NULL) {
+		// dedicated buffer: larger than a slab, or the slabs are at the high-water mark
+		cl_int ciErrNum = 0;
+		cl_mem id = clCreateBuffer(_impl->ctx->id(), _impl->flags, size, NULL, &ciErrNum);
+		if (ciErrNum != CL_SUCCESS)
+			return NULL;
+		mem = new CLPooledMem(_impl->ctx, id, _impl->flags, size, this, NULL, 0);
+		_impl->stats.dedicatedAllocs++;
+	}
+	_impl->stats.inUseBytes += mem->size();
+	if (_impl->stats.inUseBytes > _impl->stats.peakInUseBytes)
+		_impl->stats.peakInUseBytes = _impl->stats.inUseBytes;
+	return mem;
+}
+
+void CLMemPool::free(CLPooledMem *pooled) {
+	if (pooled == NULL || pooled->_pool != this)
+		return;
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	_impl->stats.frees++;
+	_impl->stats.inUseBytes -= pooled->size();
+	if (pooled->_slab == NULL) {
+		delete pooled;
+		return;
+	}
+	static_cast<CLMemSlab*>(pooled->_slab)->outstanding--;
+	_impl->freeLists[pooled->_sizeClass].push_back(pooled);
+	_impl->stats.freeListBytes += pooled->size();
+}
+
+CLMemPool* CLMemPool::setHighWater(size_t bytes) {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	_impl->highWater = bytes;
+	if (bytes > 0 && _impl->stats.reservedBytes > bytes)
+		_impl->trimLocked();
+	return this;
+}
+
+size_t CLMemPool::trim() {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	return _impl->trimLocked();
+}
+
+CLMemPoolStats CLMemPool::stats() const {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	return _impl->stats;
+}
+
+size_t CLMemPool::slabSize() const {
+	return _impl->slabSize;
+}
+
+size_t CLMemPool::alignment() const {
+	return _impl->alignment;
+}
+
+cl_int CLMemPool::ciErrNum() const {
+	return _impl->ciErrNum;
+}
+
 CLReadOnlyMem::CLReadOnlyMem(CLContext *ctx, size_t size, void *hostPtr) : CLMem(ctx, CL_MEM_READ_ONLY, size, hostPtr) {
 
 }
@@ -163,43 +1269,2985 @@ CLWriteOnlyMem::CLWriteOnlyMem(CLContext *ctx, size_t size, void *hostPtr) : CLM
 CLWriteOnlyMem::~CLWriteOnlyMem() {
 }
 
-CLProgram::CLProgram(CLContext *ctx, cl_uint count, const char **strings, const size_t *lengths) : _ctx(ctx), _count(count), _strings(strings), _lengths(lengths) {
+char CLProgram::g_binaryCacheDir[MAX_CLBINARY_CACHE_PATH_LEN] = "";
+
+// 64 bit FNV-1a, chained through hash
+static cl_ulong clHash64(const void *data, size_t size, cl_ulong hash = 14695981039346656037ULL) {
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// True if a loaded bundle has binaries of the program, see CLProgram::loadBundle
+static bool bundleHasProgram(const char *name);
+
+struct CLProgram::BuildState {
+	std::mutex mutex;
+	std::condition_variable completed;
+	bool pending;
+	// clBuildProgram with a callback: the build completes once both the call returned and the callback ran
+	bool returned;
+	bool notified;
+	cl_int returnedErrNum;
+	std::string options;
+
+	BuildState() : pending(false), returned(false), notified(false), returnedErrNum(CL_SUCCESS) {}
+};
+
+// Worker threads for the builds of the ICDs whose clBuildProgram blocks even with a callback.
+// Started on first use, joined at exit.
+class CLBuildPool {
+private:
+	std::mutex _mutex;
+	std::condition_variable _available;
+	std::deque<std::function<void()> > _tasks;
+	std::vector<std::thread> _threads;
+	bool _stop;
+
+	CLBuildPool() : _stop(false) {}
+	void work() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_available.wait(lock, [this] { return _stop || !_tasks.empty(); });
+				if (_tasks.empty())
+					return;
+				task = _tasks.front();
+				_tasks.pop_front();
+			}
+			task();
+		}
+	}
+public:
+	~CLBuildPool() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_available.notify_all();
+		for (size_t i = 0; i < _threads.size(); i++)
+			_threads[i].join();
+	}
+	static CLBuildPool &instance() {
+		static CLBuildPool pool;
+		return pool;
+	}
+	void submit(const std::function<void()> &task) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_threads.empty()) {
+			unsigned numThreads = std::thread::hardware_concurrency();
+			numThreads = numThreads < 2 ? 2 : (numThreads > 8 ? 8 : numThreads);
+			for (unsigned i = 0; i < numThreads; i++)
+				_threads.push_back(std::thread(&CLBuildPool::work, this));
+		}
+		_tasks.push_back(task);
+		_available.notify_one();
+	}
+};
+
+// Whether clBuildProgram returns before the callback runs, per platform. Learnt from the first
+// buildAsync() on the platform, which runs on the pool.
+enum CLAsyncBuildSupport { CLASYNC_BUILD_UNKNOWN, CLASYNC_BUILD_PROBING, CLASYNC_BUILD_NATIVE, CLASYNC_BUILD_BLOCKING };
+static std::mutex g_asyncBuildMutex;
+static std::map<cl_platform_id, CLAsyncBuildSupport> g_asyncBuildSupport;
+
+CLProgram::CLProgram(CLContext *ctx, cl_uint count, const char **strings, const size_t *lengths) : _ctx(ctx), _count(count), _strings(strings), _lengths(lengths),
+	_fromBinaryCache(false), _fromBundle(false), _name(NULL), _embedded(NULL), _buildState(new BuildState()) {
+	_ciErrNum = 0;
+	_id = clCreateProgramWithSource(_ctx->id(), _count, _strings, _lengths, &_ciErrNum);
+	_sourceHash = clHash64(&_count, sizeof(_count));
+	for (cl_uint i = 0; i < _count; i++) {
+		// the length is hashed too so that the split of the sources into strings matters
+		size_t length = (_lengths != NULL && _lengths[i] != 0) ? _lengths[i] : strlen(_strings[i]);
+		_sourceHash = clHash64(&length, sizeof(length), _sourceHash);
+		_sourceHash = clHash64(_strings[i], length, _sourceHash);
+	}
+}
+
+CLProgram::CLProgram(CLContext *ctx, const char *name) : _id(NULL), _ctx(ctx), _count(0), _strings(NULL), _lengths(NULL),
+	_fromBinaryCache(false), _fromBundle(false), _name(name), _embedded(findSource(name)), _buildState(new BuildState()) {
+	if (_embedded == NULL) {
+		// build() creates the program from the bundle's binaries
+		_sourceHash = clHash64(name, strlen(name));
+		_ciErrNum = bundleHasProgram(name) ? CL_SUCCESS : CL_INVALID_VALUE;
+		return;
+	}
+	_sourceHash = _embedded->hash;
+	_count = 1;
+	_strings = const_cast<const char**>(&_embedded->source);
+	_lengths = &_embedded->length;
 	_ciErrNum = 0;
 	_id = clCreateProgramWithSource(_ctx->id(), _count, _strings, _lengths, &_ciErrNum);
 }
 
+cl_ulong CLProgram::sourceTextHash() const {
+	if (_embedded != NULL)
+		return _embedded->hash;
+	cl_ulong hash = clHash64(NULL, 0);
+	for (cl_uint i = 0; i < _count; i++)
+		hash = clHash64(_strings[i], (_lengths != NULL && _lengths[i] != 0) ? _lengths[i] : strlen(_strings[i]), hash);
+	return _count > 0 ? hash : 0;
+}
+
+// Registry of the embedded sources. Function local so that it exists before the static registrars run.
+static std::map<std::string, const CLEmbeddedSource*> &embeddedSources() {
+	static std::map<std::string, const CLEmbeddedSource*> sources;
+	return sources;
+}
+static std::mutex g_embeddedSourcesMutex;
+
+void CLProgram::registerSources(const CLEmbeddedSource *sources, cl_uint count) {
+	std::lock_guard<std::mutex> lock(g_embeddedSourcesMutex);
+	for (cl_uint i = 0; i < count; i++)
+		embeddedSources()[sources[i].name] = &sources[i];
+}
+
+const CLEmbeddedSource *CLProgram::findSource(const char *name) {
+	std::lock_guard<std::mutex> lock(g_embeddedSourcesMutex);
+	std::map<std::string, const CLEmbeddedSource*>::const_iterator it = embeddedSources().find(name);
+	return it != embeddedSources().end() ? it->second : NULL;
+}
+
 CLProgram::~CLProgram() {
-	clReleaseProgram(_id);
+	// the pending build refers to this program
+	wait();
+	delete _buildState;
+	if (_id != NULL)
+		clReleaseProgram(_id);
 }
 
 CLProgram* CLProgram::build(const char *options) {
-	_ciErrNum = clBuildProgram(_id, 0, NULL, options, NULL, NULL);
+	wait();
+	_ciErrNum = buildNow(options);
 	if(_ciErrNum == CL_SUCCESS)
 		return this;
 	else
 		return NULL;
 }
 
-CLKernel::CLKernel(CLProgram *program, const char *name) : _program(program), _name(name), _ciErrNum(0), _argNum(0) {
-	_id = clCreateKernel(_program->id(), _name, &_ciErrNum);
-}
-
-CLKernel::~CLKernel() {
-	clReleaseKernel(_id);
+cl_int CLProgram::buildNow(const char *options) {
+	_fromBundle = _name != NULL && buildFromBundle(options);
+	if (_fromBundle)
+		return CL_SUCCESS;
+	// no source: a program name without embedded source nor matching bundle entries
+	if (_id == NULL)
+		return CL_INVALID_PROGRAM;
+	_fromBinaryCache = binaryCacheDir() != NULL && buildFromBinaryCache(options);
+	if (_fromBinaryCache)
+		return CL_SUCCESS;
+	cl_int ciErrNum = clBuildProgram(_id, 0, NULL, options, NULL, NULL);
+	if (ciErrNum == CL_SUCCESS && binaryCacheDir() != NULL)
+		saveToBinaryCache(options);
+	return ciErrNum;
 }
 
-CLKernel* CLKernel::setArg(CLMem* arg, int argNum) {
-	if(argNum != -1)
-		_argNum = (cl_uint) argNum;
+CLProgram* CLProgram::buildAsync(const char *options) {
+	wait();
+	BuildState &state = *_buildState;
+	{
+		// the pool threads read the state under the mutex
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.pending = true;
+		state.options = options != NULL ? options : "";
+	}
+	_fromBinaryCache = false;
+	_fromBundle = false;
 
-	_ciErrNum = clSetKernelArg(_id, _argNum++, sizeof(cl_mem), (void*)&arg->id());
+	CLAsyncBuildSupport support = CLASYNC_BUILD_BLOCKING;
+	cl_platform_id platform = NULL;
+	// the binary cache and the bundles need the synchronous build
+	bool blockingBuild = binaryCacheDir() != NULL || (_name != NULL && bundleHasProgram(_name));
+	if (!blockingBuild && clGetDeviceInfo(_ctx->devices()->id(), CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) == CL_SUCCESS) {
+		std::lock_guard<std::mutex> lock(g_asyncBuildMutex);
+		std::map<cl_platform_id, CLAsyncBuildSupport>::iterator it = g_asyncBuildSupport.find(platform);
+		support = it != g_asyncBuildSupport.end() ? it->second : CLASYNC_BUILD_UNKNOWN;
+		if (support == CLASYNC_BUILD_UNKNOWN)
+			g_asyncBuildSupport[platform] = CLASYNC_BUILD_PROBING;
+	}
+	if (support == CLASYNC_BUILD_NATIVE)
+		buildWithNotify(false);
+	else if (support == CLASYNC_BUILD_UNKNOWN) {
+		CLBuildPool::instance().submit([this] {
+			buildWithNotify(true);
+		});
+	}
+	else {
+		// blocking ICD, binary cache or another build probing the platform
+		CLBuildPool::instance().submit([this] {
+			std::string options;
+			{
+				std::lock_guard<std::mutex> lock(_buildState->mutex);
+				options = _buildState->options;
+			}
+			buildCompleted(buildNow(options.c_str()));
+		});
+	}
 	return this;
 }
 
-CLKernel* CLKernel::setArg(cl_int& arg, int argNum) {
-	if(argNum != -1)
-		_argNum = (cl_uint) argNum;
+void CLProgram::buildWithNotify(bool probe) {
+	BuildState &state = *_buildState;
+	cl_platform_id platform = NULL;
+	clGetDeviceInfo(_ctx->devices()->id(), CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+	std::string options;
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.returned = false;
+		state.notified = false;
+		options = state.options;
+	}
+	cl_int ciErrNum = clBuildProgram(_id, 0, NULL, options.c_str(), buildNotify, this);
+	// a failed call may have returned before any build started (argument errors, out of resources, no
+	// compiler): no callback comes then, which the devices' build status tells
+	bool building = ciErrNum == CL_SUCCESS;
+	for (cl_uint i = 0; !building && i < _ctx->numDevices(); i++) {
+		cl_build_status status = CL_BUILD_NONE;
+		clGetProgramBuildInfo(_id, _ctx->devices()[i].id(), CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+		building = status == CL_BUILD_IN_PROGRESS;
+	}
+
+	std::unique_lock<std::mutex> lock(state.mutex);
+	state.returned = true;
+	state.returnedErrNum = ciErrNum;
+	if (probe) {
+		// a failed build tells nothing, the next one probes again
+		std::lock_guard<std::mutex> supportLock(g_asyncBuildMutex);
+		g_asyncBuildSupport[platform] = ciErrNum != CL_SUCCESS ? CLASYNC_BUILD_UNKNOWN
+			: (state.notified ? CLASYNC_BUILD_BLOCKING : CLASYNC_BUILD_NATIVE);
+	}
+	// While a build is in progress the callback is still to run: it must have run before the build
+	// completes, the program may be deleted as soon as wait() returns.
+	if (state.notified || !building) {
+		if (ciErrNum != CL_SUCCESS)
+			_ciErrNum = ciErrNum;
+		state.pending = false;
+		state.completed.notify_all();
+	}
+	// else the callback completes the build
+}
+
+void CL_CALLBACK CLProgram::buildNotify(cl_program, void *userData) {
+	CLProgram *this_ptr = static_cast<CLProgram*>(userData);
+	cl_int ciErrNum = CL_SUCCESS;
+	for (cl_uint i = 0; i < this_ptr->_ctx->numDevices(); i++) {
+		cl_build_status status = CL_BUILD_ERROR;
+		clGetProgramBuildInfo(this_ptr->_id, this_ptr->_ctx->devices()[i].id(), CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+		if (status != CL_BUILD_SUCCESS)
+			ciErrNum = CL_BUILD_PROGRAM_FAILURE;
+	}
+	BuildState &state = *this_ptr->_buildState;
+	std::lock_guard<std::mutex> lock(state.mutex);
+	state.notified = true;
+	this_ptr->_ciErrNum = ciErrNum;
+	if (state.returned) {
+		if (state.returnedErrNum != CL_SUCCESS)
+			this_ptr->_ciErrNum = state.returnedErrNum;
+		state.pending = false;
+		state.completed.notify_all();
+	}
+}
+
+void CLProgram::buildCompleted(cl_int ciErrNum) {
+	std::lock_guard<std::mutex> lock(_buildState->mutex);
+	_ciErrNum = ciErrNum;
+	_buildState->pending = false;
+	_buildState->completed.notify_all();
+}
+
+cl_int CLProgram::wait() {
+	std::unique_lock<std::mutex> lock(_buildState->mutex);
+	_buildState->completed.wait(lock, [this] { return !_buildState->pending; });
+	return _ciErrNum;
+}
+
+bool CLProgram::ready() const {
+	std::lock_guard<std::mutex> lock(_buildState->mutex);
+	return !_buildState->pending;
+}
+
+cl_int CLProgram::waitAll(CLProgram **programs, cl_uint count) {
+	cl_int ciErrNum = CL_SUCCESS;
+	for (cl_uint i = 0; i < count; i++) {
+		cl_int programErrNum = programs[i]->wait();
+		if (ciErrNum == CL_SUCCESS)
+			ciErrNum = programErrNum;
+	}
+	return ciErrNum;
+}
+
+// Binary cache entry: header followed by the device's CL_PROGRAM_BINARIES blob, in <dir>/<key>.clbin
+#define CLBINARY_CACHE_MAGIC "OCLPPBIN"
+#define CLBINARY_CACHE_FORMAT_VERSION 1
+
+struct CLBinaryCacheHeader {
+	char magic[8];
+	cl_uint formatVersion;
+	cl_uint reserved;
+	cl_ulong key;
+	cl_ulong binarySize;
+	cl_ulong binaryHash;
+};
+
+static void binaryCachePath(char *path, size_t size, const char *dir, cl_ulong key) {
+	snprintf(path, size, "%s/%016llx.clbin", dir, (unsigned long long) key);
+}
+
+void CLProgram::setBinaryCacheDir(const char *dir) {
+	g_binaryCacheDir[0] = '\0';
+	if (dir != NULL)
+		strncat(g_binaryCacheDir, dir, MAX_CLBINARY_CACHE_PATH_LEN - 1);
+}
+
+const char *CLProgram::binaryCacheDir() {
+	const char *dir = g_binaryCacheDir[0] != '\0' ? g_binaryCacheDir : getenv("OPENCLPP_BINARY_CACHE");
+	return dir != NULL && dir[0] != '\0' ? dir : NULL;
+}
+
+cl_ulong CLProgram::binaryCacheKey(const CLDevice *device, const char *options) const {
+	cl_ulong hash = clHash64(&_sourceHash, sizeof(_sourceHash));
+	if (options == NULL)
+		options = "";
+	hash = clHash64(options, strlen(options) + 1, hash);
+	hash = clHash64(device->name(), strlen(device->name()) + 1, hash);
+	return clHash64(device->driverVersion(), strlen(device->driverVersion()) + 1, hash);
+}
+
+bool CLProgram::buildFromBinaryCache(const char *options) {
+	const char *dir = binaryCacheDir();
+	cl_uint numDevices = _ctx->numDevices();
+	std::vector<cl_device_id> deviceIds(numDevices);
+	std::vector<std::vector<unsigned char> > binaries(numDevices);
+	std::vector<const unsigned char*> binaryPtrs(numDevices);
+	std::vector<size_t> binarySizes(numDevices);
+	for (cl_uint i = 0; i < numDevices; i++) {
+		const CLDevice *device = &_ctx->devices()[i];
+		deviceIds[i] = device->id();
+		cl_ulong key = binaryCacheKey(device, options);
+		char path[MAX_CLBINARY_CACHE_PATH_LEN + 32];
+		binaryCachePath(path, sizeof(path), dir, key);
+		FILE *fp = fopen(path, "rb");
+		if (fp == NULL)
+			return false;
+		CLBinaryCacheHeader header;
+		bool ok = fread(&header, sizeof(header), 1, fp) == 1
+			&& memcmp(header.magic, CLBINARY_CACHE_MAGIC, sizeof(header.magic)) == 0
+			&& header.formatVersion == CLBINARY_CACHE_FORMAT_VERSION
+			&& header.key == key && header.binarySize > 0 && header.binarySize < ((cl_ulong) 1 << 32);
+		if (ok) {
+			binaries[i].resize((size_t) header.binarySize);
+			// the file must end with the binary: a truncated or appended entry is corrupt
+			ok = fread(&binaries[i][0], binaries[i].size(), 1, fp) == 1 && fgetc(fp) == EOF
+				&& clHash64(&binaries[i][0], binaries[i].size()) == header.binaryHash;
+		}
+		fclose(fp);
+		if (!ok)
+			return false;
+		binaryPtrs[i] = &binaries[i][0];
+		binarySizes[i] = binaries[i].size();
+	}
+
+	cl_int ciErrNum = CL_SUCCESS;
+	cl_program program = clCreateProgramWithBinary(_ctx->id(), numDevices, &deviceIds[0], &binarySizes[0], &binaryPtrs[0],
+		NULL, &ciErrNum);
+	if (ciErrNum != CL_SUCCESS)
+		return false;
+	// a binary from another driver build may still be rejected here
+	ciErrNum = clBuildProgram(program, 0, NULL, options, NULL, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		clReleaseProgram(program);
+		return false;
+	}
+	clReleaseProgram(_id);
+	_id = program;
+	return true;
+}
+
+// Devices and CL_PROGRAM_BINARIES of a built program, false on error
+static bool programBinaries(cl_program program, std::vector<cl_device_id> &deviceIds, std::vector<std::vector<unsigned char> > &binaries) {
+	cl_uint numDevices = 0;
+	if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(numDevices), &numDevices, NULL) != CL_SUCCESS || numDevices == 0)
+		return false;
+	deviceIds.resize(numDevices);
+	std::vector<size_t> binarySizes(numDevices);
+	if (clGetProgramInfo(program, CL_PROGRAM_DEVICES, numDevices * sizeof(cl_device_id), &deviceIds[0], NULL) != CL_SUCCESS
+		|| clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), &binarySizes[0], NULL) != CL_SUCCESS)
+		return false;
+	binaries.assign(numDevices, std::vector<unsigned char>());
+	std::vector<unsigned char*> binaryPtrs(numDevices);
+	for (cl_uint i = 0; i < numDevices; i++) {
+		binaries[i].resize(binarySizes[i] > 0 ? binarySizes[i] : 1);
+		binaryPtrs[i] = &binaries[i][0];
+	}
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, numDevices * sizeof(unsigned char*), &binaryPtrs[0], NULL) != CL_SUCCESS)
+		return false;
+	for (cl_uint i = 0; i < numDevices; i++) {
+		// no binary for a device the program failed to build for
+		if (binarySizes[i] == 0)
+			binaries[i].clear();
+	}
+	return true;
+}
+
+void CLProgram::saveToBinaryCache(const char *options) {
+	const char *dir = binaryCacheDir();
+	std::vector<cl_device_id> deviceIds;
+	std::vector<std::vector<unsigned char> > binaries;
+	if (!programBinaries(_id, deviceIds, binaries))
+		return;
+	cl_uint numDevices = (cl_uint) deviceIds.size();
+
+	for (cl_uint i = 0; i < numDevices; i++) {
+		const CLDevice *device = NULL;
+		for (cl_uint j = 0; j < _ctx->numDevices() && device == NULL; j++) {
+			if (_ctx->devices()[j].id() == deviceIds[i])
+				device = &_ctx->devices()[j];
+		}
+		if (device == NULL || binaries[i].empty())
+			continue;
+
+		CLBinaryCacheHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CLBINARY_CACHE_MAGIC, sizeof(header.magic));
+		header.formatVersion = CLBINARY_CACHE_FORMAT_VERSION;
+		header.key = binaryCacheKey(device, options);
+		header.binarySize = binaries[i].size();
+		header.binaryHash = clHash64(&binaries[i][0], binaries[i].size());
+
+		// Same protocol as the snapshot: concurrent writers of the same entry each write their own temporary
+		// file and the last rename wins, readers see either no entry or a complete one
+		char path[MAX_CLBINARY_CACHE_PATH_LEN + 32];
+		char tmpPath[MAX_CLBINARY_CACHE_PATH_LEN + 96];
+		binaryCachePath(path, sizeof(path), dir, header.key);
+		char suffix[64];
+		tmpFileSuffix(suffix, sizeof(suffix));
+		snprintf(tmpPath, sizeof(tmpPath), "%s%s", path, suffix);
+		FILE *fp = fopen(tmpPath, "wb");
+		if (fp == NULL)
+			continue;
+		bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(&binaries[i][0], binaries[i].size(), 1, fp) == 1;
+		ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+		if (ok)
+			remove(path);
+#endif
+		if (!ok || rename(tmpPath, path) != 0)
+			remove(tmpPath);
+	}
+}
+
+// Program bundle: header, entry table, then the binaries at 8 byte aligned offsets
+#define CLBUNDLE_MAGIC "OCLPPBDL"
+#define CLBUNDLE_FORMAT_VERSION 2
+
+struct CLBundleHeader {
+	char magic[8];
+	cl_uint formatVersion;
+	cl_uint numEntries;
+	cl_ulong fileSize;
+};
+
+struct CLBundleEntry {
+	char name[MAX_CLBUNDLE_PROGRAM_NAME_LEN];
+	char deviceName[MAX_DEVICE_NAME];
+	char driverVersion[MAX_DEVICE_DRIVER_VERSION_LEN];
+	cl_ulong optionsHash;
+	cl_ulong sourceHash;            // CLProgram::sourceTextHash
+	cl_ulong offset;
+	cl_ulong size;
+	cl_ulong binaryHash;
+};
+
+// Loaded bundles, mapped until the process exits
+struct CLMappedBundle {
+	const unsigned char *base;
+	size_t size;
+};
+static std::mutex g_bundlesMutex;
+static std::vector<CLMappedBundle> g_bundles;
+static bool g_envBundleLoaded = false;
+
+static cl_ulong optionsHash(const char *options) {
+	if (options == NULL)
+		options = "";
+	return clHash64(options, strlen(options) + 1);
+}
+
+// Maps the file read-only and checks its header and entry table
+static bool mapBundle(const char *path, CLMappedBundle &bundle) {
+	bundle.base = NULL;
+	bundle.size = 0;
+#if defined(_WIN32) || defined(_WIN64)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart >= (LONGLONG) sizeof(CLBundleHeader))
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return false;
+	bundle.base = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	CloseHandle(mapping);
+	bundle.size = (size_t) fileSize.QuadPart;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(CLBundleHeader))
+		base = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+	bundle.base = static_cast<const unsigned char*>(base);
+	bundle.size = (size_t) st.st_size;
+#endif
+	if (bundle.base == NULL)
+		return false;
+
+	const CLBundleHeader *header = reinterpret_cast<const CLBundleHeader*>(bundle.base);
+	bool ok = memcmp(header->magic, CLBUNDLE_MAGIC, sizeof(header->magic)) == 0
+		&& header->formatVersion == CLBUNDLE_FORMAT_VERSION && header->fileSize == bundle.size
+		&& sizeof(CLBundleHeader) + (cl_ulong) header->numEntries * sizeof(CLBundleEntry) <= bundle.size;
+	const CLBundleEntry *entries = reinterpret_cast<const CLBundleEntry*>(bundle.base + sizeof(CLBundleHeader));
+	for (cl_uint i = 0; ok && i < header->numEntries; i++)
+		ok = entries[i].offset <= bundle.size && entries[i].size <= bundle.size - entries[i].offset;
+	if (!ok) {
+#if defined(_WIN32) || defined(_WIN64)
+		UnmapViewOfFile(bundle.base);
+#else
+		munmap(const_cast<unsigned char*>(bundle.base), bundle.size);
+#endif
+		bundle.base = NULL;
+	}
+	return ok;
+}
+
+// Loads the OPENCLPP_BUNDLE bundle on first use, called with g_bundlesMutex held
+static void loadEnvBundle() {
+	if (g_envBundleLoaded)
+		return;
+	g_envBundleLoaded = true;
+	const char *path = getenv("OPENCLPP_BUNDLE");
+	CLMappedBundle bundle;
+	if (path != NULL && path[0] != '\0' && mapBundle(path, bundle))
+		g_bundles.push_back(bundle);
+}
+
+bool CLProgram::loadBundle(const char *path) {
+	CLMappedBundle bundle;
+	if (!mapBundle(path, bundle))
+		return false;
+	std::lock_guard<std::mutex> lock(g_bundlesMutex);
+	g_bundles.push_back(bundle);
+	return true;
+}
+
+static bool bundleHasProgram(const char *name) {
+	std::lock_guard<std::mutex> lock(g_bundlesMutex);
+	loadEnvBundle();
+	for (size_t b = 0; b < g_bundles.size(); b++) {
+		const CLBundleHeader *header = reinterpret_cast<const CLBundleHeader*>(g_bundles[b].base);
+		const CLBundleEntry *entries = reinterpret_cast<const CLBundleEntry*>(g_bundles[b].base + sizeof(CLBundleHeader));
+		for (cl_uint i = 0; i < header->numEntries; i++) {
+			if (strncmp(entries[i].name, name, MAX_CLBUNDLE_PROGRAM_NAME_LEN) == 0)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Binary of the program for the device, NULL if no loaded bundle has an intact one. The most recently
+// loaded bundle wins. An entry built from another source than *source is stale and skipped; a program
+// without source (source NULL) takes the bundle's.
+static const unsigned char *findBundleBinary(const char *name, const CLDevice *device, cl_ulong options, const cl_ulong *source, size_t *size) {
+	std::lock_guard<std::mutex> lock(g_bundlesMutex);
+	loadEnvBundle();
+	for (size_t b = g_bundles.size(); b-- > 0; ) {
+		const CLBundleHeader *header = reinterpret_cast<const CLBundleHeader*>(g_bundles[b].base);
+		const CLBundleEntry *entries = reinterpret_cast<const CLBundleEntry*>(g_bundles[b].base + sizeof(CLBundleHeader));
+		for (cl_uint i = 0; i < header->numEntries; i++) {
+			const CLBundleEntry &entry = entries[i];
+			if (entry.optionsHash != options || (source != NULL && entry.sourceHash != *source)
+				|| strncmp(entry.name, name, MAX_CLBUNDLE_PROGRAM_NAME_LEN) != 0
+				|| strncmp(entry.deviceName, device->name(), MAX_DEVICE_NAME) != 0
+				|| strncmp(entry.driverVersion, device->driverVersion(), MAX_DEVICE_DRIVER_VERSION_LEN) != 0)
+				continue;
+			const unsigned char *binary = g_bundles[b].base + entry.offset;
+			if (entry.size == 0 || clHash64(binary, (size_t) entry.size) != entry.binaryHash)
+				continue;
+			*size = (size_t) entry.size;
+			return binary;
+		}
+	}
+	return NULL;
+}
+
+bool CLProgram::buildFromBundle(const char *options) {
+	cl_uint numDevices = _ctx->numDevices();
+	cl_ulong hash = optionsHash(options);
+	cl_ulong source = sourceTextHash();
+	std::vector<cl_device_id> deviceIds(numDevices);
+	std::vector<const unsigned char*> binaryPtrs(numDevices);
+	std::vector<size_t> binarySizes(numDevices);
+	for (cl_uint i = 0; i < numDevices; i++) {
+		deviceIds[i] = _ctx->devices()[i].id();
+		binaryPtrs[i] = findBundleBinary(_name, &_ctx->devices()[i], hash, _embedded != NULL ? &source : NULL, &binarySizes[i]);
+		if (binaryPtrs[i] == NULL)
+			return false;
+	}
+	// the binaries are passed straight from the mapping
+	cl_int ciErrNum = CL_SUCCESS;
+	cl_program program = clCreateProgramWithBinary(_ctx->id(), numDevices, &deviceIds[0], &binarySizes[0], &binaryPtrs[0],
+		NULL, &ciErrNum);
+	if (ciErrNum != CL_SUCCESS)
+		return false;
+	ciErrNum = clBuildProgram(program, 0, NULL, options, NULL, NULL);
+	if (ciErrNum != CL_SUCCESS) {
+		clReleaseProgram(program);
+		return false;
+	}
+	if (_id != NULL)
+		clReleaseProgram(_id);
+	_id = program;
+	return true;
+}
+
+class CLBundleWriter::Impl {
+public:
+	struct Entry {
+		CLBundleEntry header;
+		std::vector<unsigned char> binary;
+	};
+	std::vector<Entry> entries;
+};
+
+CLBundleWriter::CLBundleWriter() : _impl(new Impl()) {
+}
+
+CLBundleWriter::~CLBundleWriter() {
+	delete _impl;
+}
+
+cl_uint CLBundleWriter::numEntries() const {
+	return (cl_uint) _impl->entries.size();
+}
+
+cl_int CLBundleWriter::add(CLProgram *program, const char *name, const char *options) {
+	if (name == NULL || strlen(name) >= MAX_CLBUNDLE_PROGRAM_NAME_LEN)
+		return CL_INVALID_VALUE;
+	std::vector<cl_device_id> deviceIds;
+	std::vector<std::vector<unsigned char> > binaries;
+	if (!programBinaries(program->id(), deviceIds, binaries))
+		return CL_INVALID_PROGRAM_EXECUTABLE;
+	for (size_t i = 0; i < deviceIds.size(); i++) {
+		if (binaries[i].empty())
+			continue;
+		Impl::Entry entry;
+		memset(&entry.header, 0, sizeof(entry.header));
+		strncpy(entry.header.name, name, MAX_CLBUNDLE_PROGRAM_NAME_LEN - 1);
+		clGetDeviceInfo(deviceIds[i], CL_DEVICE_NAME, sizeof(entry.header.deviceName) - 1, entry.header.deviceName, NULL);
+		clGetDeviceInfo(deviceIds[i], CL_DRIVER_VERSION, sizeof(entry.header.driverVersion) - 1, entry.header.driverVersion, NULL);
+		entry.header.optionsHash = optionsHash(options);
+		entry.header.sourceHash = program->sourceTextHash();
+		entry.header.size = binaries[i].size();
+		entry.header.binaryHash = clHash64(&binaries[i][0], binaries[i].size());
+		entry.binary.swap(binaries[i]);
+
+		bool replaced = false;
+		for (size_t j = 0; j < _impl->entries.size() && !replaced; j++) {
+			CLBundleEntry &other = _impl->entries[j].header;
+			if (other.optionsHash == entry.header.optionsHash && strcmp(other.name, entry.header.name) == 0
+				&& strcmp(other.deviceName, entry.header.deviceName) == 0
+				&& strcmp(other.driverVersion, entry.header.driverVersion) == 0) {
+				_impl->entries[j] = entry;
+				replaced = true;
+			}
+		}
+		if (!replaced)
+			_impl->entries.push_back(entry);
+	}
+	return CL_SUCCESS;
+}
+
+bool CLBundleWriter::write(const char *path) const {
+	cl_uint numEntries = (cl_uint) _impl->entries.size();
+	CLBundleHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLBUNDLE_MAGIC, sizeof(header.magic));
+	header.formatVersion = CLBUNDLE_FORMAT_VERSION;
+	header.numEntries = numEntries;
+	cl_ulong offset = sizeof(CLBundleHeader) + (cl_ulong) numEntries * sizeof(CLBundleEntry);
+	std::vector<CLBundleEntry> table(numEntries);
+	for (cl_uint i = 0; i < numEntries; i++) {
+		offset = (offset + 7) & ~(cl_ulong) 7;
+		table[i] = _impl->entries[i].header;
+		table[i].offset = offset;
+		offset += table[i].size;
+	}
+	header.fileSize = offset;
+
+	std::string tmpPath(path);
+	char suffix[64];
+	tmpFileSuffix(suffix, sizeof(suffix));
+	tmpPath += suffix;
+	FILE *fp = fopen(tmpPath.c_str(), "wb");
+	if (fp == NULL)
+		return false;
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& (numEntries == 0 || fwrite(&table[0], sizeof(CLBundleEntry), numEntries, fp) == numEntries);
+	static const char padding[8] = { 0 };
+	cl_ulong written = sizeof(CLBundleHeader) + (cl_ulong) numEntries * sizeof(CLBundleEntry);
+	for (cl_uint i = 0; ok && i < numEntries; i++) {
+		size_t pad = (size_t) (table[i].offset - written);
+		ok = (pad == 0 || fwrite(padding, pad, 1, fp) == 1)
+			&& fwrite(&_impl->entries[i].binary[0], _impl->entries[i].binary.size(), 1, fp) == 1;
+		written = table[i].offset + table[i].size;
+	}
+	ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(tmpPath.c_str(), path) != 0) {
+		remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Shadow copy of a kernel argument. Values up to sizeof(inlineBytes) (cl_mem handles, scalars,
+// vector types up to cl_double4) are kept inline, bigger structs on the heap.
+struct CLKernel::ArgShadow {
+	bool set;
+	bool local;
+	size_t size;
+	size_t capacity;
+	// a freed buffer's cl_mem handle value may come back for a new buffer, which must be bound again
+	cl_ulong memSerial;
+	unsigned char *heapBytes;
+	unsigned char inlineBytes[32];
+
+	ArgShadow() : set(false), local(false), size(0), capacity(sizeof(inlineBytes)), memSerial(0), heapBytes(NULL) {}
+	~ArgShadow() { free(heapBytes); }
+
+	unsigned char *bytes() { return heapBytes != NULL ? heapBytes : inlineBytes; }
+	bool matches(size_t valueSize, const void *value, cl_ulong valueMemSerial) {
+		if (!set || size != valueSize || local != (value == NULL) || memSerial != valueMemSerial)
+			return false;
+		return value == NULL || memcmp(bytes(), value, valueSize) == 0;
+	}
+	void assign(size_t valueSize, const void *value, cl_ulong valueMemSerial) {
+		set = false;
+		memSerial = valueMemSerial;
+		if (value != NULL && valueSize > capacity) {
+			unsigned char *grown = (unsigned char *) realloc(heapBytes, valueSize);
+			if (grown == NULL)
+				return;
+			heapBytes = grown;
+			capacity = valueSize;
+		}
+		if (value != NULL)
+			memcpy(bytes(), value, valueSize);
+		size = valueSize;
+		local = value == NULL;
+		set = true;
+	}
+};
+
+static std::atomic<cl_ulong> g_kernelSerial(0);
+
+CLKernel::CLKernel(CLProgram *program, const char *name) : _program(program), _name(name), _ciErrNum(0), _argNum(0), _numArgs(0),
+	_memArgs(NULL), _memArgAccess(NULL), _argShadows(NULL), _argsIssued(0), _argsElided(0), _launchMutex(new LaunchMutex()),
+	_tunedSizes(new TunedSizes()), _serial(++g_kernelSerial) {
+	// the program may still be building, see CLProgram::buildAsync
+	_program->wait();
+	_id = clCreateKernel(_program->id(), _name, &_ciErrNum);
+	if (_ciErrNum == CL_SUCCESS && clGetKernelInfo(_id, CL_KERNEL_NUM_ARGS, sizeof(_numArgs), &_numArgs, NULL) != CL_SUCCESS)
+		_numArgs = 0;
+	_memArgs = new CLMem*[_numArgs > 0 ? _numArgs : 1];
+	_memArgAccess = new CLMem::Access[_numArgs > 0 ? _numArgs : 1];
+	_argShadows = new ArgShadow[_numArgs > 0 ? _numArgs : 1];
+	for (cl_uint i = 0; i < _numArgs; i++) {
+		_memArgs[i] = NULL;
+		_memArgAccess[i] = CLMem::READ;
+	}
+}
+
+CLKernel::~CLKernel() {
+	delete[] _memArgs;
+	delete[] _memArgAccess;
+	delete[] _argShadows;
+	delete _launchMutex;
+	delete _tunedSizes;
+	clReleaseKernel(_id);
+}
+
+void CLKernel::bindMem(cl_uint argNum, CLMem *mem, CLMem::Access access) {
+	if (argNum < _numArgs) {
+		_memArgs[argNum] = mem;
+		_memArgAccess[argNum] = access;
+	}
+}
+
+// Arguments beyond the CL_KERNEL_NUM_ARGS count have no shadow and always reach the driver,
+// which reports the error.
+void CLKernel::setArgValue(cl_uint argNum, size_t size, const void *value, cl_ulong memSerial) {
+	if (argNum < _numArgs && _argShadows[argNum].matches(size, value, memSerial)) {
+		_argsElided++;
+		_ciErrNum = CL_SUCCESS;
+		return;
+	}
+	_argsIssued++;
+	_ciErrNum = clSetKernelArg(_id, argNum, size, value);
+	if (argNum < _numArgs) {
+		if (_ciErrNum == CL_SUCCESS)
+			_argShadows[argNum].assign(size, value, memSerial);
+		else
+			_argShadows[argNum].set = false;
+	}
+}
+
+cl_int CLKernel::setArgs(cl_uint numArgs, const CLKernelArg *args) {
+	if (_numArgs > 0 && numArgs != _numArgs)
+		return _ciErrNum = CL_INVALID_KERNEL_ARGS;
+	for (cl_uint i = 0; i < numArgs; i++) {
+		const CLKernelArg &arg = args[i];
+		if (arg.mem != NULL) {
+			bindMem(i, arg.mem, arg.access != 0 ? (CLMem::Access) arg.access : arg.mem->kernelAccess());
+			setArgValue(i, sizeof(cl_mem), (void*)&arg.mem->id(), arg.mem->serial());
+		}
+		else {
+			bindMem(i, NULL, CLMem::READ);
+			setArgValue(i, arg.size, arg.value);
+		}
+		if (_ciErrNum != CL_SUCCESS)
+			return _ciErrNum;
+	}
+	return _ciErrNum = CL_SUCCESS;
+}
+
+void CLKernel::invalidateArgs() {
+	for (cl_uint i = 0; i < _numArgs; i++)
+		_argShadows[i].set = false;
+}
+
+CLKernel* CLKernel::setArg(CLMem* arg, int argNum, int access) {
+	if(argNum != -1)
+		_argNum = (cl_uint) argNum;
 
-	_ciErrNum = clSetKernelArg(_id, _argNum++, sizeof(cl_int), (void*)&arg);
+	bindMem(_argNum, arg, access != 0 ? (CLMem::Access) access : arg->kernelAccess());
+	setArgValue(_argNum++, sizeof(cl_mem), (void*)&arg->id(), arg->serial());
 	return this;
 }
+
+CLKernel* CLKernel::setArg(cl_int& arg, int argNum) {
+	if(argNum != -1)
+		_argNum = (cl_uint) argNum;
+
+	bindMem(_argNum, NULL, CLMem::READ);
+	setArgValue(_argNum++, sizeof(cl_int), (void*)&arg);
+	return this;
+}
+
+CLKernel* CLKernel::setArgBytes(size_t size, const void *value, int argNum) {
+	if(argNum != -1)
+		_argNum = (cl_uint) argNum;
+
+	bindMem(_argNum, NULL, CLMem::READ);
+	setArgValue(_argNum++, size, value);
+	return this;
+}
+
+CLLatencyHistogram::CLLatencyHistogram() : _count(0) {
+	memset(_buckets, 0, sizeof(_buckets));
+}
+
+cl_uint CLLatencyHistogram::bucket(cl_ulong ns) {
+	if (ns < 8)
+		return (cl_uint) ns;
+	cl_uint exponent = 63;
+	while ((ns >> exponent) == 0)
+		exponent--;
+	return (exponent - 2) * 8 + (cl_uint) ((ns >> (exponent - 3)) & 7);
+}
+
+cl_ulong CLLatencyHistogram::bucketValue(cl_uint bucket) {
+	if (bucket < 8)
+		return bucket;
+	cl_uint exponent = bucket / 8 + 2;
+	// middle of the bucket
+	return ((cl_ulong) (8 + bucket % 8) << (exponent - 3)) + ((cl_ulong) 1 << (exponent - 3)) / 2;
+}
+
+void CLLatencyHistogram::record(cl_ulong ns) {
+	_buckets[bucket(ns)]++;
+	_count++;
+}
+
+cl_ulong CLLatencyHistogram::percentile(double p) const {
+	if (_count == 0)
+		return 0;
+	cl_ulong rank = (cl_ulong) (p * _count);
+	if (rank >= _count)
+		rank = _count - 1;
+	cl_ulong seen = 0;
+	for (cl_uint i = 0; i < CLPROFILE_HISTOGRAM_BUCKETS; i++) {
+		seen += _buckets[i];
+		if (seen > rank)
+			return bucketValue(i);
+	}
+	return bucketValue(CLPROFILE_HISTOGRAM_BUCKETS - 1);
+}
+
+CLProfileStats::CLProfileStats(Kind kind, const char *name) : _kind(kind), _count(0), _bytes(0), _execNs(0), _queuedNs(0), _submitNs(0) {
+	_name[0] = '\0';
+	if (name == NULL)
+		name = kind == HOST_TO_DEVICE ? "write" : kind == DEVICE_TO_HOST ? "read" : kind == KERNEL ? "kernel" : "other";
+	strncpy(_name, name, MAX_CLPROFILE_NAME_LEN - 1);
+	_name[MAX_CLPROFILE_NAME_LEN - 1] = '\0';
+}
+
+// Commands are collected in batches of this size while enqueuing, so that the pending list stays bounded
+#define CLPROFILE_COLLECT_THRESHOLD 64
+
+struct CLPendingCommand {
+	CLEvent event;
+	cl_uint statsIndex;
+	size_t bytes;
+};
+
+class CLProfiler::Impl {
+public:
+	mutable std::mutex mutex;
+	std::vector<CLProfileStats> stats;
+	std::vector<CLPendingCommand> pending;
+
+	cl_uint statsIndex(CLProfileStats::Kind kind, const char *name) {
+		for (size_t i = 0; i < stats.size(); i++) {
+			if (stats[i].kind() == kind && (name == NULL || strncmp(stats[i].name(), name, MAX_CLPROFILE_NAME_LEN - 1) == 0))
+				return (cl_uint) i;
+		}
+		stats.push_back(CLProfileStats(kind, name));
+		return (cl_uint) stats.size() - 1;
+	}
+
+	// Folds the command into its statistics, false if it has not completed yet
+	bool fold(const CLPendingCommand &command) {
+		cl_int status = command.event.status();
+		if (status > CL_COMPLETE)
+			return false;
+		cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+		cl_event ev = command.event.id();
+		if (status == CL_COMPLETE
+			&& clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) == CL_SUCCESS
+			&& clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL) == CL_SUCCESS
+			&& clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS
+			&& clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) {
+			CLProfileStats &s = stats[command.statsIndex];
+			s._count++;
+			s._bytes += command.bytes;
+			s._execNs += end > start ? end - start : 0;
+			s._queuedNs += submit > queued ? submit - queued : 0;
+			s._submitNs += start > submit ? start - submit : 0;
+			s._latency.record(end > start ? end - start : 0);
+		}
+		// failed commands are dropped
+		return true;
+	}
+};
+
+CLProfiler::CLProfiler() : _impl(new Impl()) {
+}
+
+CLProfiler::~CLProfiler() {
+	delete _impl;
+}
+
+void CLProfiler::record(const CLEvent &event, CLProfileStats::Kind kind, const char *name, size_t bytes) {
+	bool collectNow;
+	{
+		std::lock_guard<std::mutex> lock(_impl->mutex);
+		CLPendingCommand command;
+		command.event = event;
+		command.statsIndex = _impl->statsIndex(kind, name);
+		command.bytes = bytes;
+		_impl->pending.push_back(command);
+		collectNow = _impl->pending.size() % CLPROFILE_COLLECT_THRESHOLD == 0;
+	}
+	if (collectNow)
+		collect();
+}
+
+cl_uint CLProfiler::collect(bool wait) {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	std::vector<CLPendingCommand> &pending = _impl->pending;
+	size_t kept = 0;
+	for (size_t i = 0; i < pending.size(); i++) {
+		if (wait)
+			pending[i].event.wait();
+		if (!_impl->fold(pending[i]))
+			pending[kept++] = pending[i];
+	}
+	pending.resize(kept);
+	return (cl_uint) kept;
+}
+
+cl_uint CLProfiler::numStats() const {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	return (cl_uint) _impl->stats.size();
+}
+
+cl_uint CLProfiler::stats(CLProfileStats *stats, cl_uint maxStats) const {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	cl_uint n = 0;
+	for (; n < maxStats && n < _impl->stats.size(); n++)
+		stats[n] = _impl->stats[n];
+	return n;
+}
+
+bool CLProfiler::find(CLProfileStats::Kind kind, const char *name, CLProfileStats &stats) const {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	for (size_t i = 0; i < _impl->stats.size(); i++) {
+		const CLProfileStats &s = _impl->stats[i];
+		if (s.kind() == kind && (name == NULL || strncmp(s.name(), name, MAX_CLPROFILE_NAME_LEN - 1) == 0)) {
+			stats = s;
+			return true;
+		}
+	}
+	return false;
+}
+
+void CLProfiler::reset() {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	for (size_t i = 0; i < _impl->stats.size(); i++)
+		_impl->stats[i] = CLProfileStats(_impl->stats[i].kind(), _impl->stats[i].name());
+}
+
+void CLProfiler::print(std::ostream &os) const {
+	std::lock_guard<std::mutex> lock(_impl->mutex);
+	for (size_t i = 0; i < _impl->stats.size(); i++) {
+		const CLProfileStats &s = _impl->stats[i];
+		os << std::setw(24) << std::left << s.name() << std::right
+		   << " count " << s.count()
+		   << " p50 " << s.p50Ns() / 1000.0 << "us"
+		   << " p99 " << s.p99Ns() / 1000.0 << "us"
+		   << " total " << s.execNs() / 1e6 << "ms";
+		if (s.kind() != CLProfileStats::KERNEL)
+			os << " bytes " << s.bytes() << " " << s.gbps() << " GB/s";
+		os << std::endl;
+	}
+}
+
+CLPipeline::CLPipeline(CLContext *ctx, const CLDevice *device, cl_uint depth, cl_command_queue_properties properties)
+	: _ctx(ctx), _depth(depth > 0 ? depth : 1), _buffers(NULL), _numStreams(0), _chunkCapacity(0), _ciErrNum(CL_SUCCESS) {
+	_queues = new CLCommandQueue*[_depth];
+	for (cl_uint i = 0; i < _depth; i++) {
+		_queues[i] = new CLCommandQueue(ctx, device, properties);
+		if (_queues[i]->ciErrNum() != CL_SUCCESS)
+			_ciErrNum = _queues[i]->ciErrNum();
+	}
+}
+
+CLPipeline::~CLPipeline() {
+	freeBuffers();
+	for (cl_uint i = 0; i < _depth; i++)
+		delete _queues[i];
+	delete[] _queues;
+}
+
+void CLPipeline::freeBuffers() {
+	if (_buffers == NULL)
+		return;
+	for (cl_uint i = 0; i < _depth * _numStreams; i++)
+		delete _buffers[i];
+	delete[] _buffers;
+	_buffers = NULL;
+	_chunkCapacity = 0;
+}
+
+void CLPipeline::allocBuffers(size_t chunkElements) {
+	if (_buffers != NULL && chunkElements <= _chunkCapacity)
+		return;
+	freeBuffers();
+	_buffers = new CLMem*[_depth * _numStreams];
+	for (cl_uint slot = 0; slot < _depth; slot++) {
+		for (cl_uint j = 0; j < _numStreams; j++) {
+			size_t size = chunkElements * _streams[j].elementBytes;
+			if (_streams[j].input)
+				_buffers[slot * _numStreams + j] = new CLReadOnlyMem(_ctx, size);
+			else
+				_buffers[slot * _numStreams + j] = new CLWriteOnlyMem(_ctx, size);
+		}
+	}
+	_chunkCapacity = chunkElements;
+}
+
+CLPipeline* CLPipeline::addInput(const void *host, size_t elementBytes) {
+	if (_numStreams >= MAX_CLPIPELINE_STREAMS) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return this;
+	}
+	freeBuffers();
+	Stream &stream = _streams[_numStreams++];
+	stream.host = (char *) host;
+	stream.elementBytes = elementBytes;
+	stream.input = true;
+	return this;
+}
+
+CLPipeline* CLPipeline::addOutput(void *host, size_t elementBytes) {
+	addInput(host, elementBytes);
+	if (_ciErrNum == CL_SUCCESS)
+		_streams[_numStreams - 1].input = false;
+	return this;
+}
+
+CLPipeline* CLPipeline::run(CLKernel *kernel, size_t numElements, size_t chunkElements, size_t localWorkSize) {
+	if (numElements == 0 || _ciErrNum != CL_SUCCESS)
+		return this;
+	if (chunkElements == 0)
+		chunkElements = (numElements + _depth * 4 - 1) / (_depth * 4);
+	if (localWorkSize > 0)
+		chunkElements = (chunkElements + localWorkSize - 1) / localWorkSize * localWorkSize;
+	allocBuffers(chunkElements);
+
+	// Each slot has its own in-order queue, so reusing a slot's buffers for chunk k waits for chunk k - depth
+	// without any event; the slots themselves are independent and overlap.
+	size_t numChunks = (numElements + chunkElements - 1) / chunkElements;
+	for (size_t k = 0; k < numChunks && _ciErrNum == CL_SUCCESS; k++) {
+		cl_uint slot = (cl_uint) (k % _depth);
+		CLCommandQueue *queue = _queues[slot];
+		CLMem **buffers = &_buffers[slot * _numStreams];
+		size_t first = k * chunkElements;
+		size_t count = numElements - first < chunkElements ? numElements - first : chunkElements;
+		CLNDRange local = localWorkSize > 0 ? CLNDRange(localWorkSize) : _launchConfigs.local(kernel, queue->device(), count);
+		CLNDRange global = CLLaunchConfigCache::global(count, local);
+
+		for (cl_uint j = 0; j < _numStreams; j++) {
+			if (_streams[j].input && queue->enqueueWriteBuffer(buffers[j], false, 0, count * _streams[j].elementBytes,
+					_streams[j].host + first * _streams[j].elementBytes)->ciErrNum() != CL_SUCCESS)
+				_ciErrNum = queue->ciErrNum();
+			kernel->setArg(buffers[j], (int) j);
+		}
+		cl_int chunkCount = (cl_int) count;
+		kernel->setArg(chunkCount, (int) _numStreams);
+		if (queue->enqueueNDRangeKernel(kernel, global, local)->ciErrNum() != CL_SUCCESS)
+			_ciErrNum = queue->ciErrNum();
+		for (cl_uint j = 0; j < _numStreams; j++) {
+			if (!_streams[j].input && queue->enqueueReadBuffer(buffers[j], false, 0, count * _streams[j].elementBytes,
+					_streams[j].host + first * _streams[j].elementBytes)->ciErrNum() != CL_SUCCESS)
+				_ciErrNum = queue->ciErrNum();
+		}
+		// start the slot's commands now rather than when the driver batch fills up
+		queue->flush();
+	}
+	for (cl_uint i = 0; i < _depth; i++)
+		_queues[i]->finish();
+	return this;
+}
+
+// Tuning database: one line per kernel, device and problem size bucket, after a version line
+#define CLTUNING_DB_HEADER "# openclpp tuning db 1"
+
+struct CLTuningKey {
+	cl_ulong kernel;
+	cl_ulong device;
+	cl_uint bucket;
+
+	bool operator<(const CLTuningKey &other) const {
+		if (kernel != other.kernel)
+			return kernel < other.kernel;
+		if (device != other.device)
+			return device < other.device;
+		return bucket < other.bucket;
+	}
+};
+
+struct CLTuningEntry {
+	size_t localSize;
+	cl_ulong ns;
+	// for the readers of the file
+	std::string kernelName;
+	std::string deviceName;
+};
+
+typedef std::map<CLTuningKey, CLTuningEntry> CLTuningDB;
+
+static std::mutex g_tuningMutex;
+static CLTuningDB g_tuning;
+static bool g_tuningLoaded = false;
+// Bumped with g_tuningMutex held whenever g_tuning changes, invalidates the sizes the kernels keep
+static std::atomic<unsigned long> g_tuningGeneration(1);
+
+char CLAutotuner::g_databasePath[MAX_CLTUNING_DB_PATH_LEN] = "";
+
+static cl_ulong kernelTuningKey(const CLKernel *kernel) {
+	return clHash64(kernel->name(), strlen(kernel->name()) + 1, kernel->program()->sourceHash());
+}
+
+static cl_ulong deviceTuningKey(const CLDevice *device) {
+	return clHash64(device->driverVersion(), strlen(device->driverVersion()) + 1,
+		clHash64(device->name(), strlen(device->name()) + 1));
+}
+
+static cl_uint tuningBucket(size_t globalSize) {
+	cl_uint bucket = 0;
+	while (bucket < 63 && (globalSize >> (bucket + 1)) != 0)
+		bucket++;
+	return bucket;
+}
+
+static CLTuningKey tuningKey(const CLKernel *kernel, const CLDevice *device, size_t globalSize) {
+	CLTuningKey key = { kernelTuningKey(kernel), deviceTuningKey(device), tuningBucket(globalSize) };
+	return key;
+}
+
+static void loadTuningDB(const char *path, CLTuningDB &db) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	char line[1024];
+	bool ok = fgets(line, sizeof(line), fp) != NULL && strncmp(line, CLTUNING_DB_HEADER, strlen(CLTUNING_DB_HEADER)) == 0;
+	while (ok && fgets(line, sizeof(line), fp) != NULL) {
+		unsigned long long kernel, device, localSize, ns;
+		unsigned bucket;
+		char kernelName[256];
+		int deviceNameStart = 0;
+		if (sscanf(line, "%llx %llx %u %llu %llu %255s %n", &kernel, &device, &bucket, &localSize, &ns, kernelName, &deviceNameStart) < 6
+			|| localSize == 0)
+			continue;
+		CLTuningKey key = { kernel, device, bucket };
+		CLTuningEntry &entry = db[key];
+		entry.localSize = (size_t) localSize;
+		entry.ns = ns;
+		entry.kernelName = kernelName;
+		entry.deviceName = deviceNameStart > 0 ? line + deviceNameStart : "";
+		while (!entry.deviceName.empty() && (entry.deviceName[entry.deviceName.size() - 1] == '\n' || entry.deviceName[entry.deviceName.size() - 1] == '\r'))
+			entry.deviceName.erase(entry.deviceName.size() - 1);
+	}
+	fclose(fp);
+}
+
+// Loads the database file on first use, called with g_tuningMutex held
+static void loadTuningDBOnce(const char *path) {
+	if (g_tuningLoaded)
+		return;
+	g_tuningLoaded = true;
+	if (path != NULL) {
+		loadTuningDB(path, g_tuning);
+		g_tuningGeneration++;
+	}
+}
+
+const char *CLAutotuner::databasePath() {
+	const char *path = g_databasePath[0] != '\0' ? g_databasePath : getenv("OPENCLPP_TUNING_DB");
+	return path != NULL && path[0] != '\0' ? path : NULL;
+}
+
+bool CLAutotuner::setDatabaseFile(const char *path) {
+	std::lock_guard<std::mutex> lock(g_tuningMutex);
+	if (g_tuningLoaded)
+		return false;
+	g_databasePath[0] = '\0';
+	if (path != NULL)
+		strncat(g_databasePath, path, MAX_CLTUNING_DB_PATH_LEN - 1);
+	return true;
+}
+
+cl_uint CLAutotuner::candidates(CLKernel *kernel, const CLDevice *device, size_t globalSize, size_t *sizes, cl_uint maxSizes) {
+	size_t kernelMax = 0, multiple = 1;
+	if (clGetKernelWorkGroupInfo(kernel->id(), device->id(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelMax), &kernelMax, NULL) != CL_SUCCESS)
+		kernelMax = device->maxWorkGroupSize();
+	if (clGetKernelWorkGroupInfo(kernel->id(), device->id(), CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL) != CL_SUCCESS
+		|| multiple == 0)
+		multiple = 1;
+	size_t limit = kernelMax;
+	if (device->maxWorkGroupSize() > 0 && device->maxWorkGroupSize() < limit)
+		limit = device->maxWorkGroupSize();
+	if (device->maxWorkItemSizes()[0] > 0 && device->maxWorkItemSizes()[0] < limit)
+		limit = device->maxWorkItemSizes()[0];
+
+	// the global size is padded to the local size: a group larger than the problem only wastes work items
+	if (globalSize > 0 && globalSize < limit)
+		limit = globalSize;
+
+	std::vector<size_t> all;
+	for (size_t size = limit < 8 ? 1 : 8; size <= limit; size *= 2)
+		all.push_back(size);
+	for (size_t size = multiple; size <= limit; size *= 2)
+		all.push_back(size);
+	std::sort(all.begin(), all.end());
+	all.erase(std::unique(all.begin(), all.end()), all.end());
+	cl_uint count = 0;
+	for (size_t i = 0; i < all.size() && count < maxSizes; i++)
+		sizes[count++] = all[i];
+	return count;
+}
+
+size_t CLAutotuner::tune(CLCommandQueue *queue, CLKernel *kernel, size_t globalSize, cl_uint repetitions) {
+	const CLDevice *device = queue->device();
+	size_t sizes[MAX_CLTUNING_CANDIDATES];
+	cl_uint numSizes = candidates(kernel, device, globalSize, sizes, MAX_CLTUNING_CANDIDATES);
+	CLCommandQueue *timingQueue = queue;
+	if ((queue->properties() & CL_QUEUE_PROFILING_ENABLE) == 0) {
+		timingQueue = new CLCommandQueue(const_cast<CLContext*>(queue->ctx()), device, CL_QUEUE_PROFILING_ENABLE);
+		if (timingQueue->ciErrNum() != CL_SUCCESS) {
+			delete timingQueue;
+			return 0;
+		}
+	}
+	if (repetitions == 0)
+		repetitions = 1;
+
+	size_t best = 0;
+	cl_ulong bestNs = 0;
+	for (cl_uint i = 0; i < numSizes; i++) {
+		// the launch CLLaunchConfig makes with this local size
+		size_t paddedSize = (globalSize + sizes[i] - 1) / sizes[i] * sizes[i];
+		// the warm-up run also rejects the sizes the kernel cannot run with (e.g. local memory)
+		CLEvent ev;
+		if (timingQueue->enqueueNDRangeKernel(kernel, 1, NULL, &paddedSize, &sizes[i], 0, NULL, &ev)->ciErrNum() != CL_SUCCESS
+			|| ev.wait() != CL_SUCCESS)
+			continue;
+		// fastest run: the others include interference
+		cl_ulong ns = 0;
+		for (cl_uint r = 0; r < repetitions; r++) {
+			if (timingQueue->enqueueNDRangeKernel(kernel, 1, NULL, &paddedSize, &sizes[i], 0, NULL, &ev)->ciErrNum() != CL_SUCCESS
+				|| ev.wait() != CL_SUCCESS) {
+				ns = 0;
+				break;
+			}
+			cl_ulong elapsed = ev.elapsedNs();
+			if (r == 0 || elapsed < ns)
+				ns = elapsed;
+		}
+		if (ns > 0 && (best == 0 || ns < bestNs)) {
+			best = sizes[i];
+			bestNs = ns;
+		}
+	}
+	if (timingQueue != queue)
+		delete timingQueue;
+
+	if (best != 0) {
+		record(kernel, device, globalSize, best, bestNs);
+		if (databasePath() != NULL)
+			save();
+	}
+	return best;
+}
+
+// Entry of the key's bucket or else of the nearest bucket tuned for the kernel and device, called with
+// g_tuningMutex held
+static size_t nearestTunedSize(const CLTuningKey &key) {
+	const CLTuningEntry *nearest = NULL;
+	cl_uint distance = 0;
+	CLTuningDB::const_iterator it = g_tuning.lower_bound(key);
+	if (it != g_tuning.end() && it->first.kernel == key.kernel && it->first.device == key.device) {
+		nearest = &it->second;
+		distance = it->first.bucket - key.bucket;
+	}
+	if (it != g_tuning.begin()) {
+		--it;
+		if (it->first.kernel == key.kernel && it->first.device == key.device && (nearest == NULL || key.bucket - it->first.bucket < distance))
+			nearest = &it->second;
+	}
+	return nearest != NULL ? nearest->localSize : 0;
+}
+
+size_t CLAutotuner::localSize(const CLKernel *kernel, const CLDevice *device, size_t globalSize) {
+	CLKernel::TunedSizes &tuned = *kernel->_tunedSizes;
+	std::pair<const CLDevice*, cl_uint> slot(device, tuningBucket(globalSize));
+	CLTuningKey key;
+	{
+		std::lock_guard<std::mutex> lock(tuned.mutex);
+		std::map<std::pair<const CLDevice*, cl_uint>, size_t>::const_iterator it = tuned.sizes.find(slot);
+		if (it != tuned.sizes.end() && tuned.generation == g_tuningGeneration)
+			return it->second;
+		if (!tuned.hashed) {
+			tuned.kernelKey = kernelTuningKey(kernel);
+			tuned.hashed = true;
+		}
+		key.kernel = tuned.kernelKey;
+	}
+	key.device = deviceTuningKey(device);
+	key.bucket = slot.second;
+
+	size_t size;
+	unsigned long generation;
+	{
+		std::lock_guard<std::mutex> lock(g_tuningMutex);
+		loadTuningDBOnce(databasePath());
+		size = g_tuning.empty() ? 0 : nearestTunedSize(key);
+		generation = g_tuningGeneration;
+	}
+	std::lock_guard<std::mutex> lock(tuned.mutex);
+	if (tuned.generation != generation) {
+		tuned.sizes.clear();
+		tuned.generation = generation;
+	}
+	tuned.sizes[slot] = size;
+	return size;
+}
+
+void CLAutotuner::record(const CLKernel *kernel, const CLDevice *device, size_t globalSize, size_t localSize, cl_ulong ns) {
+	std::lock_guard<std::mutex> lock(g_tuningMutex);
+	loadTuningDBOnce(databasePath());
+	CLTuningEntry &entry = g_tuning[tuningKey(kernel, device, globalSize)];
+	entry.localSize = localSize;
+	entry.ns = ns;
+	entry.kernelName = kernel->name();
+	entry.deviceName = device->name();
+	g_tuningGeneration++;
+}
+
+bool CLAutotuner::save() {
+	const char *path = databasePath();
+	if (path == NULL)
+		return false;
+	std::lock_guard<std::mutex> lock(g_tuningMutex);
+	loadTuningDBOnce(path);
+	// entries saved by other processes since the load are kept, ours win
+	CLTuningDB merged;
+	loadTuningDB(path, merged);
+	for (CLTuningDB::const_iterator it = g_tuning.begin(); it != g_tuning.end(); ++it)
+		merged[it->first] = it->second;
+	g_tuning = merged;
+	g_tuningGeneration++;
+
+	char tmpPath[MAX_CLTUNING_DB_PATH_LEN + 64];
+	char suffix[64];
+	tmpFileSuffix(suffix, sizeof(suffix));
+	snprintf(tmpPath, sizeof(tmpPath), "%s%s", path, suffix);
+	FILE *fp = fopen(tmpPath, "w");
+	if (fp == NULL)
+		return false;
+	bool ok = fprintf(fp, "%s\n# kernel-hash device-hash bucket local-size ns kernel device\n", CLTUNING_DB_HEADER) > 0;
+	for (CLTuningDB::const_iterator it = g_tuning.begin(); ok && it != g_tuning.end(); ++it) {
+		ok = fprintf(fp, "%016llx %016llx %u %llu %llu %s %s\n", (unsigned long long) it->first.kernel, (unsigned long long) it->first.device,
+			it->first.bucket, (unsigned long long) it->second.localSize, (unsigned long long) it->second.ns,
+			it->second.kernelName.c_str(), it->second.deviceName.c_str()) > 0;
+	}
+	ok = (fclose(fp) == 0) && ok;
+#if defined(_WIN32) || defined(_WIN64)
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(tmpPath, path) != 0) {
+		remove(tmpPath);
+		return false;
+	}
+	return true;
+}
+
+void CLAutotuner::clear() {
+	std::lock_guard<std::mutex> lock(g_tuningMutex);
+	g_tuning.clear();
+	g_tuningGeneration++;
+}
+
+unsigned long CLAutotuner::generation() {
+	return g_tuningGeneration;
+}
+
+static CLNDRange ndRange(cl_uint dim, const size_t *sizes) {
+	return dim == 1 ? CLNDRange(sizes[0]) : dim == 2 ? CLNDRange(sizes[0], sizes[1]) : CLNDRange(sizes[0], sizes[1], sizes[2]);
+}
+
+CLLaunchConfig::CLLaunchConfig(CLKernel *kernel, const CLDevice *device, const CLNDRange &problem, size_t localMemPerItem)
+	: _problem(problem), _global(problem), _kernelWorkGroupSize(0), _preferredMultiple(1), _kernelLocalMemSize(0) {
+	cl_uint dim = problem.dim();
+	if (dim == 0) {
+		_ciErrNum = CL_INVALID_WORK_DIMENSION;
+		return;
+	}
+	for (cl_uint d = 0; d < dim; d++) {
+		if (problem[d] == 0) {
+			_ciErrNum = CL_INVALID_GLOBAL_WORK_SIZE;
+			return;
+		}
+	}
+	_ciErrNum = clGetKernelWorkGroupInfo(kernel->id(), device->id(), CL_KERNEL_WORK_GROUP_SIZE, sizeof(_kernelWorkGroupSize), &_kernelWorkGroupSize, NULL);
+	if (_ciErrNum != CL_SUCCESS)
+		return;
+	if (clGetKernelWorkGroupInfo(kernel->id(), device->id(), CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(_preferredMultiple), &_preferredMultiple, NULL) != CL_SUCCESS
+		|| _preferredMultiple == 0)
+		_preferredMultiple = 1;
+	if (clGetKernelWorkGroupInfo(kernel->id(), device->id(), CL_KERNEL_LOCAL_MEM_SIZE, sizeof(_kernelLocalMemSize), &_kernelLocalMemSize, NULL) != CL_SUCCESS)
+		_kernelLocalMemSize = 0;
+
+	size_t limit = _kernelWorkGroupSize;
+	if (device->maxWorkGroupSize() > 0 && device->maxWorkGroupSize() < limit)
+		limit = device->maxWorkGroupSize();
+	if (localMemPerItem > 0) {
+		cl_ulong available = device->localMemSize() > _kernelLocalMemSize ? device->localMemSize() - _kernelLocalMemSize : 0;
+		if (available / localMemPerItem < limit)
+			limit = (size_t) (available / localMemPerItem);
+	}
+	if (limit == 0) {
+		_ciErrNum = CL_OUT_OF_RESOURCES;
+		return;
+	}
+
+	size_t local[3] = { 1, 1, 1 };
+	size_t tuned = dim == 1 ? CLAutotuner::localSize(kernel, device, problem[0]) : 0;
+	if (tuned != 0 && tuned <= limit && (device->maxWorkItemSizes()[0] == 0 || tuned <= device->maxWorkItemSizes()[0]))
+		local[0] = tuned;
+	else {
+		// x gets the preferred multiple (whole warps or wavefronts, coalesced rows), grown up to the problem
+		// size; in 2D and 3D at most max(multiple, 16) so that the other dimensions get their share
+		size_t remaining = limit < CLLAUNCH_TARGET_GROUP_SIZE ? limit : CLLAUNCH_TARGET_GROUP_SIZE;
+		for (cl_uint d = 0; d < dim; d++) {
+			size_t cap = remaining;
+			if (device->maxWorkItemSizes()[d] > 0 && device->maxWorkItemSizes()[d] < cap)
+				cap = device->maxWorkItemSizes()[d];
+			if (d == 0 && dim > 1) {
+				size_t rowCap = _preferredMultiple > 16 ? _preferredMultiple : 16;
+				if (rowCap < cap)
+					cap = rowCap;
+			}
+			size_t size = d == 0 && _preferredMultiple <= cap ? _preferredMultiple : 1;
+			while (size * 2 <= cap && size < problem[d])
+				size *= 2;
+			local[d] = size;
+			remaining /= size;
+		}
+	}
+	size_t global[3];
+	for (cl_uint d = 0; d < dim; d++)
+		global[d] = (problem[d] + local[d] - 1) / local[d] * local[d];
+	_global = ndRange(dim, global);
+	_local = ndRange(dim, local);
+}
+
+struct CLLaunchConfigKey {
+	cl_ulong kernel;                   // serial
+	const CLDevice *device;
+	size_t localMemPerItem;
+	cl_uint bucket;
+
+	bool operator<(const CLLaunchConfigKey &other) const {
+		if (kernel != other.kernel)
+			return kernel < other.kernel;
+		if (device != other.device)
+			return device < other.device;
+		if (localMemPerItem != other.localMemPerItem)
+			return localMemPerItem < other.localMemPerItem;
+		return bucket < other.bucket;
+	}
+};
+
+class CLLaunchConfigCache::Impl {
+public:
+	// 0 for a configuration which failed
+	std::map<CLLaunchConfigKey, size_t> localSizes;
+	unsigned long generation;
+
+	Impl() : generation(0) {}
+};
+
+CLLaunchConfigCache::CLLaunchConfigCache() : _impl(new Impl()) {
+}
+
+CLLaunchConfigCache::~CLLaunchConfigCache() {
+	delete _impl;
+}
+
+CLNDRange CLLaunchConfigCache::local(CLKernel *kernel, const CLDevice *device, size_t problem, size_t localMemPerItem) {
+	unsigned long generation = CLAutotuner::generation();
+	if (_impl->generation != generation) {
+		_impl->localSizes.clear();
+		_impl->generation = generation;
+	}
+	CLLaunchConfigKey key = { kernel->serial(), device, localMemPerItem, tuningBucket(problem) };
+	std::map<CLLaunchConfigKey, size_t>::iterator it = _impl->localSizes.find(key);
+	if (it == _impl->localSizes.end()) {
+		CLLaunchConfig config(kernel, device, CLNDRange(problem), localMemPerItem);
+		size_t localSize = config.ciErrNum() == CL_SUCCESS ? config.local()[0] : 0;
+		it = _impl->localSizes.insert(std::make_pair(key, localSize)).first;
+	}
+	return it->second > 0 ? CLNDRange(it->second) : CLNDRange();
+}
+
+CLNDRange CLLaunchConfigCache::global(size_t problem, const CLNDRange &local) {
+	return local.dim() > 0 ? CLNDRange((problem + local[0] - 1) / local[0] * local[0]) : CLNDRange(problem);
+}
+
+// Programs of the library's primitives (CLReduction, ...), built once per context and source. The
+// cache outlives the static objects, a static CLContext may be destroyed after it otherwise.
+struct CLPrimitiveProgram {
+	std::string source;
+	const char *strings[1];
+	CLProgram *program;
+};
+typedef std::map<std::pair<const CLContext*, std::string>, CLPrimitiveProgram*> CLPrimitivePrograms;
+struct CLPrimitiveCache {
+	std::mutex mutex;
+	CLPrimitivePrograms programs;
+};
+
+static CLPrimitiveCache &primitiveCache() {
+	static CLPrimitiveCache *cache = new CLPrimitiveCache;
+	return *cache;
+}
+
+// Built program of source for all the context's devices, NULL on error (in *ciErrNum)
+static CLProgram *primitiveProgram(CLContext *ctx, const std::string &source, cl_int *ciErrNum) {
+	CLPrimitiveCache &cache = primitiveCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	std::pair<const CLContext*, std::string> key(ctx, source);
+	CLPrimitivePrograms::iterator it = cache.programs.find(key);
+	if (it != cache.programs.end()) {
+		*ciErrNum = CL_SUCCESS;
+		return it->second->program;
+	}
+	CLPrimitiveProgram *entry = new CLPrimitiveProgram;
+	entry->source = source;
+	entry->strings[0] = entry->source.c_str();
+	entry->program = new CLProgram(ctx, 1, entry->strings);
+	if (entry->program->build() == NULL) {
+		*ciErrNum = entry->program->ciErrNum();
+		delete entry->program;
+		delete entry;
+		return NULL;
+	}
+	cache.programs[key] = entry;
+	*ciErrNum = CL_SUCCESS;
+	return entry->program;
+}
+
+static void releasePrimitivePrograms(const CLContext *ctx) {
+	CLPrimitiveCache &cache = primitiveCache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	CLPrimitivePrograms::iterator it = cache.programs.lower_bound(std::make_pair(ctx, std::string()));
+	while (it != cache.programs.end() && it->first.first == ctx) {
+		delete it->second->program;
+		delete it->second;
+		cache.programs.erase(it++);
+	}
+}
+
+// Element type of a primitive's kernels as CLPP_T
+static std::string primitivePreamble(const char *typeName, bool isDouble) {
+	std::string preamble = isDouble ? "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n" : "";
+	return preamble + "#define CLPP_T " + typeName + "\n";
+}
+
+// Largest power of 2 not above size
+static size_t floorPow2(size_t size) {
+	size_t pow2 = 1;
+	while (pow2 * 2 <= size)
+		pow2 *= 2;
+	return pow2;
+}
+
+// Reduces in[offset, offset + n) to out[outOffset + group]: a strided loop per work item, then a tree in local memory
+static const char *g_reduceSource = R"(
+__kernel void Reduce(__global const CLPP_T *in, uint offset, uint n, __global CLPP_T *out, uint outOffset, __local CLPP_T *scratch)
+{
+	uint lid = get_local_id(0);
+	uint stride = get_global_size(0);
+	CLPP_T acc = REDUCE_IDENTITY;
+	for (uint i = get_global_id(0); i < n; i += stride) {
+		CLPP_T a = acc, b = in[offset + i];
+		acc = REDUCE_OP(a, b);
+	}
+	scratch[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint s = get_local_size(0) >> 1; s > 0; s >>= 1) {
+		if (lid < s) {
+			CLPP_T a = scratch[lid], b = scratch[lid + s];
+			scratch[lid] = REDUCE_OP(a, b);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		out[outOffset + get_group_id(0)] = scratch[0];
+}
+)";
+
+CLReductionBase::CLReductionBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize, const CLReduceOp &op)
+	: _ctx(ctx), _device(device), _kernel(NULL), _partials(NULL), _result(NULL), _elementSize(elementSize), _localSize(0), _maxGroups(0) {
+	if (isDouble && device->nativeDoubleSupport() == 0) {
+		_ciErrNum = CL_INVALID_DEVICE;
+		return;
+	}
+	std::string source = primitivePreamble(typeName, isDouble)
+		+ "#define REDUCE_OP(a, b) (" + op.expression + ")\n"
+		+ "#define REDUCE_IDENTITY (" + op.identity + ")\n" + g_reduceSource;
+	CLProgram *program = primitiveProgram(ctx, source, &_ciErrNum);
+	if (program == NULL)
+		return;
+	_kernel = new CLKernel(program, "Reduce");
+	if ((_ciErrNum = _kernel->ciErrNum()) != CL_SUCCESS)
+		return;
+	// largest local size the kernel and its local memory allow, as a power of 2 for the tree
+	CLLaunchConfig config(_kernel, device, CLNDRange(1 << 20), elementSize);
+	if ((_ciErrNum = config.ciErrNum()) != CL_SUCCESS)
+		return;
+	_localSize = floorPow2(config.local()[0]);
+	// a few groups per compute unit to hide latency, reduced by one group in the second pass
+	_maxGroups = device->numComputeUnits() > 0 ? device->numComputeUnits() * 4 : 1;
+	if (_maxGroups > _localSize)
+		_maxGroups = _localSize;
+	_partials = new CLMem(ctx, CL_MEM_READ_WRITE, _maxGroups * elementSize);
+	_result = new CLMem(ctx, CL_MEM_READ_WRITE, elementSize);
+	if ((_ciErrNum = _partials->ciErrNum()) == CL_SUCCESS)
+		_ciErrNum = _result->ciErrNum();
+}
+
+CLReductionBase::~CLReductionBase() {
+	delete _result;
+	delete _partials;
+	delete _kernel;
+}
+
+CLCommandQueue* CLReductionBase::enqueueReduce(CLCommandQueue *queue, CLMem *in, size_t offset, size_t count, CLMem *out, size_t outOffset,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_kernel == NULL || _partials == NULL)
+		return queue;
+	size_t inCount = in->size() / _elementSize;
+	if (offset > inCount || count > inCount - offset || outOffset >= out->size() / _elementSize) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	// the kernel indexes with uint
+	if (offset + count > 0xffffffffu - _localSize * _maxGroups || outOffset > 0xffffffffu) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	size_t groups = (count + _localSize - 1) / _localSize;
+	if (groups > _maxGroups)
+		groups = _maxGroups;
+	if (groups == 0)
+		groups = 1;
+	cl_uint inOffset = (cl_uint) offset, n = (cl_uint) count, resultOffset = (cl_uint) outOffset, zero = 0, numPartials = (cl_uint) groups;
+	CLLocalMem scratch(_localSize * _elementSize);
+	if (groups == 1) {
+		CLKernelArg args[] = { CLKernelArg::of(in), CLKernelArg::of(inOffset), CLKernelArg::of(n), CLKernelArg::of(out),
+			CLKernelArg::of(resultOffset), CLKernelArg::of(scratch) };
+		_ciErrNum = queue->enqueueKernel(_kernel, 6, args, CLNDRange(_localSize), CLNDRange(_localSize), numWaitEvents, waitList, event)->ciErrNum();
+		return queue;
+	}
+	CLEvent partialsDone;
+	CLKernelArg firstPass[] = { CLKernelArg::of(in), CLKernelArg::of(inOffset), CLKernelArg::of(n), CLKernelArg::of(_partials),
+		CLKernelArg::of(zero), CLKernelArg::of(scratch) };
+	if ((_ciErrNum = queue->enqueueKernel(_kernel, 6, firstPass, CLNDRange(groups * _localSize), CLNDRange(_localSize),
+			numWaitEvents, waitList, &partialsDone)->ciErrNum()) != CL_SUCCESS)
+		return queue;
+	CLKernelArg secondPass[] = { CLKernelArg::of(_partials), CLKernelArg::of(zero), CLKernelArg::of(numPartials), CLKernelArg::of(out),
+		CLKernelArg::of(resultOffset), CLKernelArg::of(scratch) };
+	_ciErrNum = queue->enqueueKernel(_kernel, 6, secondPass, CLNDRange(_localSize), CLNDRange(_localSize), 1, &partialsDone, event)->ciErrNum();
+	return queue;
+}
+
+void CLReductionBase::reduce(CLCommandQueue *queue, CLMem *in, size_t offset, size_t count, void *value) {
+	if (enqueueReduce(queue, in, offset, count, _result, 0, 0, NULL, NULL) != NULL && _ciErrNum == CL_SUCCESS)
+		_ciErrNum = queue->enqueueReadBuffer(_result, true, 0, _elementSize, value)->ciErrNum();
+}
+
+// Scan over (head, value) pairs: (h1, v1) + (h2, v2) = (h1 | h2, h2 ? v2 : v1 op v2) is associative and
+// restarts at the segment heads. SCAN_HEAD(i) is 0 for a plain scan. Each group scans the chunk
+// [group * chunk, min(n, (group + 1) * chunk)) in tiles of 2 * get_local_size(0) elements.
+static const char *g_scanSource = R"(
+typedef struct { uint head; CLPP_T value; } ScanPair;
+
+ScanPair scanIdentity()
+{
+	ScanPair r;
+	r.head = 0;
+	r.value = SCAN_IDENTITY;
+	return r;
+}
+
+ScanPair scanCombine(ScanPair x, ScanPair y)
+{
+	ScanPair r;
+	r.head = x.head | y.head;
+	if (y.head)
+		r.value = y.value;
+	else {
+		CLPP_T a = x.value, b = y.value;
+		r.value = SCAN_OP(a, b);
+	}
+	return r;
+}
+
+// Exclusive Blelloch scan of the 2 * get_local_size(0) pairs of tile, the total in tile[2 * get_local_size(0)]
+void scanTile(__local ScanPair *tile)
+{
+	uint lid = get_local_id(0);
+	uint n = 2 * get_local_size(0);
+	uint offset = 1;
+	for (uint d = n >> 1; d > 0; d >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint ai = offset * (2 * lid + 1) - 1, bi = offset * (2 * lid + 2) - 1;
+			tile[bi] = scanCombine(tile[ai], tile[bi]);
+		}
+		offset <<= 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0) {
+		tile[n] = tile[n - 1];
+		tile[n - 1] = scanIdentity();
+	}
+	for (uint d = 1; d < n; d <<= 1) {
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint ai = offset * (2 * lid + 1) - 1, bi = offset * (2 * lid + 2) - 1;
+			ScanPair left = tile[ai];
+			tile[ai] = tile[bi];
+			tile[bi] = scanCombine(tile[bi], left);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+#define SCAN_LOAD(p, i, end) { (p).head = (i) < (end) ? SCAN_HEAD(i) : 0; (p).value = (i) < (end) ? in[i] : SCAN_IDENTITY; }
+
+__kernel void ScanReduce(__global const CLPP_T *in SCAN_SEGMENTS, uint n, uint chunk, __global CLPP_T *sumValues, __global uint *sumHeads,
+	__local ScanPair *tile)
+{
+	uint lid = get_local_id(0), half = get_local_size(0);
+	uint begin = get_group_id(0) * chunk;
+	uint end = min(n, begin + chunk);
+	ScanPair total = scanIdentity();
+	for (uint base = begin; base < end; base += 2 * half) {
+		uint i0 = base + lid, i1 = base + half + lid;
+		ScanPair p0, p1;
+		SCAN_LOAD(p0, i0, end);
+		SCAN_LOAD(p1, i1, end);
+		tile[lid] = p0;
+		tile[half + lid] = p1;
+		scanTile(tile);
+		total = scanCombine(total, tile[2 * half]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0) {
+		sumValues[get_group_id(0)] = total.value;
+		sumHeads[get_group_id(0)] = total.head;
+	}
+}
+
+// Exclusive scan of the numSums <= 2 * get_local_size(0) chunk totals, in place, by one group
+__kernel void ScanSums(__global CLPP_T *sumValues, __global uint *sumHeads, uint numSums, __local ScanPair *tile)
+{
+	uint lid = get_local_id(0), half = get_local_size(0);
+	for (uint k = 0; k < 2; k++) {
+		uint i = k * half + lid;
+		ScanPair p = scanIdentity();
+		if (i < numSums) {
+			p.head = sumHeads[i];
+			p.value = sumValues[i];
+		}
+		tile[i] = p;
+	}
+	scanTile(tile);
+	for (uint k = 0; k < 2; k++) {
+		uint i = k * half + lid;
+		if (i < numSums) {
+			sumHeads[i] = tile[i].head;
+			sumValues[i] = tile[i].value;
+		}
+	}
+}
+
+// Result of an element from its chunk's prefix carry and its exclusive prefix within the tile
+CLPP_T scanResult(ScanPair carry, ScanPair prefix, ScanPair element, uint inclusive)
+{
+	ScanPair p = scanCombine(carry, prefix);
+	if (inclusive)
+		return scanCombine(p, element).value;
+	return element.head ? SCAN_IDENTITY : p.value;
+}
+
+__kernel void ScanTiles(__global const CLPP_T *in SCAN_SEGMENTS, uint n, uint chunk, __global const CLPP_T *sumValues,
+	__global const uint *sumHeads, __global CLPP_T *out, uint inclusive, __local ScanPair *tile)
+{
+	uint lid = get_local_id(0), half = get_local_size(0);
+	uint begin = get_group_id(0) * chunk;
+	uint end = min(n, begin + chunk);
+	ScanPair carry;
+	carry.head = sumHeads[get_group_id(0)];
+	carry.value = sumValues[get_group_id(0)];
+	for (uint base = begin; base < end; base += 2 * half) {
+		uint i0 = base + lid, i1 = base + half + lid;
+		ScanPair p0, p1;
+		SCAN_LOAD(p0, i0, end);
+		SCAN_LOAD(p1, i1, end);
+		tile[lid] = p0;
+		tile[half + lid] = p1;
+		scanTile(tile);
+		if (i0 < end)
+			out[i0] = scanResult(carry, tile[lid], p0, inclusive);
+		if (i1 < end)
+			out[i1] = scanResult(carry, tile[half + lid], p1, inclusive);
+		carry = scanCombine(carry, tile[2 * half]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+)";
+
+CLScanBase::CLScanBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize, const CLReduceOp &op,
+	Segments segments, const char *keyTypeName, bool keyIsDouble)
+	: _ctx(ctx), _device(device), _segments(segments), _reduceKernel(NULL), _sumsKernel(NULL), _scanKernel(NULL),
+	_sumValues(NULL), _sumHeads(NULL), _elementSize(elementSize), _localSize(0), _maxGroups(0) {
+	if ((isDouble || (segments == KEYS && keyIsDouble)) && device->nativeDoubleSupport() == 0) {
+		_ciErrNum = CL_INVALID_DEVICE;
+		return;
+	}
+	std::string source = primitivePreamble(typeName, isDouble || (segments == KEYS && keyIsDouble))
+		+ "#define SCAN_OP(a, b) (" + op.expression + ")\n"
+		+ "#define SCAN_IDENTITY (" + op.identity + ")\n";
+	if (segments == NONE)
+		source += "#define SCAN_SEGMENTS\n#define SCAN_HEAD(i) 0u\n";
+	else if (segments == FLAGS)
+		source += "#define SCAN_SEGMENTS , __global const uint *segments\n#define SCAN_HEAD(i) (segments[i] != 0 ? 1u : 0u)\n";
+	else
+		source += std::string("#define SCAN_SEGMENTS , __global const ") + keyTypeName + " *segments\n"
+			+ "#define SCAN_HEAD(i) ((i) == 0 || segments[i] != segments[(i) - 1] ? 1u : 0u)\n";
+	source += g_scanSource;
+	CLProgram *program = primitiveProgram(ctx, source, &_ciErrNum);
+	if (program == NULL)
+		return;
+	_reduceKernel = new CLKernel(program, "ScanReduce");
+	_sumsKernel = new CLKernel(program, "ScanSums");
+	_scanKernel = new CLKernel(program, "ScanTiles");
+	if ((_ciErrNum = _reduceKernel->ciErrNum()) != CL_SUCCESS || (_ciErrNum = _sumsKernel->ciErrNum()) != CL_SUCCESS
+		|| (_ciErrNum = _scanKernel->ciErrNum()) != CL_SUCCESS)
+		return;
+
+	// Largest power of 2 work group the three kernels, the device and its local memory allow: 2 tiles + 2
+	// pairs of 2 * elementSize bytes (a uint and a 4 or 8 byte CLPP_T) per work item
+	size_t limit = device->maxWorkGroupSize();
+	CLKernel *kernels[] = { _reduceKernel, _sumsKernel, _scanKernel };
+	cl_ulong kernelLocalMem = 0;
+	for (int k = 0; k < 3; k++) {
+		CLLaunchConfig config(kernels[k], device, CLNDRange(1));
+		if ((_ciErrNum = config.ciErrNum()) != CL_SUCCESS)
+			return;
+		if (config.kernelWorkGroupSize() < limit)
+			limit = config.kernelWorkGroupSize();
+		if (config.kernelLocalMemSize() > kernelLocalMem)
+			kernelLocalMem = config.kernelLocalMemSize();
+	}
+	size_t pairBytes = 2 * elementSize;
+	cl_ulong localMem = device->localMemSize() > kernelLocalMem + pairBytes ? device->localMemSize() - kernelLocalMem - pairBytes : 0;
+	if (localMem / (2 * pairBytes) < limit)
+		limit = (size_t) (localMem / (2 * pairBytes));
+	if (limit == 0) {
+		_ciErrNum = CL_OUT_OF_RESOURCES;
+		return;
+	}
+	_localSize = floorPow2(limit);
+	// a few groups per compute unit, one group scans their totals
+	_maxGroups = device->numComputeUnits() > 0 ? device->numComputeUnits() * 4 : 1;
+	if (_maxGroups > 2 * _localSize)
+		_maxGroups = 2 * _localSize;
+	_sumValues = new CLMem(ctx, CL_MEM_READ_WRITE, _maxGroups * elementSize);
+	_sumHeads = new CLMem(ctx, CL_MEM_READ_WRITE, _maxGroups * sizeof(cl_uint));
+	if ((_ciErrNum = _sumValues->ciErrNum()) == CL_SUCCESS)
+		_ciErrNum = _sumHeads->ciErrNum();
+}
+
+CLScanBase::~CLScanBase() {
+	delete _sumHeads;
+	delete _sumValues;
+	delete _scanKernel;
+	delete _sumsKernel;
+	delete _reduceKernel;
+}
+
+CLCommandQueue* CLScanBase::enqueueScan(CLCommandQueue *queue, CLMem *in, CLMem *segments, CLMem *out, size_t count, bool inclusive,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_sumValues == NULL || _sumHeads == NULL || count == 0)
+		return queue;
+	size_t tile = 2 * _localSize;
+	// the kernels index with uint
+	if (count > 0xffffffffu - tile) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	if ((segments == NULL) != (_segments == NONE)) {
+		_ciErrNum = CL_INVALID_KERNEL_ARGS;
+		return queue;
+	}
+	// whole tiles per chunk, at most _maxGroups chunks
+	size_t groups = (count + tile - 1) / tile;
+	if (groups > _maxGroups)
+		groups = _maxGroups;
+	size_t chunk = ((count + groups - 1) / groups + tile - 1) / tile * tile;
+	groups = (count + chunk - 1) / chunk;
+
+	cl_uint n = (cl_uint) count, chunkSize = (cl_uint) chunk, numSums = (cl_uint) groups, isInclusive = inclusive ? 1 : 0;
+	CLLocalMem tileMem((tile + 1) * 2 * _elementSize);
+	CLNDRange global(groups * _localSize), local(_localSize);
+	CLKernelArg args[9];
+	cl_uint numArgs = 0;
+
+	CLEvent reduced, scanned;
+	args[numArgs++] = CLKernelArg::of(in);
+	if (segments != NULL)
+		args[numArgs++] = CLKernelArg::of(segments);
+	args[numArgs++] = CLKernelArg::of(n);
+	args[numArgs++] = CLKernelArg::of(chunkSize);
+	args[numArgs++] = CLKernelArg::of(_sumValues);
+	args[numArgs++] = CLKernelArg::of(_sumHeads);
+	args[numArgs++] = CLKernelArg::of(tileMem);
+	if ((_ciErrNum = queue->enqueueKernel(_reduceKernel, numArgs, args, global, local, numWaitEvents, waitList, &reduced)->ciErrNum()) != CL_SUCCESS)
+		return queue;
+
+	CLKernelArg sumsArgs[] = { CLKernelArg::of(_sumValues), CLKernelArg::of(_sumHeads), CLKernelArg::of(numSums), CLKernelArg::of(tileMem) };
+	if ((_ciErrNum = queue->enqueueKernel(_sumsKernel, 4, sumsArgs, local, local, 1, &reduced, &scanned)->ciErrNum()) != CL_SUCCESS)
+		return queue;
+
+	numArgs = 0;
+	args[numArgs++] = CLKernelArg::of(in);
+	if (segments != NULL)
+		args[numArgs++] = CLKernelArg::of(segments);
+	args[numArgs++] = CLKernelArg::of(n);
+	args[numArgs++] = CLKernelArg::of(chunkSize);
+	args[numArgs++] = CLKernelArg::of(_sumValues);
+	args[numArgs++] = CLKernelArg::of(_sumHeads);
+	args[numArgs++] = CLKernelArg::of(out);
+	args[numArgs++] = CLKernelArg::of(isInclusive);
+	args[numArgs++] = CLKernelArg::of(tileMem);
+	_ciErrNum = queue->enqueueKernel(_scanKernel, numArgs, args, global, local, 1, &scanned, event)->ciErrNum();
+	return queue;
+}
+
+// Radix sort pass on the digit (SORT_ORDER(key) >> shift) & 15. SORT_KEY (and SORT_VALUE) are the unsigned
+// integers of the key (and value) sizes, SORT_ORDER maps the key bits to an unsigned order. Each group
+// handles the chunk [group * chunk, min(n, (group + 1) * chunk)) in tiles of get_local_size(0) elements.
+static const char *g_sortSource = R"(
+#define SORT_RADIX_BITS 4
+#define SORT_RADIX 16
+
+uint sortDigit(SORT_KEY key, uint shift)
+{
+	return (uint) ((SORT_ORDER(key) >> shift) & (SORT_RADIX - 1));
+}
+
+// Exclusive scan of the get_local_size(0) (a power of 2) counts of scan, their total in scan[get_local_size(0)]
+void sortScan(__local uint *scan)
+{
+	uint lid = get_local_id(0), n = get_local_size(0), offset = 1;
+	for (uint d = n >> 1; d > 0; d >>= 1) {
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d)
+			scan[offset * (2 * lid + 2) - 1] += scan[offset * (2 * lid + 1) - 1];
+		offset <<= 1;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (lid == 0) {
+		scan[n] = scan[n - 1];
+		scan[n - 1] = 0;
+	}
+	for (uint d = 1; d < n; d <<= 1) {
+		offset >>= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < d) {
+			uint ai = offset * (2 * lid + 1) - 1, bi = offset * (2 * lid + 2) - 1;
+			uint left = scan[ai];
+			scan[ai] = scan[bi];
+			scan[bi] += left;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Digit counts of each chunk, digit major: histogram[digit * get_num_groups(0) + group]
+__kernel void SortHistogram(__global const SORT_KEY *keys, uint n, uint chunk, uint shift, __global uint *histogram, __local uint *counts)
+{
+	uint lid = get_local_id(0), group = get_group_id(0);
+	uint begin = group * chunk, end = min(n, begin + chunk);
+	for (uint d = lid; d < SORT_RADIX; d += get_local_size(0))
+		counts[d] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint i = begin + lid; i < end; i += get_local_size(0))
+		atomic_inc(&counts[sortDigit(keys[i], shift)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint d = lid; d < SORT_RADIX; d += get_local_size(0))
+		histogram[d * get_num_groups(0) + group] = counts[d];
+}
+
+// Moves each chunk's elements to their sorted position, from the scanned histogram. digitInfo holds the
+// tile's digit starts, the chunk's next output offset per digit and the tile's digit counts.
+__kernel void SortScatter(__global const SORT_KEY *keysIn, __global SORT_KEY *keysOut SORT_VALUE_ARGS, uint n, uint chunk, uint shift,
+	__global const uint *offsets, __local SORT_KEY *localKeys SORT_LOCAL_VALUE_ARG, __local uint *localDigits, __local uint *scan,
+	__local uint *digitInfo)
+{
+	uint lid = get_local_id(0), size = get_local_size(0), group = get_group_id(0);
+	__local uint *digitStart = digitInfo, *groupOffset = digitInfo + SORT_RADIX, *tileCounts = digitInfo + 2 * SORT_RADIX;
+	uint begin = group * chunk, end = min(n, begin + chunk);
+	for (uint d = lid; d < SORT_RADIX; d += size) {
+		groupOffset[d] = offsets[d * get_num_groups(0) + group];
+		tileCounts[d] = 0;
+	}
+	for (uint base = begin; base < end; base += size) {
+		uint i = base + lid;
+		uint valid = min(size, end - base);
+		// the padding work items sort after the valid ones, whatever digit they get
+		SORT_KEY key = 0;
+		uint digit = SORT_RADIX - 1;
+#ifdef SORT_VALUE
+		SORT_VALUE value = 0;
+#endif
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (i < end) {
+			key = keysIn[i];
+			digit = sortDigit(key, shift);
+#ifdef SORT_VALUE
+			value = valuesIn[i];
+#endif
+			atomic_inc(&tileCounts[digit]);
+		}
+		// stable split of the tile on each bit of the digit, lowest first
+		for (uint bit = 0; bit < SORT_RADIX_BITS; bit++) {
+			uint b = (digit >> bit) & 1;
+			scan[lid] = 1 - b;
+			sortScan(scan);
+			uint pos = b ? scan[size] + lid - scan[lid] : scan[lid];
+			localKeys[pos] = key;
+			localDigits[pos] = digit;
+#ifdef SORT_VALUE
+			localValues[pos] = value;
+#endif
+			barrier(CLK_LOCAL_MEM_FENCE);
+			key = localKeys[lid];
+			digit = localDigits[lid];
+#ifdef SORT_VALUE
+			value = localValues[lid];
+#endif
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		if (lid == 0 || localDigits[lid - 1] != digit)
+			digitStart[digit] = lid;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < valid) {
+			uint dst = groupOffset[digit] + lid - digitStart[digit];
+			keysOut[dst] = key;
+#ifdef SORT_VALUE
+			valuesOut[dst] = value;
+#endif
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint d = lid; d < SORT_RADIX; d += size) {
+			groupOffset[d] += tileCounts[d];
+			tileCounts[d] = 0;
+		}
+	}
+}
+)";
+
+CLRadixSortBase::CLRadixSortBase(CLContext *ctx, const CLDevice *device, size_t keySize, bool keyIsFloat, bool keyIsSigned, size_t valueSize)
+	: _ctx(ctx), _device(device), _histogramKernel(NULL), _scatterKernel(NULL), _scan(NULL), _histogram(NULL), _tempKeys(NULL), _tempValues(NULL),
+	_tempCount(0), _keySize(keySize), _keyIsFloat(keyIsFloat), _keyIsSigned(keyIsSigned), _valueSize(valueSize), _localSize(0), _maxGroups(0),
+	_hostThreshold(CLSORT_HOST_THRESHOLD) {
+	const char *keyType = keySize == 8 ? "ulong" : "uint";
+	std::string source = std::string("#define SORT_KEY ") + keyType + "\n"
+		+ "#define SORT_SIGN (" + (keySize == 8 ? "0x8000000000000000ul" : "0x80000000u") + ")\n";
+	if (keyIsFloat)
+		source += "#define SORT_ORDER(k) (((k) & SORT_SIGN) ? ~(k) : (k) | SORT_SIGN)\n";
+	else if (keyIsSigned)
+		source += "#define SORT_ORDER(k) ((k) ^ SORT_SIGN)\n";
+	else
+		source += "#define SORT_ORDER(k) (k)\n";
+	if (valueSize > 0)
+		source += std::string("#define SORT_VALUE ") + (valueSize == 8 ? "ulong" : "uint") + "\n"
+			+ "#define SORT_VALUE_ARGS , __global const SORT_VALUE *valuesIn, __global SORT_VALUE *valuesOut\n"
+			+ "#define SORT_LOCAL_VALUE_ARG , __local SORT_VALUE *localValues\n";
+	else
+		source += "#define SORT_VALUE_ARGS\n#define SORT_LOCAL_VALUE_ARG\n";
+	source += g_sortSource;
+	CLProgram *program = primitiveProgram(ctx, source, &_ciErrNum);
+	if (program == NULL)
+		return;
+	_histogramKernel = new CLKernel(program, "SortHistogram");
+	_scatterKernel = new CLKernel(program, "SortScatter");
+	if ((_ciErrNum = _histogramKernel->ciErrNum()) != CL_SUCCESS || (_ciErrNum = _scatterKernel->ciErrNum()) != CL_SUCCESS)
+		return;
+
+	// Power of 2 work group within the kernels' and device's limits and the local memory of the scatter
+	// (key, value, digit and scan count per work item), at most CLLAUNCH_TARGET_GROUP_SIZE
+	size_t limit = CLLAUNCH_TARGET_GROUP_SIZE;
+	if (device->maxWorkGroupSize() < limit)
+		limit = device->maxWorkGroupSize();
+	CLKernel *kernels[] = { _histogramKernel, _scatterKernel };
+	cl_ulong kernelLocalMem = 0;
+	for (int k = 0; k < 2; k++) {
+		CLLaunchConfig config(kernels[k], device, CLNDRange(1));
+		if ((_ciErrNum = config.ciErrNum()) != CL_SUCCESS)
+			return;
+		if (config.kernelWorkGroupSize() < limit)
+			limit = config.kernelWorkGroupSize();
+		if (config.kernelLocalMemSize() > kernelLocalMem)
+			kernelLocalMem = config.kernelLocalMemSize();
+	}
+	size_t itemBytes = keySize + valueSize + 2 * sizeof(cl_uint);
+	size_t fixedBytes = (1 + 3 * 16) * sizeof(cl_uint);
+	cl_ulong localMem = device->localMemSize() > kernelLocalMem + fixedBytes ? device->localMemSize() - kernelLocalMem - fixedBytes : 0;
+	if (localMem / itemBytes < limit)
+		limit = (size_t) (localMem / itemBytes);
+	if (limit == 0) {
+		_ciErrNum = CL_OUT_OF_RESOURCES;
+		return;
+	}
+	_localSize = floorPow2(limit);
+	_maxGroups = device->numComputeUnits() > 0 ? device->numComputeUnits() * 4 : 1;
+	_histogram = new CLBuffer<unsigned int>(ctx, CL_MEM_READ_WRITE, 16 * _maxGroups);
+	if ((_ciErrNum = _histogram->ciErrNum()) != CL_SUCCESS)
+		return;
+	_scan = new CLScan<unsigned int>(ctx, device);
+	_ciErrNum = _scan->ciErrNum();
+}
+
+CLRadixSortBase::~CLRadixSortBase() {
+	delete _tempValues;
+	delete _tempKeys;
+	delete _scan;
+	delete _histogram;
+	delete _scatterKernel;
+	delete _histogramKernel;
+}
+
+CLCommandQueue* CLRadixSortBase::hostSort(CLCommandQueue *queue, CLMem *keys, CLMem *values, size_t count,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	std::vector<unsigned char> keyBytes(count * _keySize), valueBytes(values != NULL ? count * _valueSize : 0);
+	if ((_ciErrNum = queue->enqueueReadBuffer(keys, true, 0, keyBytes.size(), &keyBytes[0], numWaitEvents, waitList)->ciErrNum()) != CL_SUCCESS
+		|| (values != NULL && (_ciErrNum = queue->enqueueReadBuffer(values, true, 0, valueBytes.size(), &valueBytes[0])->ciErrNum()) != CL_SUCCESS))
+		return queue;
+	// same unsigned order as the device: signed keys have their sign bit flipped, negative floats all their bits
+	cl_ulong sign = (cl_ulong) 1 << (8 * _keySize - 1);
+	cl_ulong mask = _keySize == 8 ? ~(cl_ulong) 0 : 0xffffffffull;
+	std::vector<std::pair<unsigned long long, unsigned int> > order(count);
+	for (size_t i = 0; i < count; i++) {
+		cl_ulong bits = 0;
+		if (_keySize == 8)
+			memcpy(&bits, &keyBytes[i * 8], 8);
+		else {
+			cl_uint bits32;
+			memcpy(&bits32, &keyBytes[i * 4], 4);
+			bits = bits32;
+		}
+		if (_keyIsFloat)
+			bits = (bits & sign) ? ~bits & mask : bits | sign;
+		else if (_keyIsSigned)
+			bits ^= sign;
+		order[i] = std::make_pair((unsigned long long) bits, (unsigned int) i);
+	}
+	std::stable_sort(order.begin(), order.end(),
+		[](const std::pair<unsigned long long, unsigned int> &a, const std::pair<unsigned long long, unsigned int> &b) { return a.first < b.first; });
+	std::vector<unsigned char> sortedKeys(keyBytes.size()), sortedValues(valueBytes.size());
+	for (size_t i = 0; i < count; i++) {
+		memcpy(&sortedKeys[i * _keySize], &keyBytes[order[i].second * _keySize], _keySize);
+		if (values != NULL)
+			memcpy(&sortedValues[i * _valueSize], &valueBytes[order[i].second * _valueSize], _valueSize);
+	}
+	if (values != NULL && (_ciErrNum = queue->enqueueWriteBuffer(values, true, 0, sortedValues.size(), &sortedValues[0])->ciErrNum()) != CL_SUCCESS)
+		return queue;
+	_ciErrNum = queue->enqueueWriteBuffer(keys, true, 0, sortedKeys.size(), &sortedKeys[0], 0, NULL, event)->ciErrNum();
+	return queue;
+}
+
+CLCommandQueue* CLRadixSortBase::enqueueSort(CLCommandQueue *queue, CLMem *keys, CLMem *values, size_t count,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_scan == NULL || _scan->ciErrNum() != CL_SUCCESS || count < 2)
+		return queue;
+	if ((values != NULL) != (_valueSize > 0)) {
+		_ciErrNum = CL_INVALID_MEM_OBJECT;
+		return queue;
+	}
+	if (count < _hostThreshold)
+		return hostSort(queue, keys, values, count, numWaitEvents, waitList, event);
+	// the kernels index with uint
+	if (count > 0xffffffffu - _localSize) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	if (count > _tempCount) {
+		delete _tempKeys;
+		delete _tempValues;
+		_tempValues = NULL;
+		_tempCount = 0;
+		_tempKeys = new CLMem(_ctx, CL_MEM_READ_WRITE, count * _keySize);
+		if ((_ciErrNum = _tempKeys->ciErrNum()) != CL_SUCCESS)
+			return queue;
+		if (_valueSize > 0) {
+			_tempValues = new CLMem(_ctx, CL_MEM_READ_WRITE, count * _valueSize);
+			if ((_ciErrNum = _tempValues->ciErrNum()) != CL_SUCCESS)
+				return queue;
+		}
+		_tempCount = count;
+	}
+	// whole tiles per chunk, at most _maxGroups chunks
+	size_t groups = (count + _localSize - 1) / _localSize;
+	if (groups > _maxGroups)
+		groups = _maxGroups;
+	size_t chunk = ((count + groups - 1) / groups + _localSize - 1) / _localSize * _localSize;
+	groups = (count + chunk - 1) / chunk;
+
+	cl_uint n = (cl_uint) count, chunkSize = (cl_uint) chunk;
+	CLNDRange global(groups * _localSize), local(_localSize);
+	CLLocalMem counts(16 * sizeof(cl_uint)), localKeys(_localSize * _keySize), localValues(_localSize * _valueSize),
+		localDigits(_localSize * sizeof(cl_uint)), scan((_localSize + 1) * sizeof(cl_uint)), digitInfo(3 * 16 * sizeof(cl_uint));
+	CLMem *srcKeys = keys, *dstKeys = _tempKeys, *srcValues = values, *dstValues = _tempValues;
+	// each launch waits for the previous one, the first for the caller's events; an even number of passes
+	// leaves the result in keys and values
+	CLEvent previous;
+	cl_uint numWait = numWaitEvents;
+	const CLEvent *wait = waitList;
+	cl_uint passes = (cl_uint) (8 * _keySize / 4);
+	for (cl_uint pass = 0; pass < passes; pass++) {
+		cl_uint shift = 4 * pass;
+		CLEvent counted, scanned, scattered;
+		CLKernelArg histogramArgs[] = { CLKernelArg::of(srcKeys), CLKernelArg::of(n), CLKernelArg::of(chunkSize), CLKernelArg::of(shift),
+			CLKernelArg::of(_histogram), CLKernelArg::of(counts) };
+		if ((_ciErrNum = queue->enqueueKernel(_histogramKernel, 6, histogramArgs, global, local, numWait, wait, &counted)->ciErrNum()) != CL_SUCCESS)
+			return queue;
+		if ((_ciErrNum = _scan->exclusive(queue, _histogram, _histogram, 16 * groups, 1, &counted, &scanned)->ciErrNum()) != CL_SUCCESS
+			|| (_ciErrNum = _scan->ciErrNum()) != CL_SUCCESS)
+			return queue;
+		CLKernelArg scatterArgs[14];
+		cl_uint numArgs = 0;
+		scatterArgs[numArgs++] = CLKernelArg::of(srcKeys);
+		scatterArgs[numArgs++] = CLKernelArg::of(dstKeys);
+		if (values != NULL) {
+			scatterArgs[numArgs++] = CLKernelArg::of(srcValues);
+			scatterArgs[numArgs++] = CLKernelArg::of(dstValues);
+		}
+		scatterArgs[numArgs++] = CLKernelArg::of(n);
+		scatterArgs[numArgs++] = CLKernelArg::of(chunkSize);
+		scatterArgs[numArgs++] = CLKernelArg::of(shift);
+		scatterArgs[numArgs++] = CLKernelArg::of(_histogram);
+		scatterArgs[numArgs++] = CLKernelArg::of(localKeys);
+		if (values != NULL)
+			scatterArgs[numArgs++] = CLKernelArg::of(localValues);
+		scatterArgs[numArgs++] = CLKernelArg::of(localDigits);
+		scatterArgs[numArgs++] = CLKernelArg::of(scan);
+		scatterArgs[numArgs++] = CLKernelArg::of(digitInfo);
+		if ((_ciErrNum = queue->enqueueKernel(_scatterKernel, numArgs, scatterArgs, global, local, 1, &scanned,
+				pass + 1 == passes ? event : &scattered)->ciErrNum()) != CL_SUCCESS)
+			return queue;
+		previous = scattered;
+		numWait = 1;
+		wait = &previous;
+		std::swap(srcKeys, dstKeys);
+		std::swap(srcValues, dstValues);
+	}
+	return queue;
+}
+
+// Row major C = alpha op(A) op(B) + beta C. A work group of GEMM_LX x GEMM_LY work items computes the
+// GEMM_TM x GEMM_TN tile of C at (group y, group x), each work item GEMM_RM x GEMM_RN elements strided by
+// the work group size (rows ty + i * GEMM_LY, columns tx + j * GEMM_LX), from GEMM_TK wide slices of op(A)
+// and op(B) in local memory. The slices are stored k major with a padding element against bank conflicts.
+static const char *g_gemmSource = R"(
+#define GEMM_LX (GEMM_TN / GEMM_RN)
+#define GEMM_LY (GEMM_TM / GEMM_RM)
+#define GEMM_TMP (GEMM_TM + 1)
+#define GEMM_TNP (GEMM_TN + 1)
+
+// transA and transB are constants of the kernels, the compiler specializes the loads once inlined
+void gemmTile(uint transA, uint transB, uint M, uint N, uint K, CLPP_T alpha, __global const CLPP_T *A, uint lda,
+	__global const CLPP_T *B, uint ldb, CLPP_T beta, __global CLPP_T *C, uint ldc, __local CLPP_T *tileA, __local CLPP_T *tileB)
+{
+	uint tx = get_local_id(0), ty = get_local_id(1), lid = ty * GEMM_LX + tx;
+	uint row0 = get_group_id(1) * GEMM_TM, col0 = get_group_id(0) * GEMM_TN;
+	CLPP_T acc[GEMM_RM][GEMM_RN];
+	for (uint i = 0; i < GEMM_RM; i++)
+		for (uint j = 0; j < GEMM_RN; j++)
+			acc[i][j] = 0;
+	for (uint k0 = 0; k0 < K; k0 += GEMM_TK) {
+		// tileA[k][m] = op(A)[row0 + m][k0 + k] and tileB[k][n] = op(B)[k0 + k][col0 + n], read along the
+		// contiguous dimension of A and B, 0 past the edges
+		for (uint e = lid; e < GEMM_TM * GEMM_TK; e += GEMM_LX * GEMM_LY) {
+			uint m = transA ? e % GEMM_TM : e / GEMM_TK;
+			uint k = transA ? e / GEMM_TM : e % GEMM_TK;
+			uint row = row0 + m, kk = k0 + k;
+			tileA[k * GEMM_TMP + m] = row < M && kk < K ? A[transA ? kk * lda + row : row * lda + kk] : 0;
+		}
+		for (uint e = lid; e < GEMM_TK * GEMM_TN; e += GEMM_LX * GEMM_LY) {
+			uint n = transB ? e / GEMM_TK : e % GEMM_TN;
+			uint k = transB ? e % GEMM_TK : e / GEMM_TN;
+			uint col = col0 + n, kk = k0 + k;
+			tileB[k * GEMM_TNP + n] = col < N && kk < K ? B[transB ? col * ldb + kk : kk * ldb + col] : 0;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint k = 0; k < GEMM_TK; k++) {
+			CLPP_T a[GEMM_RM], b[GEMM_RN];
+			for (uint i = 0; i < GEMM_RM; i++)
+				a[i] = tileA[k * GEMM_TMP + ty + i * GEMM_LY];
+			for (uint j = 0; j < GEMM_RN; j++)
+				b[j] = tileB[k * GEMM_TNP + tx + j * GEMM_LX];
+			for (uint i = 0; i < GEMM_RM; i++)
+				for (uint j = 0; j < GEMM_RN; j++)
+					acc[i][j] += a[i] * b[j];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	for (uint i = 0; i < GEMM_RM; i++) {
+		uint row = row0 + ty + i * GEMM_LY;
+		for (uint j = 0; j < GEMM_RN; j++) {
+			uint col = col0 + tx + j * GEMM_LX;
+			if (row < M && col < N) {
+				__global CLPP_T *c = C + row * ldc + col;
+				*c = beta == 0 ? alpha * acc[i][j] : alpha * acc[i][j] + beta * *c;
+			}
+		}
+	}
+}
+
+#define GEMM_KERNEL(name, transA, transB) \
+__kernel void name(uint M, uint N, uint K, CLPP_T alpha, __global const CLPP_T *A, uint lda, __global const CLPP_T *B, uint ldb, \
+	CLPP_T beta, __global CLPP_T *C, uint ldc) \
+{ \
+	__local CLPP_T tileA[GEMM_TK * GEMM_TMP]; \
+	__local CLPP_T tileB[GEMM_TK * GEMM_TNP]; \
+	gemmTile(transA, transB, M, N, K, alpha, A, lda, B, ldb, beta, C, ldc, tileA, tileB); \
+}
+
+GEMM_KERNEL(GemmNN, 0, 0)
+GEMM_KERNEL(GemmNT, 0, 1)
+GEMM_KERNEL(GemmTN, 1, 0)
+GEMM_KERNEL(GemmTT, 1, 1)
+)";
+
+// Row major y = alpha A x + beta y (GemvRows, a work group per row of A: a strided dot product, then a tree
+// in local memory) and y = alpha A^T x + beta y (GemvColumns, a work item per column of A, x staged in local
+// memory a work group size tile at a time). A has rows x cols elements.
+static const char *g_gemvSource = R"(
+__kernel void GemvRows(uint rows, uint cols, CLPP_T alpha, __global const CLPP_T *A, uint lda, __global const CLPP_T *x,
+	CLPP_T beta, __global CLPP_T *y, __local CLPP_T *scratch)
+{
+	uint lid = get_local_id(0);
+	for (uint row = get_group_id(0); row < rows; row += get_num_groups(0)) {
+		__global const CLPP_T *a = A + row * lda;
+		CLPP_T acc = 0;
+		for (uint j = lid; j < cols; j += get_local_size(0))
+			acc += a[j] * x[j];
+		scratch[lid] = acc;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint s = get_local_size(0) >> 1; s > 0; s >>= 1) {
+			if (lid < s)
+				scratch[lid] += scratch[lid + s];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		if (lid == 0)
+			y[row] = beta == 0 ? alpha * scratch[0] : alpha * scratch[0] + beta * y[row];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+__kernel void GemvColumns(uint rows, uint cols, CLPP_T alpha, __global const CLPP_T *A, uint lda, __global const CLPP_T *x,
+	CLPP_T beta, __global CLPP_T *y, __local CLPP_T *xTile)
+{
+	uint lid = get_local_id(0), col = get_global_id(0), size = get_local_size(0);
+	CLPP_T acc = 0;
+	for (uint i0 = 0; i0 < rows; i0 += size) {
+		uint tile = min(size, rows - i0);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid < tile)
+			xTile[lid] = x[i0 + lid];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (col < cols) {
+			__global const CLPP_T *a = A + i0 * lda + col;
+			for (uint i = 0; i < tile; i++)
+				acc += a[i * lda] * xTile[i];
+		}
+	}
+	if (col < cols)
+		y[col] = beta == 0 ? alpha * acc : alpha * acc + beta * y[col];
+}
+)";
+
+// Tile of C of the gemm tilings, largest first, all with 4 x 4 elements per work item: work groups of
+// 256, 128, 64, 32, 16, 4 and 1 work items
+struct CLGemmTiling {
+	size_t rows;
+	size_t columns;
+	size_t depth;
+};
+
+#define CLGEMM_REGISTER_BLOCK 4
+
+static const CLGemmTiling g_gemmTilings[CLGEMM_NUM_TILINGS] = {
+	{ 64, 64, 16 }, { 64, 32, 16 }, { 32, 32, 16 }, { 32, 16, 16 }, { 16, 16, 16 }, { 8, 8, 8 }, { 4, 4, 4 }
+};
+
+static const char *g_gemmKernelNames[4] = { "GemmNN", "GemmNT", "GemmTN", "GemmTT" };
+
+static CLNDRange gemmLocal(const CLGemmTiling &tiling) {
+	return CLNDRange(tiling.columns / CLGEMM_REGISTER_BLOCK, tiling.rows / CLGEMM_REGISTER_BLOCK);
+}
+
+// A rows x cols matrix of elementSize elements, ld apart, fits in mem and the kernels' uint indices
+static bool matrixFits(const CLMem *mem, size_t rows, size_t cols, size_t ld, size_t elementSize) {
+	if (rows == 0 || cols == 0)
+		return true;
+	if (ld < cols || rows > 0xffffffffu / ld)
+		return false;
+	return ((rows - 1) * ld + cols) * elementSize <= mem->size();
+}
+
+CLMatrixMultiplyBase::CLMatrixMultiplyBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize)
+	: _ctx(ctx), _device(device), _typeName(typeName), _isDouble(isDouble), _gemvRowsKernel(NULL), _gemvColumnsKernel(NULL),
+	_gemvLocalSize(0), _elementSize(elementSize) {
+	for (int t = 0; t < CLGEMM_NUM_TILINGS; t++) {
+		_gemmUnusable[t] = false;
+		for (int v = 0; v < 4; v++)
+			_gemmKernels[t][v] = NULL;
+	}
+	if (isDouble && device->nativeDoubleSupport() == 0) {
+		_ciErrNum = CL_INVALID_DEVICE;
+		return;
+	}
+	CLProgram *program = primitiveProgram(ctx, primitivePreamble(typeName, isDouble) + g_gemvSource, &_ciErrNum);
+	if (program == NULL)
+		return;
+	_gemvRowsKernel = new CLKernel(program, "GemvRows");
+	_gemvColumnsKernel = new CLKernel(program, "GemvColumns");
+	if ((_ciErrNum = _gemvRowsKernel->ciErrNum()) != CL_SUCCESS || (_ciErrNum = _gemvColumnsKernel->ciErrNum()) != CL_SUCCESS)
+		return;
+	// one local size for both, a power of 2 for the tree, with an element of local memory per work item
+	CLLaunchConfig rows(_gemvRowsKernel, device, CLNDRange(1 << 20), elementSize);
+	CLLaunchConfig columns(_gemvColumnsKernel, device, CLNDRange(1 << 20), elementSize);
+	if ((_ciErrNum = rows.ciErrNum()) != CL_SUCCESS || (_ciErrNum = columns.ciErrNum()) != CL_SUCCESS)
+		return;
+	_gemvLocalSize = floorPow2(rows.local()[0] < columns.local()[0] ? rows.local()[0] : columns.local()[0]);
+}
+
+CLMatrixMultiplyBase::~CLMatrixMultiplyBase() {
+	for (int t = 0; t < CLGEMM_NUM_TILINGS; t++) {
+		for (int v = 0; v < 4; v++)
+			delete _gemmKernels[t][v];
+	}
+	delete _gemvColumnsKernel;
+	delete _gemvRowsKernel;
+}
+
+CLKernel *CLMatrixMultiplyBase::gemmKernel(int tiling, int variant) {
+	if (_gemmKernels[tiling][variant] != NULL || _gemmUnusable[tiling] || _gemvRowsKernel == NULL)
+		return _gemmKernels[tiling][variant];
+	// the device limits first, then the kernels' once built (registers, local memory)
+	const CLGemmTiling &t = g_gemmTilings[tiling];
+	CLNDRange local = gemmLocal(t);
+	cl_ulong localMem = (cl_ulong) t.depth * (t.rows + 1 + t.columns + 1) * _elementSize;
+	_gemmUnusable[tiling] = local.total() > _device->maxWorkGroupSize() || local[0] > _device->maxWorkItemSizes()[0]
+		|| local[1] > _device->maxWorkItemSizes()[1] || localMem > _device->localMemSize();
+	if (_gemmUnusable[tiling])
+		return NULL;
+	char defines[128];
+	snprintf(defines, sizeof(defines), "#define GEMM_TM %u\n#define GEMM_TN %u\n#define GEMM_TK %u\n#define GEMM_RM %d\n#define GEMM_RN %d\n",
+		(unsigned) t.rows, (unsigned) t.columns, (unsigned) t.depth, CLGEMM_REGISTER_BLOCK, CLGEMM_REGISTER_BLOCK);
+	cl_int ciErrNum;
+	CLProgram *program = primitiveProgram(_ctx, primitivePreamble(_typeName, _isDouble) + defines + g_gemmSource, &ciErrNum);
+	for (int v = 0; program != NULL && v < 4 && !_gemmUnusable[tiling]; v++) {
+		CLKernel *kernel = new CLKernel(program, g_gemmKernelNames[v]);
+		CLLaunchConfig config(kernel, _device, CLNDRange(1));
+		if (kernel->ciErrNum() != CL_SUCCESS || config.ciErrNum() != CL_SUCCESS || config.kernelWorkGroupSize() < local.total()
+			|| config.kernelLocalMemSize() > _device->localMemSize()) {
+			delete kernel;
+			_gemmUnusable[tiling] = true;
+		}
+		else
+			_gemmKernels[tiling][v] = kernel;
+	}
+	if (program == NULL || _gemmUnusable[tiling]) {
+		_gemmUnusable[tiling] = true;
+		for (int v = 0; v < 4; v++) {
+			delete _gemmKernels[tiling][v];
+			_gemmKernels[tiling][v] = NULL;
+		}
+	}
+	return _gemmKernels[tiling][variant];
+}
+
+int CLMatrixMultiplyBase::selectTiling(size_t rows, size_t columns) {
+	// the tuning database entries are keyed by the largest tiling the device runs
+	int largest = 0;
+	while (largest < CLGEMM_NUM_TILINGS && gemmKernel(largest, 0) == NULL)
+		largest++;
+	if (largest == CLGEMM_NUM_TILINGS)
+		return -1;
+	size_t tuned = CLAutotuner::localSize(_gemmKernels[largest][0], _device, rows * columns);
+	for (int t = largest; tuned > 0 && t < CLGEMM_NUM_TILINGS; t++) {
+		if (gemmLocal(g_gemmTilings[t]).total() == tuned && gemmKernel(t, 0) != NULL)
+			return t;
+	}
+	int selected = largest;
+	for (int t = largest; t < CLGEMM_NUM_TILINGS; t++) {
+		if (gemmKernel(t, 0) == NULL)
+			continue;
+		selected = t;
+		size_t tiles = ((rows + g_gemmTilings[t].rows - 1) / g_gemmTilings[t].rows) * ((columns + g_gemmTilings[t].columns - 1) / g_gemmTilings[t].columns);
+		if (tiles >= _device->numComputeUnits())
+			break;
+	}
+	return selected;
+}
+
+void CLMatrixMultiplyBase::tileSize(size_t M, size_t N, size_t *rows, size_t *columns) {
+	int tiling = selectTiling(M, N);
+	*rows = tiling >= 0 ? g_gemmTilings[tiling].rows : 0;
+	*columns = tiling >= 0 ? g_gemmTilings[tiling].columns : 0;
+}
+
+CLCommandQueue* CLMatrixMultiplyBase::enqueueGemm(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose transA, CLTranspose transB,
+					   size_t M, size_t N, size_t K, const void *alpha, CLMem *A, size_t lda, CLMem *B, size_t ldb,
+					   const void *beta, CLMem *C, size_t ldc, cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_gemvRowsKernel == NULL || M == 0 || N == 0)
+		return queue;
+	// column major C = op(A) op(B) is row major C^T = op(B)^T op(A)^T, with the same buffers
+	if (order == CLColumnMajor) {
+		std::swap(M, N);
+		std::swap(A, B);
+		std::swap(lda, ldb);
+		std::swap(transA, transB);
+	}
+	if (!matrixFits(A, transA == CLTrans ? K : M, transA == CLTrans ? M : K, lda, _elementSize)
+		|| !matrixFits(B, transB == CLTrans ? N : K, transB == CLTrans ? K : N, ldb, _elementSize)
+		|| !matrixFits(C, M, N, ldc, _elementSize) || K > 0xffffffffu) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	int tiling = selectTiling(M, N);
+	if (tiling < 0) {
+		_ciErrNum = CL_OUT_OF_RESOURCES;
+		return queue;
+	}
+	const CLGemmTiling &t = g_gemmTilings[tiling];
+	CLNDRange local = gemmLocal(t);
+	CLNDRange global((N + t.columns - 1) / t.columns * local[0], (M + t.rows - 1) / t.rows * local[1]);
+	cl_uint m = (cl_uint) M, n = (cl_uint) N, k = (cl_uint) K, a = (cl_uint) lda, b = (cl_uint) ldb, c = (cl_uint) ldc;
+	CLKernelArg alphaArg = { _elementSize, alpha, NULL, 0 }, betaArg = { _elementSize, beta, NULL, 0 };
+	CLKernelArg args[] = { CLKernelArg::of(m), CLKernelArg::of(n), CLKernelArg::of(k), alphaArg, CLKernelArg::of(A), CLKernelArg::of(a),
+		CLKernelArg::of(B), CLKernelArg::of(b), betaArg, CLKernelArg::of(C), CLKernelArg::of(c) };
+	CLKernel *kernel = gemmKernel(tiling, (transA == CLTrans ? 2 : 0) + (transB == CLTrans ? 1 : 0));
+	_ciErrNum = queue->enqueueKernel(kernel, 11, args, global, local, numWaitEvents, waitList, event)->ciErrNum();
+	return queue;
+}
+
+CLCommandQueue* CLMatrixMultiplyBase::enqueueGemv(CLCommandQueue *queue, CLMatrixOrder order, CLTranspose trans, size_t M, size_t N,
+					   const void *alpha, CLMem *A, size_t lda, CLMem *x, const void *beta, CLMem *y,
+					   cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_gemvRowsKernel == NULL || M == 0 || N == 0)
+		return queue;
+	// A as stored, row major: a dot product per row if op(A) keeps the rows, else an output per column
+	size_t rows = order == CLRowMajor ? M : N, cols = order == CLRowMajor ? N : M;
+	bool byRow = (order == CLRowMajor) == (trans == CLNoTrans);
+	size_t inputs = byRow ? cols : rows, outputs = byRow ? rows : cols;
+	if (!matrixFits(A, rows, cols, lda, _elementSize) || x->size() < inputs * _elementSize || y->size() < outputs * _elementSize) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	cl_uint r = (cl_uint) rows, c = (cl_uint) cols, a = (cl_uint) lda;
+	CLKernelArg alphaArg = { _elementSize, alpha, NULL, 0 }, betaArg = { _elementSize, beta, NULL, 0 };
+	CLLocalMem scratch(_gemvLocalSize * _elementSize);
+	CLKernelArg args[] = { CLKernelArg::of(r), CLKernelArg::of(c), alphaArg, CLKernelArg::of(A), CLKernelArg::of(a), CLKernelArg::of(x),
+		betaArg, CLKernelArg::of(y), CLKernelArg::of(scratch) };
+	// rows beyond a few groups per compute unit are looped over by the groups
+	size_t maxGroups = _device->numComputeUnits() > 0 ? _device->numComputeUnits() * 16 : 1;
+	size_t groups = byRow ? (rows < maxGroups ? rows : maxGroups) : (cols + _gemvLocalSize - 1) / _gemvLocalSize;
+	_ciErrNum = queue->enqueueKernel(byRow ? _gemvRowsKernel : _gemvColumnsKernel, 9, args, CLNDRange(groups * _gemvLocalSize),
+		CLNDRange(_gemvLocalSize), numWaitEvents, waitList, event)->ciErrNum();
+	return queue;
+}
+
+size_t CLMatrixMultiplyBase::tune(CLCommandQueue *queue, size_t M, size_t N, size_t K, cl_uint repetitions) {
+	int largest = 0;
+	while (largest < CLGEMM_NUM_TILINGS && gemmKernel(largest, 0) == NULL)
+		largest++;
+	if (largest == CLGEMM_NUM_TILINGS || M == 0 || N == 0 || K == 0 || M * K > 0xffffffffu || K * N > 0xffffffffu || M * N > 0xffffffffu)
+		return 0;
+	// zeroed operands: the timings do not depend on denormals or NaNs
+	std::vector<char> zeros(std::max(M * N, std::max(M * K, K * N)) * _elementSize, 0);
+	CLMem a(_ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, M * K * _elementSize, &zeros[0]);
+	CLMem b(_ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, K * N * _elementSize, &zeros[0]);
+	CLMem c(_ctx, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, M * N * _elementSize, &zeros[0]);
+	if (a.ciErrNum() != CL_SUCCESS || b.ciErrNum() != CL_SUCCESS || c.ciErrNum() != CL_SUCCESS)
+		return 0;
+	CLCommandQueue *timingQueue = queue;
+	if ((queue->properties() & CL_QUEUE_PROFILING_ENABLE) == 0) {
+		timingQueue = new CLCommandQueue(_ctx, _device, CL_QUEUE_PROFILING_ENABLE);
+		if (timingQueue->ciErrNum() != CL_SUCCESS) {
+			delete timingQueue;
+			return 0;
+		}
+	}
+	if (repetitions == 0)
+		repetitions = 1;
+
+	cl_float oneFloat = 1, zeroFloat = 0;
+	cl_double oneDouble = 1, zeroDouble = 0;
+	CLKernelArg alphaArg = { _elementSize, _isDouble ? (const void *) &oneDouble : &oneFloat, NULL, 0 };
+	CLKernelArg betaArg = { _elementSize, _isDouble ? (const void *) &zeroDouble : &zeroFloat, NULL, 0 };
+	cl_uint m = (cl_uint) M, n = (cl_uint) N, k = (cl_uint) K;
+	CLKernelArg args[] = { CLKernelArg::of(m), CLKernelArg::of(n), CLKernelArg::of(k), alphaArg, CLKernelArg::of(&a), CLKernelArg::of(k),
+		CLKernelArg::of(&b), CLKernelArg::of(n), betaArg, CLKernelArg::of(&c), CLKernelArg::of(n) };
+	size_t best = 0;
+	cl_ulong bestNs = 0;
+	for (int t = largest; t < CLGEMM_NUM_TILINGS; t++) {
+		CLKernel *kernel = gemmKernel(t, 0);
+		if (kernel == NULL)
+			continue;
+		CLNDRange local = gemmLocal(g_gemmTilings[t]);
+		CLNDRange global((N + g_gemmTilings[t].columns - 1) / g_gemmTilings[t].columns * local[0],
+			(M + g_gemmTilings[t].rows - 1) / g_gemmTilings[t].rows * local[1]);
+		// fastest run after a warm-up run
+		CLEvent ev;
+		cl_ulong ns = 0;
+		for (cl_uint r = 0; r <= repetitions; r++) {
+			if (timingQueue->enqueueKernel(kernel, 11, args, global, local, 0, NULL, &ev)->ciErrNum() != CL_SUCCESS || ev.wait() != CL_SUCCESS) {
+				ns = 0;
+				break;
+			}
+			cl_ulong elapsed = ev.elapsedNs();
+			if (r == 1 || (r > 1 && elapsed < ns))
+				ns = elapsed;
+		}
+		if (ns > 0 && (best == 0 || ns < bestNs)) {
+			best = local.total();
+			bestNs = ns;
+		}
+	}
+	if (timingQueue != queue)
+		delete timingQueue;
+
+	if (best != 0) {
+		CLAutotuner::record(_gemmKernels[largest][0], _device, M * N, best, bestNs);
+		CLAutotuner::save();
+	}
+	return best;
+}
+
+// a_i = A + i * strideA and b_i = B + i * strideB, strideB 0 for one b. DotUnrolled has a work item per
+// vector and the dimension DOT_D as a constant, so that the compiler unrolls the loop.
+static const char *g_batchedDotUnrolledSource = R"(
+__kernel void DotUnrolled(uint n, __global const CLPP_T *A, uint strideA, __global const CLPP_T *B, uint strideB, __global CLPP_T *out)
+{
+	uint i = get_global_id(0);
+	if (i >= n)
+		return;
+	__global const CLPP_T *a = A + i * strideA;
+	__global const CLPP_T *b = B + i * strideB;
+	CLPP_T acc = 0;
+	for (uint k = 0; k < DOT_D; k++)
+		acc += a[k] * b[k];
+	out[i] = acc;
+}
+)";
+
+// DotGroup: teams of lanes work items (a power of 2 dividing the work group size) per vector, a strided
+// loop then a tree in local memory. DotPartial: groupsPerVector work groups per vector, each the sum of
+// its interleaved work group size blocks of the vector into partials[group], which DotSumPartials adds.
+static const char *g_batchedDotSource = R"(
+__kernel void DotGroup(uint n, uint d, __global const CLPP_T *A, uint strideA, __global const CLPP_T *B, uint strideB,
+	__global CLPP_T *out, uint lanes, __local CLPP_T *scratch)
+{
+	uint lid = get_local_id(0), lane = lid % lanes, team = lid / lanes;
+	uint teams = get_local_size(0) / lanes;
+	for (uint first = get_group_id(0) * teams; first < n; first += get_num_groups(0) * teams) {
+		uint i = first + team;
+		CLPP_T acc = 0;
+		if (i < n) {
+			__global const CLPP_T *a = A + i * strideA;
+			__global const CLPP_T *b = B + i * strideB;
+			for (uint k = lane; k < d; k += lanes)
+				acc += a[k] * b[k];
+		}
+		scratch[lid] = acc;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (uint s = lanes >> 1; s > 0; s >>= 1) {
+			if (lane < s)
+				scratch[lid] += scratch[lid + s];
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+		if (lane == 0 && i < n)
+			out[i] = scratch[lid];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+__kernel void DotPartial(uint d, __global const CLPP_T *A, uint strideA, __global const CLPP_T *B, uint strideB,
+	__global CLPP_T *partials, uint groupsPerVector, __local CLPP_T *scratch)
+{
+	uint lid = get_local_id(0), size = get_local_size(0);
+	uint i = get_group_id(0) / groupsPerVector, part = get_group_id(0) % groupsPerVector;
+	__global const CLPP_T *a = A + i * strideA;
+	__global const CLPP_T *b = B + i * strideB;
+	CLPP_T acc = 0;
+	for (uint k = part * size + lid; k < d; k += groupsPerVector * size)
+		acc += a[k] * b[k];
+	scratch[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint s = size >> 1; s > 0; s >>= 1) {
+		if (lid < s)
+			scratch[lid] += scratch[lid + s];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		partials[get_group_id(0)] = scratch[0];
+}
+
+__kernel void DotSumPartials(uint n, __global const CLPP_T *partials, uint groupsPerVector, __global CLPP_T *out)
+{
+	uint i = get_global_id(0);
+	if (i >= n)
+		return;
+	CLPP_T acc = 0;
+	for (uint p = 0; p < groupsPerVector; p++)
+		acc += partials[i * groupsPerVector + p];
+	out[i] = acc;
+}
+)";
+
+// n vectors of d elements, stride apart, fit in mem and the kernels' uint indices
+static bool vectorsFit(const CLMem *mem, size_t n, size_t d, size_t stride, size_t elementSize) {
+	if (n > 1 && stride > (0xffffffffu - d) / (n - 1))
+		return false;
+	size_t end = (n - 1) * stride + d;
+	return end <= 0xffffffffu && end * elementSize <= mem->size();
+}
+
+CLBatchedDotBase::CLBatchedDotBase(CLContext *ctx, const CLDevice *device, const char *typeName, bool isDouble, size_t elementSize)
+	: _ctx(ctx), _device(device), _typeName(typeName), _isDouble(isDouble), _groupKernel(NULL), _partialKernel(NULL), _sumKernel(NULL),
+	_partials(NULL), _partialCount(0), _elementSize(elementSize), _localSize(0) {
+	for (int d = 0; d <= CLBATCHED_DOT_UNROLL_MAX; d++)
+		_unrolledKernels[d] = NULL;
+	if (isDouble && device->nativeDoubleSupport() == 0) {
+		_ciErrNum = CL_INVALID_DEVICE;
+		return;
+	}
+	CLProgram *program = primitiveProgram(ctx, primitivePreamble(typeName, isDouble) + g_batchedDotSource, &_ciErrNum);
+	if (program == NULL)
+		return;
+	_groupKernel = new CLKernel(program, "DotGroup");
+	_partialKernel = new CLKernel(program, "DotPartial");
+	_sumKernel = new CLKernel(program, "DotSumPartials");
+	if ((_ciErrNum = _groupKernel->ciErrNum()) != CL_SUCCESS || (_ciErrNum = _partialKernel->ciErrNum()) != CL_SUCCESS
+		|| (_ciErrNum = _sumKernel->ciErrNum()) != CL_SUCCESS)
+		return;
+	// one local size for both trees, a power of 2, with an element of local memory per work item
+	CLLaunchConfig group(_groupKernel, device, CLNDRange(1 << 20), elementSize);
+	CLLaunchConfig partial(_partialKernel, device, CLNDRange(1 << 20), elementSize);
+	if ((_ciErrNum = group.ciErrNum()) != CL_SUCCESS || (_ciErrNum = partial.ciErrNum()) != CL_SUCCESS)
+		return;
+	_localSize = floorPow2(group.local()[0] < partial.local()[0] ? group.local()[0] : partial.local()[0]);
+}
+
+CLBatchedDotBase::~CLBatchedDotBase() {
+	for (int d = 0; d <= CLBATCHED_DOT_UNROLL_MAX; d++)
+		delete _unrolledKernels[d];
+	delete _partials;
+	delete _sumKernel;
+	delete _partialKernel;
+	delete _groupKernel;
+}
+
+CLKernel *CLBatchedDotBase::unrolledKernel(size_t d) {
+	if (_unrolledKernels[d] != NULL)
+		return _unrolledKernels[d];
+	char define[32];
+	snprintf(define, sizeof(define), "#define DOT_D %u\n", (unsigned) d);
+	CLProgram *program = primitiveProgram(_ctx, primitivePreamble(_typeName, _isDouble) + define + g_batchedDotUnrolledSource, &_ciErrNum);
+	if (program == NULL)
+		return NULL;
+	CLKernel *kernel = new CLKernel(program, "DotUnrolled");
+	if ((_ciErrNum = kernel->ciErrNum()) != CL_SUCCESS) {
+		delete kernel;
+		return NULL;
+	}
+	_unrolledKernels[d] = kernel;
+	return kernel;
+}
+
+size_t CLBatchedDotBase::groupsPerVector(size_t n, size_t d) const {
+	// split vectors only while there are fewer than a few work groups per compute unit, and while every
+	// work item keeps at least 4 elements of its vector
+	if (_localSize == 0)
+		return 1;
+	size_t target = _device->numComputeUnits() > 0 ? _device->numComputeUnits() * 4 : 1;
+	size_t byWork = d / (4 * _localSize);
+	if (n >= target || byWork <= 1)
+		return 1;
+	size_t byOccupancy = (target + n - 1) / n;
+	return byWork < byOccupancy ? byWork : byOccupancy;
+}
+
+CLBatchedDotBase::Variant CLBatchedDotBase::variant(size_t n, size_t d) const {
+	if (d <= CLBATCHED_DOT_UNROLL_MAX)
+		return UNROLLED;
+	return groupsPerVector(n, d) > 1 ? MULTI_GROUP : GROUP_PER_VECTOR;
+}
+
+CLCommandQueue* CLBatchedDotBase::enqueueDot(CLCommandQueue *queue, size_t n, size_t d, CLMem *A, size_t strideA, CLMem *B, size_t strideB,
+					   CLMem *out, cl_uint numWaitEvents, const CLEvent *waitList, CLEvent *event) {
+	if (_groupKernel == NULL || _localSize == 0 || n == 0)
+		return queue;
+	if (!vectorsFit(A, n, d, strideA, _elementSize) || !vectorsFit(B, n, d, strideB, _elementSize) || out->size() < n * _elementSize) {
+		_ciErrNum = CL_INVALID_VALUE;
+		return queue;
+	}
+	cl_uint count = (cl_uint) n, dim = (cl_uint) d, a = (cl_uint) strideA, b = (cl_uint) strideB;
+	CLLocalMem scratch(_localSize * _elementSize);
+	switch (variant(n, d)) {
+	case UNROLLED: {
+		CLKernel *kernel = unrolledKernel(d);
+		if (kernel == NULL)
+			return queue;
+		CLNDRange local = _launchConfigs.local(kernel, _device, n);
+		CLKernelArg args[] = { CLKernelArg::of(count), CLKernelArg::of(A), CLKernelArg::of(a), CLKernelArg::of(B), CLKernelArg::of(b),
+			CLKernelArg::of(out) };
+		_ciErrNum = queue->enqueueKernel(kernel, 6, args, CLLaunchConfigCache::global(n, local), local, numWaitEvents, waitList, event)->ciErrNum();
+		break;
+	}
+	case GROUP_PER_VECTOR: {
+		// about 4 elements per lane, several vectors per work group when they are short
+		size_t lanes = floorPow2(d / 4 < _localSize ? d / 4 : _localSize);
+		size_t teams = _localSize / lanes;
+		size_t groups = (n + teams - 1) / teams;
+		size_t maxGroups = _device->numComputeUnits() > 0 ? _device->numComputeUnits() * 16 : 1;
+		if (groups > maxGroups)
+			groups = maxGroups;
+		cl_uint numLanes = (cl_uint) lanes;
+		CLKernelArg args[] = { CLKernelArg::of(count), CLKernelArg::of(dim), CLKernelArg::of(A), CLKernelArg::of(a), CLKernelArg::of(B),
+			CLKernelArg::of(b), CLKernelArg::of(out), CLKernelArg::of(numLanes), CLKernelArg::of(scratch) };
+		_ciErrNum = queue->enqueueKernel(_groupKernel, 9, args, CLNDRange(groups * _localSize), CLNDRange(_localSize),
+			numWaitEvents, waitList, event)->ciErrNum();
+		break;
+	}
+	case MULTI_GROUP: {
+		size_t parts = groupsPerVector(n, d);
+		if (n * parts > _partialCount) {
+			delete _partials;
+			_partialCount = 0;
+			_partials = new CLMem(_ctx, CL_MEM_READ_WRITE, n * parts * _elementSize);
+			if ((_ciErrNum = _partials->ciErrNum()) != CL_SUCCESS)
+				return queue;
+			_partialCount = n * parts;
+		}
+		cl_uint numParts = (cl_uint) parts;
+		CLEvent partialsDone;
+		CLKernelArg partialArgs[] = { CLKernelArg::of(dim), CLKernelArg::of(A), CLKernelArg::of(a), CLKernelArg::of(B), CLKernelArg::of(b),
+			CLKernelArg::of(_partials), CLKernelArg::of(numParts), CLKernelArg::of(scratch) };
+		if ((_ciErrNum = queue->enqueueKernel(_partialKernel, 8, partialArgs, CLNDRange(n * parts * _localSize), CLNDRange(_localSize),
+				numWaitEvents, waitList, &partialsDone)->ciErrNum()) != CL_SUCCESS)
+			return queue;
+		CLNDRange local = _launchConfigs.local(_sumKernel, _device, n);
+		CLKernelArg sumArgs[] = { CLKernelArg::of(count), CLKernelArg::of(_partials), CLKernelArg::of(numParts), CLKernelArg::of(out) };
+		_ciErrNum = queue->enqueueKernel(_sumKernel, 4, sumArgs, CLLaunchConfigCache::global(n, local), local, 1, &partialsDone, event)->ciErrNum();
+		break;
+	}
+	}
+	return queue;
+}
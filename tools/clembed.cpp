@@ -0,0 +1,104 @@
+/*
+ File: clembed.cpp
+ Embeds OpenCL C sources into a C++ file, with their #include "..." directives resolved, so that
+ the program needs no kernel file at run time. Each source is registered under its file name and
+ built with CLProgram(ctx, name). Angle bracket includes are left to the OpenCL compiler.
+ compilation:
+ Windows:
+ cl /EHsc clembed.cpp
+ Linux:
+ g++ -std=c++11 clembed.cpp -o clembed
+ usage:
+ clembed [-I dir]... -o out.cpp file.cl...
+ The generated file is compiled and linked with the program. From a static library, it must be
+ referenced (or linked as an object file) so that its registration runs.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "clexpand.h"
+
+// 64 bit FNV-1a, the hash function of the library
+static unsigned long long hash64(const std::string &s)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < s.size(); i++) {
+		hash ^= (unsigned char) s[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// One string literal per source line: short literals stay within the compilers' limits
+static void writeLiteral(FILE *fp, const std::string &s)
+{
+	fputs("\t\"", fp);
+	for (size_t i = 0; i < s.size(); i++) {
+		unsigned char c = (unsigned char) s[i];
+		if (c == '\n')
+			fputs(i + 1 < s.size() ? "\\n\"\n\t\"" : "\\n", fp);
+		else if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c == '?')
+			fputs("\\?", fp);  // no trigraphs
+		else if (c < 32 || c > 126)
+			fprintf(fp, "\\%03o", c);
+		else
+			fputc(c, fp);
+	}
+	fputs("\"", fp);
+}
+
+int main(int argc, char **argv)
+{
+	const char *outPath = NULL;
+	std::vector<std::string> inputs;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+			g_includeDirs.push_back(argv[++i]);
+		else if (strncmp(argv[i], "-I", 2) == 0 && argv[i][2] != '\0')
+			g_includeDirs.push_back(argv[i] + 2);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else
+			inputs.push_back(argv[i]);
+	}
+	if (outPath == NULL || inputs.empty()) {
+		fprintf(stderr, "usage: %s [-I dir]... -o out.cpp file.cl...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::vector<std::string> sources(inputs.size());
+	for (size_t i = 0; i < inputs.size(); i++) {
+		std::vector<std::string> stack;
+		if (!expand(inputs[i], stack, sources[i]))
+			return EXIT_FAILURE;
+	}
+
+	FILE *fp = fopen(outPath, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "clembed: cannot write %s\n", outPath);
+		return EXIT_FAILURE;
+	}
+	fprintf(fp, "// Generated by clembed from");
+	for (size_t i = 0; i < inputs.size(); i++)
+		fprintf(fp, " %s", inputs[i].c_str());
+	fprintf(fp, ", do not edit\n#include <opencl++.h>\n\n");
+	for (size_t i = 0; i < sources.size(); i++) {
+		fprintf(fp, "static constexpr char clembedSource%u[] =\n", (unsigned) i);
+		writeLiteral(fp, sources[i]);
+		fprintf(fp, ";\n\n");
+	}
+	fprintf(fp, "static const CLEmbeddedSource clembedSources[] = {\n");
+	for (size_t i = 0; i < sources.size(); i++)
+		fprintf(fp, "\t{ \"%s\", clembedSource%u, sizeof(clembedSource%u) - 1, 0x%016llxULL },\n",
+			baseName(inputs[i]).c_str(), (unsigned) i, (unsigned) i, hash64(sources[i]));
+	fprintf(fp, "};\n\nstatic CLEmbeddedSourceRegistrar clembedRegistrar(clembedSources, %u);\n", (unsigned) sources.size());
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "clembed: cannot write %s\n", outPath);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
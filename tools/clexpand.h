@@ -0,0 +1,114 @@
+/*
+ File: clexpand.h
+ Expansion of the quoted #include directives of OpenCL C sources, shared by clembed and clprecompile
+ so that both produce, and hash, the same source text.
+*/
+#ifndef _CLEXPAND_H_
+#define _CLEXPAND_H_
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static std::vector<std::string> g_includeDirs;
+
+static bool readFile(const std::string &path, std::string &contents)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (fp == NULL)
+		return false;
+	char buf[4096];
+	size_t n;
+	contents.clear();
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		contents.append(buf, n);
+	fclose(fp);
+	return true;
+}
+
+static std::string dirName(const std::string &path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+static std::string baseName(const std::string &path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// File name of a #include "name" line, empty for any other line
+static std::string quotedInclude(const std::string &line)
+{
+	size_t i = line.find_first_not_of(" \t");
+	if (i == std::string::npos || line[i] != '#')
+		return "";
+	i = line.find_first_not_of(" \t", i + 1);
+	if (i == std::string::npos || line.compare(i, 7, "include") != 0)
+		return "";
+	i = line.find_first_not_of(" \t", i + 7);
+	if (i == std::string::npos || line[i] != '"')
+		return "";
+	size_t end = line.find('"', i + 1);
+	return end == std::string::npos ? "" : line.substr(i + 1, end - i - 1);
+}
+
+// Appends path to out with its quoted includes expanded in place. #line directives keep the
+// compiler's messages pointing at the original files. stack detects include cycles.
+static bool expand(const std::string &path, std::vector<std::string> &stack, std::string &out)
+{
+	for (size_t i = 0; i < stack.size(); i++) {
+		if (stack[i] == path) {
+			fprintf(stderr, "include cycle through %s\n", path.c_str());
+			return false;
+		}
+	}
+	std::string contents;
+	if (!readFile(path, contents)) {
+		fprintf(stderr, "cannot read %s\n", path.c_str());
+		return false;
+	}
+	stack.push_back(path);
+	char lineDirective[64];
+	out += "#line 1 \"" + baseName(path) + "\"\n";
+	size_t lineStart = 0;
+	int lineNumber = 1;
+	while (lineStart < contents.size()) {
+		size_t lineEnd = contents.find('\n', lineStart);
+		if (lineEnd == std::string::npos)
+			lineEnd = contents.size();
+		std::string line = contents.substr(lineStart, lineEnd - lineStart);
+		std::string include = quotedInclude(line);
+		if (include.empty()) {
+			out += line;
+			out += '\n';
+		}
+		else {
+			// relative to the including file first, then the -I directories
+			std::string resolved = dirName(path) + "/" + include;
+			FILE *fp = fopen(resolved.c_str(), "rb");
+			for (size_t d = 0; fp == NULL && d < g_includeDirs.size(); d++) {
+				resolved = g_includeDirs[d] + "/" + include;
+				fp = fopen(resolved.c_str(), "rb");
+			}
+			if (fp == NULL) {
+				fprintf(stderr, "%s:%d: cannot find %s\n", path.c_str(), lineNumber, include.c_str());
+				stack.pop_back();
+				return false;
+			}
+			fclose(fp);
+			if (!expand(resolved, stack, out)) {
+				stack.pop_back();
+				return false;
+			}
+			snprintf(lineDirective, sizeof(lineDirective), "#line %d \"", lineNumber + 1);
+			out += lineDirective + baseName(path) + "\"\n";
+		}
+		lineStart = lineEnd + 1;
+		lineNumber++;
+	}
+	stack.pop_back();
+	return true;
+}
+
+#endif /* _CLEXPAND_H_ */
@@ -0,0 +1,105 @@
+/*
+ File: clprecompile.cpp
+ Offline kernel compiler: builds OpenCL C files for every device found (or those selected with
+ -type and -platform) and writes their binaries into one bundle file. A program created with
+ CLProgram(ctx, "file.cl") then loads its binary from the bundle (CLProgram::loadBundle or env
+ OPENCLPP_BUNDLE) instead of compiling at startup, when the options, the device name, the driver
+ version and, for an embedded source, the source hash match. Quoted #include directives are
+ expanded as clembed does (relative to the including file, then the -I directories), so that the
+ bundle matches the sources clembed embeds from the same files.
+ compilation:
+ Windows:
+ cl /EHsc -I ..\include clprecompile.cpp ..\src\opencl++.cpp ..\lib\Win32\OpenCL.lib
+ Linux:
+ g++ -std=c++11 -I ../include clprecompile.cpp ../src/opencl++.cpp -lOpenCL -pthread -o clprecompile
+ usage:
+ clprecompile [-I dir]... [-options "build options"] [-type cpu|gpu|accelerator|all] [-platform name] -o bundle.clb file.cl...
+ e.g. on a host with a CPU ICD like pocl:
+ clprecompile -options "-D CONFIG_USE_DOUBLE" -type cpu -o DotProduct.clb DotProduct.cl
+*/
+#include <opencl++.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "clexpand.h"
+
+int main(int argc, char **argv)
+{
+	const char *options = NULL;
+	const char *outPath = NULL;
+	const char *platformName = NULL;
+	cl_device_type devType = CL_DEVICE_TYPE_ALL;
+	int firstFile = argc;
+	for(int i = 1;i < argc;i++) {
+		if(strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+			g_includeDirs.push_back(argv[++i]);
+		else if(strncmp(argv[i], "-I", 2) == 0 && argv[i][2] != '\0')
+			g_includeDirs.push_back(argv[i] + 2);
+		else if(strcmp(argv[i], "-options") == 0 && i + 1 < argc)
+			options = argv[++i];
+		else if(strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else if(strcmp(argv[i], "-platform") == 0 && i + 1 < argc)
+			platformName = argv[++i];
+		else if(strcmp(argv[i], "-type") == 0 && i + 1 < argc) {
+			i++;
+			devType = strcmp(argv[i], "cpu") == 0 ? CL_DEVICE_TYPE_CPU
+				: strcmp(argv[i], "gpu") == 0 ? CL_DEVICE_TYPE_GPU
+				: strcmp(argv[i], "accelerator") == 0 ? CL_DEVICE_TYPE_ACCELERATOR : CL_DEVICE_TYPE_ALL;
+		}
+		else {
+			firstFile = i;
+			break;
+		}
+	}
+	if(outPath == NULL || firstFile >= argc) {
+		fprintf(stderr, "usage: %s [-I dir]... [-options \"build options\"] [-type cpu|gpu|accelerator|all] [-platform name] -o bundle.clb file.cl...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// Load and expand all the sources first: a missing file fails before any compilation
+	int numFiles = argc - firstFile;
+	std::vector<std::string> sources(numFiles);
+	int status = EXIT_SUCCESS;
+	for(int f = 0;f < numFiles;f++) {
+		std::vector<std::string> stack;
+		if(!expand(argv[firstFile + f], stack, sources[f]))
+			status = EXIT_FAILURE;
+	}
+
+	CLPlatform::setDiscoveryFilter(devType, platformName);
+	const CLPlatform *platforms = CLPlatform::getAllPlatforms();
+	cl_uint numPlatforms = CLPlatform::numPlatforms();
+	CLBundleWriter writer;
+	cl_uint numDevices = 0;
+	for(cl_uint i = 0;status == EXIT_SUCCESS && i < numPlatforms;i++) {
+		for(cl_uint j = 0;j < platforms[i].numDevices();j++) {
+			const CLDevice *device = &platforms[i].devices()[j];
+			CLContext ctx(device, 1);
+			numDevices++;
+			for(int f = 0;f < numFiles;f++) {
+				const char *source = sources[f].c_str();
+				size_t length = sources[f].size();
+				CLProgram program(&ctx, 1, &source, &length);
+				if(program.build(options) == NULL || writer.add(&program, baseName(argv[firstFile + f]).c_str(), options) != CL_SUCCESS) {
+					fprintf(stderr, "%s: %s: build failed (%d)\n", device->name(), argv[firstFile + f], program.ciErrNum());
+					status = EXIT_FAILURE;
+					continue;
+				}
+				printf("%s (%s): %s\n", device->name(), device->driverVersion(), argv[firstFile + f]);
+			}
+		}
+	}
+	if(status == EXIT_SUCCESS && numDevices == 0) {
+		fprintf(stderr, "no OpenCL device found\n");
+		status = EXIT_FAILURE;
+	}
+	if(status == EXIT_SUCCESS && !writer.write(outPath)) {
+		fprintf(stderr, "cannot write %s\n", outPath);
+		status = EXIT_FAILURE;
+	}
+	if(status == EXIT_SUCCESS)
+		printf("%u binaries written to %s\n", writer.numEntries(), outPath);
+
+	return status;
+}